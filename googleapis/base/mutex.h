@@ -70,7 +70,11 @@ class PThreadCondVar {
     struct timespec ts;
     gettimeofday(&tv, NULL);
     ts.tv_sec = tv.tv_sec + millis / 1000;
-    ts.tv_nsec = millis % 1000;
+    ts.tv_nsec = tv.tv_usec * 1000 + (millis % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
     int result = pthread_cond_timedwait(&cv_, &mu->mutex_, &ts);
     if (!result) return true;
 
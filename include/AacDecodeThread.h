@@ -31,6 +31,7 @@ public:
 private:
 	INT_PCM pcm_buffer_[2048 * 2];  // Max 2048 samples * 2 channels
 	HANDLE_AACDECODER decoder_;
+	size_t frame_pcm_size_;
 
 	DISALLOW_COPY_AND_ASSIGN(AacDecodeThread);
 };
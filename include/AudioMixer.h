@@ -11,14 +11,21 @@
 #ifndef AUDIOMIXER_H_
 #define AUDIOMIXER_H_
 
+#include "LatencyTrace.h"
+#include "PcmConvert.h"
+#include "time_util.h"
 #include "util.h"
 
 #include <alsa/asoundlib.h>
+#include <atomic>
 #include <glog/logging.h>
 #include <pthread.h>
 
 namespace iqurius {
 
+// The mixer output is stereo 16 bit at this rate.
+static constexpr uint32_t OUTPUT_SAMPLE_RATE = 44100;
+
 template<class T, std::size_t sz>
 class FFRingBuffer {
 public:
@@ -58,14 +65,71 @@ private:
 	DISALLOW_COPY_AND_ASSIGN(FFRingBuffer);
 };
 
+class BorrowedBufferPool;
 class AudioBuffer {
 public:
-	AudioBuffer(size_t size) : size_(size), data_len_(0) {
+	AudioBuffer(size_t size)
+	    : size_(size),
+	      data_len_(0),
+	      channels_(2),
+	      sample_rate_(OUTPUT_SAMPLE_RATE),
+	      encoding_(ENCODING_PCM_S16),
+	      pool_(nullptr) {
 		buffer_ = new uint8_t[size];
+		trace_.reset();
+	}
+	// A buffer without storage of its own, see borrow().
+	explicit AudioBuffer(BorrowedBufferPool* pool)
+	    : size_(0),
+	      data_len_(0),
+	      channels_(2),
+	      sample_rate_(OUTPUT_SAMPLE_RATE),
+	      encoding_(ENCODING_PCM_S16),
+	      buffer_(nullptr),
+	      pool_(pool) {
+		trace_.reset();
+	}
+	virtual ~AudioBuffer() {
+		if (!pool_) {
+			delete [] buffer_;
+		}
+	}
+
+	void reset() {
+		data_len_ = 0;
+		channels_ = 2;
+		sample_rate_ = OUTPUT_SAMPLE_RATE;
+		encoding_ = ENCODING_PCM_S16;
+		trace_.reset();
+		if (pool_) {
+			buffer_ = nullptr;
+		}
 	}
-	virtual ~AudioBuffer() { delete [] buffer_; }
 
-	void reset() { data_len_ = 0; }
+	// Points a borrowed buffer at samples owned by the producer. The data
+	// must stay valid until the buffer is back in its pool.
+	void borrow(const uint8_t* data,
+			size_t len,
+			uint8_t channels,
+			uint32_t sample_rate = OUTPUT_SAMPLE_RATE) {
+		// Posted buffers are only read by the mixer.
+		buffer_ = const_cast<uint8_t*>(data);
+		data_len_ = len;
+		channels_ = channels;
+		sample_rate_ = sample_rate;
+	}
+	BorrowedBufferPool* getPool() const { return pool_; }
+
+	// Interleaved 16 bit samples, mono buffers are upmixed by the mixer.
+	uint8_t getChannels() const { return channels_; }
+	void setChannels(uint8_t channels) { channels_ = channels; }
+	size_t getFrameSize() const { return channels_ * 2; }
+	// Mono buffers below the output rate are upsampled by the mixer.
+	uint32_t getSampleRate() const { return sample_rate_; }
+	void setSampleRate(uint32_t sample_rate) { sample_rate_ = sample_rate; }
+	// IMA-ADPCM buffers hold whole blocks and are decoded by the mixer.
+	SampleEncoding getEncoding() const { return encoding_; }
+	void setEncoding(SampleEncoding encoding) { encoding_ = encoding; }
 
 	size_t getSize() const { return size_; }
 	size_t getDataLen() const { return data_len_; }
@@ -85,19 +149,82 @@ public:
 		return len;
 	}
 
+	BufferTrace& trace() { return trace_; }
+	const BufferTrace& trace() const { return trace_; }
+
 private:
 	const size_t size_;
 	size_t data_len_;
+	uint8_t channels_;
+	uint32_t sample_rate_;
+	SampleEncoding encoding_;
 	uint8_t* buffer_;
+	BorrowedBufferPool* const pool_;
+	BufferTrace trace_;
 
 	DISALLOW_COPY_AND_ASSIGN(AudioBuffer);
 };
 
+// Borrowed buffers of one producer. The mixer returns them here through
+// AudioChannel::releaseBuffer, the producer may reuse or free the
+// borrowed data once getOutstanding() drops to zero.
+class BorrowedBufferPool {
+public:
+	static constexpr size_t NUM_BUFFERS = 4;
+
+	BorrowedBufferPool() : outstanding_(0) {
+	  for (size_t idx = 0; idx < NUM_BUFFERS; ++idx) {
+		free_buffers_.enqueue(new AudioBuffer(this));
+	  }
+	}
+
+	~BorrowedBufferPool() {
+	  AudioBuffer* audio_buffer = nullptr;
+	  while (free_buffers_.dequeue(&audio_buffer)) {
+		delete audio_buffer;
+	  }
+	  if (outstanding_) {
+		LOG(ERROR) << outstanding_ << " borrowed buffers leaked.";
+	  }
+	}
+
+	AudioBuffer* getFreeBuffer() {
+	  AudioBuffer* audio_buffer = nullptr;
+	  if (free_buffers_.dequeue(&audio_buffer)) {
+		outstanding_++;
+	  }
+	  return audio_buffer;
+	}
+
+	void releaseBuffer(AudioBuffer* audio_buffer) {
+	  audio_buffer->reset();
+	  if (!free_buffers_.enqueue(audio_buffer)) {
+		LOG(ERROR) << "Unable to return borrowed buffer (pool mismatch?).";
+		return;
+	  }
+	  outstanding_--;
+	}
+
+	size_t getOutstanding() const { return outstanding_; }
+
+private:
+	FFRingBuffer<AudioBuffer, NUM_BUFFERS> free_buffers_;
+	std::atomic<size_t> outstanding_;
+	DISALLOW_COPY_AND_ASSIGN(BorrowedBufferPool);
+};
+
 class AudioChannel {
 public:
 	static constexpr size_t NUM_AUDIO_BUFFERS = 10;
 
-	AudioChannel(size_t audio_buffer_size) : volume_(0x100), idle_(true) {
+	AudioChannel(size_t audio_buffer_size)
+	    : volume_(0x100),
+	      idle_(true),
+	      queued_bytes_(0),
+	      underruns_(0),
+	      output_delay_(0),
+	      mixing_(false),
+	      flush_requested_(false) {
 	  for (size_t idx = 0; idx < NUM_AUDIO_BUFFERS; ++idx) {
 		AudioBuffer* audio_buffer = new AudioBuffer(audio_buffer_size);
 		free_audio_buffers_.enqueue(audio_buffer);
@@ -112,6 +239,10 @@ public:
 		  num_buffers++;
 	  }
 	  while (audio_buffers_.dequeue(&audio_buffer)) {
+		  if (audio_buffer->getPool()) {
+			  audio_buffer->getPool()->releaseBuffer(audio_buffer);
+			  continue;
+		  }
 		  delete audio_buffer;
 		  num_buffers++;
 	  }
@@ -132,6 +263,10 @@ public:
 		LOG(ERROR) << "Attempting to return a null buffer.";
 		return;
 	  }
+	  if (audio_buffer->getPool()) {
+		audio_buffer->getPool()->releaseBuffer(audio_buffer);
+		return;
+	  }
 	  audio_buffer->reset();
 	  if (!free_audio_buffers_.enqueue(audio_buffer)) {
 		LOG(ERROR) << "Unable to return buffer (channel mismatch?).";
@@ -155,9 +290,34 @@ public:
 		return false;
 	  }
 	  idle_ = false;
-	  return audio_buffers_.enqueue(audio_buffer);
+	  audio_buffer->trace().posted_us = timeGetTimeUs();
+	  size_t data_len = audio_buffer->getDataLen();
+	  if (!audio_buffers_.enqueue(audio_buffer)) {
+		return false;
+	  }
+	  queued_bytes_ += data_len;
+	  return true;
 	}
 
+	// Number of bytes posted to the channel that the mixer has not played yet.
+	size_t getQueuedBytes() const { return queued_bytes_; }
+
+	// Number of times the mixer ran out of data in the middle of a block.
+	uint32_t getUnderruns() const { return underruns_; }
+
+	// Frames between the mixer input and the DAC, the mix block plus the
+	// ALSA queue.
+	uint32_t getOutputDelay() const { return output_delay_; }
+
+	// Latency of the buffers played on this channel, updated by the mixer.
+	LatencyTrace* getLatencyTrace() { return &latency_trace_; }
+
+	// Drops every buffer posted to the channel, the one the mixer is
+	// playing included, and returns borrowed buffers to their pools. Waits
+	// at most timeout_ms for the mixer to let go of them, false when it did
+	// not.
+	bool flush(uint32_t timeout_ms);
+
 	void waitForIdle() {
 	  int max_wait_cnt = 0;
 	  while (!idle_ && max_wait_cnt < 10) {  // Max wait 1s
@@ -167,10 +327,27 @@ public:
 	}
 
 private:
+	friend class AudioMixer;
+
+	void consumed(size_t len) { queued_bytes_ -= len; }
+	void underrun() { underruns_++; }
+	void setOutputDelay(uint32_t frames) { output_delay_ = frames; }
+	// Only the mixer thread takes buffers out of the queue while it runs.
+	void setMixing(bool mixing) { mixing_ = mixing; }
+	bool flushRequested() const { return flush_requested_; }
+	void flushed() { flush_requested_ = false; }
+	void dropQueued();
+
 	FFRingBuffer<AudioBuffer, NUM_AUDIO_BUFFERS> free_audio_buffers_;
 	FFRingBuffer<AudioBuffer, NUM_AUDIO_BUFFERS> audio_buffers_;
 	int16_t volume_;
 	volatile bool idle_;
+	std::atomic<size_t> queued_bytes_;
+	std::atomic<uint32_t> underruns_;
+	std::atomic<uint32_t> output_delay_;
+	std::atomic<bool> mixing_;
+	std::atomic<bool> flush_requested_;
+	LatencyTrace latency_trace_;
 	DISALLOW_COPY_AND_ASSIGN(AudioChannel);
 };
 
@@ -186,14 +363,44 @@ public:
 	AudioChannel* getAudioChannel(size_t channel_no);
 
 	static constexpr size_t AUDIO_BUFFER_SIZE = 4*4410;  // 100ms
+	// The mixer consumes channel buffers in blocks of this many frames, so
+	// channels can post buffers of any size up to AUDIO_BUFFER_SIZE.
+	static constexpr size_t MIX_BLOCK_FRAMES = 882;  // 20ms
 protected:
 	void playPcm(const uint8_t* buffer, size_t size);
 
 private:
-	static const AudioBuffer* SILENCE;
+	// Mixer side read position in a channel.
+	struct ChannelState {
+		AudioBuffer* buffer;
+		size_t offset;
+		bool active;
+		// Trace of the first buffer that started in the current block,
+		// completed once the block is written to ALSA.
+		BufferTrace trace;
+		size_t trace_frame;
+		bool trace_pending;
+		// Linear interpolation between prev_sample and next_sample for
+		// buffers below the output rate, phase is 16.16 fixed point.
+		uint32_t phase;
+		int16_t prev_sample;
+		int16_t next_sample;
+		// The current IMA-ADPCM block of the buffer, decoded.
+		int16_t decoded[IMA_ADPCM_BLOCK_SAMPLES];
+		size_t decoded_len;
+		size_t decoded_pos;
+	};
 
 	static void* threadProc(void *);
 	void run();
+	void enableTimestamps();
+	void updateOutputDelay();
+	void traceBlock(ChannelState* channel_state);
+	void finishBuffer(AudioChannel* channel, ChannelState* state);
+	size_t mixChannel(AudioChannel* channel,
+			ChannelState* state,
+			int32_t* accumulator,
+			size_t frames);
 
 	bool running_;
 	bool signal_stop_;
@@ -204,6 +411,8 @@ private:
 	AudioChannel** channels_;
 	snd_pcm_t *pcm_handle_;
 	int dbg_handle_;
+	snd_pcm_uframes_t pcm_buffer_size_;
+	bool pcm_tstamp_;
 	DISALLOW_COPY_AND_ASSIGN(AudioMixer);
 };
 
@@ -0,0 +1,99 @@
+/*
+ * BlockCodec.h
+ *
+ *  Created on: Jun 24, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#ifndef BLOCKCODEC_H_
+#define BLOCKCODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace iqurius {
+
+// How a container block is stored. The ids are part of the v2 container
+// format, never renumber them.
+enum BlockCodec {
+	CODEC_STORED = 0,
+	CODEC_LZO1X = 1,
+	// Same as the block of the installed file, nothing is stored.
+	CODEC_UNCHANGED = 2,
+	// LZO1X of the XOR with the block of the installed file.
+	CODEC_XOR_LZO1X = 3,
+	CODEC_LZ4 = 4,
+	CODEC_ZSTD = 5,
+	CODEC_COUNT
+};
+
+// How the codec of each block is picked when compressing. Blocks that do
+// not shrink are always stored.
+enum CodecPolicy {
+	// LZO1X, the only codec of version 1 containers.
+	POLICY_LZO,
+	POLICY_LZ4,
+	POLICY_ZSTD,
+	// Nothing is compressed.
+	POLICY_STORE,
+	// The smallest result of every codec built in.
+	POLICY_BEST_RATIO,
+	// The codec that decodes fastest on the device, LZ4 when built in.
+	POLICY_FASTEST_DECODE,
+};
+
+// Codecs that need the installed file to rebuild the block.
+inline bool isDeltaCodec(BlockCodec codec) {
+	return codec == CODEC_UNCHANGED || codec == CODEC_XOR_LZO1X;
+}
+
+const char* codecName(BlockCodec codec);
+// Whether the codec was built in, LZ4 and zstd are optional.
+bool codecAvailable(BlockCodec codec);
+// Parses the policy names of the --codec_policy flag: lzo, lz4, zstd,
+// store, ratio and decode.
+bool parseCodecPolicy(const char* name, CodecPolicy* policy);
+
+// Worst case size of a compressed block of len bytes, any codec.
+inline size_t compressedBound(size_t len) {
+	return len + len / 16 + 64 + 3;
+}
+
+// Size of the scratch memory compressBlock() needs, one per thread.
+size_t compressWorkMemory();
+
+// Compresses input into output, output_len is the buffer size on entry.
+bool compressBlock(BlockCodec codec,
+		const uint8_t* input, size_t input_len,
+		uint8_t* output, size_t* output_len,
+		uint8_t* work_memory);
+
+// Compresses input with the codec the policy picks, *codec is
+// CODEC_STORED and output unused when the block does not shrink. scratch
+// holds a compressedBound(input_len) candidate for the policies that try
+// several codecs.
+bool compressBlockWithPolicy(CodecPolicy policy,
+		const uint8_t* input, size_t input_len,
+		uint8_t* output, size_t* output_len,
+		BlockCodec* codec,
+		uint8_t* work_memory,
+		uint8_t* scratch);
+
+// Decodes a block that has to expand to exactly output_len bytes. Delta
+// codecs decode to the XOR with the installed block, see xorBlock().
+bool decompressBlock(BlockCodec codec,
+		const uint8_t* input, size_t input_len,
+		uint8_t* output, size_t output_len);
+
+// XORs the first base_len bytes of data with base, the rest is left as is.
+void xorBlock(uint8_t* data, const uint8_t* base, size_t base_len);
+
+// Fast checksum of the stored bytes of a block, CRC-32.
+uint32_t blockChecksum(const uint8_t* data, size_t len);
+
+} /* namespace iqurius */
+
+#endif /* BLOCKCODEC_H_ */
@@ -0,0 +1,180 @@
+/*
+ * BlockPool.h
+ *
+ *  Created on: Jun 22, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#ifndef BLOCKPOOL_H_
+#define BLOCKPOOL_H_
+
+#include "BlockCodec.h"
+#include "util.h"
+
+#include <deque>
+#include <googleapis/base/mutex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+namespace iqurius {
+
+// Runs container blocks through a pool of worker threads. Blocks come out
+// of takeCompleted() in the order they were submitted, so the result does
+// not depend on how many threads did the work.
+class BlockPool {
+public:
+	struct Block {
+		uint8_t* input_;
+		size_t input_len_;
+		// Where the input is read from when it is not copied into input_,
+		// e.g. a block of a mapped container.
+		const uint8_t* source_;
+		uint8_t* output_;
+		size_t output_len_;
+		// The same block of the installed file for delta compression.
+		uint8_t* base_;
+		size_t base_len_;
+		BlockCodec codec_;
+		uint32_t checksum_;
+		// Version 1 containers have no block checksums.
+		bool has_checksum_;
+		uint32_t base_checksum_;
+		bool failed_;
+	};
+
+	virtual ~BlockPool();
+
+	// Sizes the pool to about bytes of block buffers, with at least one
+	// block per thread and one more to fill. Call it before start().
+	void setMemoryBudget(size_t bytes);
+	bool start();
+	void stop();
+
+	// Returns an empty block to fill, or NULL when every block is in flight.
+	// The oldest block has to be taken out with takeCompleted() first then.
+	Block* getFreeBlock();
+	// Queues a filled block for processing.
+	void submit(Block* block);
+	// Returns the oldest submitted block once it is processed, NULL when no
+	// block is in flight. When wait is false it also returns NULL while the
+	// oldest block is still being worked on.
+	Block* takeCompleted(bool wait);
+	void releaseBlock(Block* block);
+
+	size_t threads() const { return threads_.size(); }
+	size_t blockSize() const { return input_size_; }
+protected:
+	BlockPool(size_t threads,
+			size_t input_size,
+			size_t output_size,
+			size_t base_size);
+
+	// Called on the worker threads, state comes from createThreadState().
+	virtual bool processBlock(Block* block, uint8_t* state) = 0;
+	virtual uint8_t* createThreadState() { return NULL; }
+private:
+	struct Slot {
+		Block block_;
+		bool done_;
+	};
+
+	static void* threadProc(void* arg);
+	void processBlocks();
+
+	size_t input_size_;
+	size_t output_size_;
+	size_t base_size_;
+	size_t num_threads_;
+	std::vector<pthread_t> threads_;
+	std::vector<Slot> slots_;
+	googleapis::Mutex mutex_;
+	googleapis::CondVar queued_cond_;
+	googleapis::CondVar done_cond_;
+	std::vector<Slot*> free_;
+	std::deque<Slot*> queued_;
+	std::deque<Slot*> in_flight_;
+	bool stopping_;
+	DISALLOW_COPY_AND_ASSIGN(BlockPool);
+};
+
+// Compresses the input of each block into its output with the codec the
+// policy picks, each thread with its own work memory. Blocks that do not
+// shrink are stored as they are. With delta set, blocks that match base_
+// are marked unchanged, and with xor_blocks set the XOR with base_ is
+// compressed too and kept if it comes out smaller.
+class CompressionPool : public BlockPool {
+public:
+	CompressionPool(size_t threads, size_t block_size)
+		: BlockPool(threads, block_size, compressedBound(block_size), 0),
+		  policy_(POLICY_LZO),
+		  delta_(false),
+		  xor_blocks_(false) {
+	}
+	CompressionPool(size_t threads,
+			size_t block_size,
+			CodecPolicy policy,
+			bool delta,
+			bool xor_blocks)
+		: BlockPool(threads, block_size, compressedBound(block_size),
+				delta ? block_size : 0),
+		  policy_(policy),
+		  delta_(delta),
+		  xor_blocks_(xor_blocks) {
+	}
+	virtual ~CompressionPool() { stop(); }
+
+	static bool compressed(const Block* block) {
+		return block->codec_ != CODEC_STORED;
+	}
+	static const uint8_t* data(const Block* block) {
+		return compressed(block) ? block->output_ : block->input_;
+	}
+	static size_t dataLen(const Block* block) {
+		return compressed(block) ? block->output_len_ : block->input_len_;
+	}
+protected:
+	virtual bool processBlock(Block* block, uint8_t* work_memory);
+	virtual uint8_t* createThreadState();
+private:
+	bool compressDelta(Block* block, uint8_t* state);
+
+	CodecPolicy policy_;
+	bool delta_;
+	bool xor_blocks_;
+	DISALLOW_COPY_AND_ASSIGN(CompressionPool);
+};
+
+// Checks and decodes container blocks. The caller sets the codec, the
+// expected checksum of the input and the decoded length in output_len_.
+// Delta blocks also need the installed block in base_, which is checked
+// against base_checksum_ before it is used.
+class DecompressionPool : public BlockPool {
+public:
+	DecompressionPool(size_t threads, size_t block_size)
+		: BlockPool(threads, block_size, block_size, 0) {
+	}
+	DecompressionPool(size_t threads, size_t block_size, bool delta)
+		: BlockPool(threads, block_size, block_size, delta ? block_size : 0) {
+	}
+	virtual ~DecompressionPool() { stop(); }
+
+	// Stored blocks are not copied, their data stays in the input.
+	static const uint8_t* data(const Block* block) {
+		if (block->codec_ != CODEC_STORED) {
+			return block->output_;
+		}
+		return block->source_ ? block->source_ : block->input_;
+	}
+protected:
+	virtual bool processBlock(Block* block, uint8_t* state);
+private:
+	DISALLOW_COPY_AND_ASSIGN(DecompressionPool);
+};
+
+} /* namespace iqurius */
+
+#endif /* BLOCKPOOL_H_ */
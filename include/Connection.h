@@ -36,6 +36,9 @@ public:
 	Message sendWithReplyAndBlock(const RemoteMethod& method, int timeout_msec);
 	void send(const RemoteMethod& method, int timeout_msec,
 			googleapis::Callback1<Message*>* cb);
+	// Drops a pending reply callback passed to send(). The callback is
+	// deleted without being called.
+	void cancel(googleapis::Callback1<Message*>* cb);
 	void addObject(ObjectBase* object);
 	void removeObject(const ObjectBase* object);
 
@@ -0,0 +1,57 @@
+/*
+ * ContainerSource.h
+ *
+ *  Created on: Jun 26, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#ifndef CONTAINERSOURCE_H_
+#define CONTAINERSOURCE_H_
+
+#include "util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace iqurius {
+
+// Read access to an update container. The file is mapped when the
+// filesystem allows it so blocks are decoded straight out of the page
+// cache, otherwise it is read with pread() into the caller's buffer.
+// Containers on removable media are never mapped, an I/O error there has
+// to fail a read instead of killing the process with SIGBUS.
+class ContainerSource {
+public:
+	explicit ContainerSource(const std::string& path);
+	~ContainerSource();
+
+	// Opens the container, tries to map it when use_mmap is set and the
+	// container is not on removable media.
+	bool open(bool use_mmap);
+	void close();
+
+	uint64_t size() const { return size_; }
+	bool mapped() const { return NULL != map_; }
+
+	// Returns len bytes at offset, pointing into the mapping or into
+	// scratch, which has to hold len bytes. Returns NULL on errors.
+	const uint8_t* read(uint64_t offset, size_t len, uint8_t* scratch);
+	// Starts reading the range ahead of its use.
+	void willNeed(uint64_t offset, size_t len);
+	// The range has been consumed, its pages can go.
+	void dontNeed(uint64_t offset, size_t len);
+private:
+	std::string path_;
+	int fd_;
+	uint64_t size_;
+	uint8_t* map_;
+	DISALLOW_COPY_AND_ASSIGN(ContainerSource);
+};
+
+} /* namespace iqurius */
+
+#endif /* CONTAINERSOURCE_H_ */
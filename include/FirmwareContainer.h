@@ -11,20 +11,28 @@
 #ifndef FIRMWARECONTAINER_H_
 #define FIRMWARECONTAINER_H_
 
+#include "BlockPool.h"
 #include "util.h"
 
+#include <deque>
+#include <gcrypt.h>
 #include <list>
 #include <stdio.h>
 #include <string>
+#include <vector>
 
 namespace iqurius {
 
+class ContainerSource;
+class UpdateJournal;
+
 #define CONTAINER_MAGIC_NUMBER 0x57465149
+#define CONTAINER_MAGIC_NUMBER_V2 0x32465149
 
 constexpr int MAX_DIGEST_SIZE = 256 / 8;
 
 /*
- * Container structure:
+ * Container structure, version 1:
  *
  * MAGIC_NUMBER(4 bytes)
  * SHA-MANIFEST
@@ -48,11 +56,80 @@ constexpr int MAX_DIGEST_SIZE = 256 / 8;
  * [File compressed data 2]
  *
  * [File compressed data N]
+ *
+ * Container structure, version 2:
+ *
+ * MAGIC_NUMBER_V2(4 bytes)
+ *
+ * [Block data]
+ *      stored bytes of every block of every file, back to back
+ *
+ * [Manifest stored data]
+ *
+ * [Index]
+ *    [Entry 1] ... [Entry N], one per block in file order
+ *      offset(8 bytes)
+ *      stored_size(4 bytes)
+ *      uncompressed_size(4 bytes)
+ *      codec(1 byte)
+ *      checksum(4 bytes), CRC-32 of the stored bytes
+ *      base_checksum(4 bytes), CRC-32 of the installed block that delta
+ *          blocks are rebuilt from
+ *
+ * [Footer]
+ *      manifest_offset(8 bytes)
+ *      manifest_stored_size(4 bytes)
+ *      manifest_size(4 bytes)
+ *      manifest_codec(1 byte)
+ *      SHA-MANIFEST
+ *      index_offset(8 bytes)
+ *      index_entries(4 bytes)
+ *      index_entry_size(2 bytes)
+ *      block_size(4 bytes)
+ *      index_checksum(4 bytes), CRC-32 of the index
+ *      MAGIC_NUMBER_V2(4 bytes)
+ *
+ * Every file is cut into block_size blocks, so the index entries of a file
+ * follow from the file sizes in the manifest. Readers skip index entry
+ * bytes past the fields they know about.
+ *
+ * Delta containers rebuild blocks from the file they replace: unchanged
+ * blocks store nothing and are copied from the installed file, diffed
+ * blocks store the compressed XOR with the installed block.
  */
+struct ContainerBlock {
+	uint64_t offset_;
+	uint32_t stored_len_;
+	uint32_t len_;
+	uint8_t codec_;
+	uint32_t checksum_;
+	uint32_t base_checksum_;
+};
+
 class FirmwareContainerWriter {
 public:
 	FirmwareContainerWriter(const char* version)
-		: version_(version) {
+		: version_(version),
+		  threads_(1),
+		  format_version_(1),
+		  codec_policy_(POLICY_LZO),
+		  delta_xor_(false) {
+	}
+
+	// Number of threads compressing blocks, the output does not depend on it.
+	void setThreads(size_t threads) { threads_ = threads ? threads : 1; }
+	// Devices read the update with the firmware they already run, keep
+	// writing version 1 until every device in the field reads version 2.
+	void setFormatVersion(int version) { format_version_ = version; }
+	// How the codec of each block is picked. Anything but POLICY_LZO needs
+	// version 2 and a device that decodes the codecs it picks.
+	void setCodecPolicy(CodecPolicy policy) { codec_policy_ = policy; }
+	// Builds a delta against the installed files found in base_dir under
+	// their archive paths, version 2 only. Changed blocks are also diffed
+	// against the installed block when xor_blocks is set.
+	void setDeltaBase(const char* base_dir, bool xor_blocks) {
+		delta_base_ = base_dir;
+		delta_xor_ = xor_blocks;
 	}
 
 	bool addFile(const char* path,
@@ -72,31 +149,106 @@ private:
 	};
 
 	bool serializeManifest(uint8_t* buffer, size_t* buffer_len);
-	bool calculateFileDigest(const char* path, uint8_t* digest);
-	bool compressFile(const FileInfo& file_info,
+	bool writeManifest(FILE* output, uint64_t* bytes_written);
+	bool compressFile(FileInfo* file_info,
 			FILE* output,
-			uint8_t* input_buffer,
-			size_t input_buffer_len,
-			uint8_t* output_buffer,
-			size_t output_buffer_len,
-			uint8_t* work_mem);
+			CompressionPool* pool,
+			uint64_t* bytes_written);
+	bool writeBlock(const BlockPool::Block* block,
+			FILE* output,
+			uint64_t* bytes_written);
+	bool writeTrailer(FILE* output,
+			CompressionPool* pool,
+			uint64_t* bytes_written);
 
 	std::string version_;
+	size_t threads_;
+	int format_version_;
+	CodecPolicy codec_policy_;
+	std::string delta_base_;
+	bool delta_xor_;
 	std::list<FileInfo> manifest_;
+	std::vector<ContainerBlock> blocks_;
+	uint32_t codec_blocks_[CODEC_COUNT];
 	DISALLOW_COPY_AND_ASSIGN(FirmwareContainerWriter);
 };
 
 class FirmwareContainerReader {
 public:
 	FirmwareContainerReader(const char* path)
-        : container_path_(path) {
+        : container_path_(path),
+          readback_(false),
+          direct_io_(true),
+          use_mmap_(true),
+          threads_(1),
+          memory_budget_(0),
+          format_version_(0),
+          block_size_(0),
+          files_offset_(0),
+          delta_(false),
+          journal_blocks_(0) {
 	}
 
+	// Decompresses and hashes every file without writing anything. Fails
+	// on delta containers, which need the installed files.
 	bool verifyFiles();
+	// Same for delta containers, which rebuild blocks from the installed
+	// files found under the same paths performUpdate() writes to.
+	bool verifyFiles(const char* flash_path, const char* storage_path);
 	bool loadManifest();
+	// Extracts and verifies the files in a single pass over the container.
 	bool performUpdate(const char* flash_path, const char* storage_path);
+	// Reads every extracted file back from the media after syncing it and
+	// checks the digest again.
+	void setReadback(bool readback) { readback_ = readback; }
+	// Writes the files with O_DIRECT where the filesystem supports it.
+	void setDirectIo(bool direct_io) { direct_io_ = direct_io; }
+	// Maps the container instead of reading it when the filesystem allows.
+	void setUseMmap(bool use_mmap) { use_mmap_ = use_mmap; }
+	// Records the progress of performUpdate() in a journal on the storage
+	// partition every blocks blocks, so an update interrupted by a power
+	// loss resumes from the last record. 0 disables the journal.
+	void setJournalInterval(uint32_t blocks) { journal_blocks_ = blocks; }
+	// Threads decoding blocks while the next ones are read and the decoded
+	// ones hashed and written.
+	void setThreads(size_t threads) { threads_ = threads ? threads : 1; }
+	// Bytes of block buffers to read ahead with, 0 keeps two blocks per
+	// thread. The pool never goes below one block per thread plus one.
+	void setMemoryBudget(size_t bytes) { memory_budget_ = bytes; }
+	int formatVersion() const { return format_version_; }
+	// True when some files are rebuilt from the installed ones.
+	bool isDelta() const { return delta_; }
 private:
-	bool deserializeManifest(uint8_t* buffer, size_t buffer_len);
+	struct FileInfo;
+	struct BlockStream;
+
+	bool deserializeManifest(const uint8_t* buffer, size_t buffer_len);
+	bool loadIndex(ContainerSource* source,
+			uint8_t* compressed_buffer,
+			uint8_t* output_buffer,
+			uint8_t* manifest_digest,
+			uint32_t* manifest_len);
+	bool mapBlocks();
+	bool openInstalledFile(const FileInfo& file_info,
+			const char* flash_path,
+			const char* storage_path,
+			int* fd);
+	void startFile(BlockStream* stream,
+			const FileInfo& file_info,
+			int base_fd,
+			uint32_t block);
+	bool queueFileBlock(BlockStream* stream, BlockPool::Block* block);
+	bool nextFileBlock(BlockStream* stream,
+			const uint8_t** data,
+			uint32_t* len);
+	bool skipFileBlocks(ContainerSource* source,
+			uint64_t* offset,
+			uint32_t blocks);
+	uint64_t resumeFile(const UpdateJournal& journal,
+			uint32_t file_index,
+			const FileInfo& file_info,
+			const std::string& file_path,
+			gcry_md_hd_t hd);
 	void revertUpdate(const char* flash_path, const char* storage_path);
 	bool checksumFile(const std::string& file_path, const uint8_t* checksum);
 
@@ -105,11 +257,47 @@ private:
 		uint64_t file_size_;
 		bool to_storage_;
 		uint8_t digest_[MAX_DIGEST_SIZE];
+		uint32_t first_block_;
+		uint32_t block_count_;
+		bool has_delta_;
+	};
+
+	// The blocks of one file on their way through the decompression pool.
+	// Blocks are read and queued as slots free up, so the container and
+	// the installed file are read while earlier blocks are decoded and
+	// written.
+	struct BlockStream {
+		DecompressionPool* pool_;
+		ContainerSource* source_;
+		const FileInfo* file_info_;
+		int base_fd_;
+		// The next block record to read, version 1 containers.
+		uint64_t offset_;
+		uint32_t next_block_;
+		bool queued_all_;
+		// Handed out by nextFileBlock(), released by the next call.
+		BlockPool::Block* current_;
+		// The container offset past each queued block.
+		std::deque<uint64_t> ends_;
+		// The container is read up to here by the blocks handed out.
+		uint64_t consumed_;
 	};
 
 	std::string container_path_;
 	std::string version_;
 	std::list<FileInfo> manifest_;
+	bool readback_;
+	bool direct_io_;
+	bool use_mmap_;
+	size_t threads_;
+	size_t memory_budget_;
+	int format_version_;
+	uint32_t block_size_;
+	uint64_t files_offset_;
+	uint8_t manifest_digest_[MAX_DIGEST_SIZE];
+	bool delta_;
+	uint32_t journal_blocks_;
+	std::vector<ContainerBlock> blocks_;
 	DISALLOW_COPY_AND_ASSIGN(FirmwareContainerReader);
 };
 
@@ -0,0 +1,65 @@
+/*
+ * FlashWriter.h
+ *
+ *  Created on: Jun 29, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#ifndef FLASHWRITER_H_
+#define FLASHWRITER_H_
+
+#include "util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace iqurius {
+
+// Writes a file to the SD card in large aligned chunks, bypassing the page
+// cache with O_DIRECT where the filesystem supports it, and makes it
+// durable with fdatasync() when it is finished.
+class FlashWriter {
+public:
+	FlashWriter(size_t buffer_size, bool direct_io);
+	~FlashWriter();
+
+	bool open(const std::string& path);
+	// Keeps the first offset bytes of an existing file and writes after
+	// them.
+	bool openAt(const std::string& path, uint64_t offset);
+	bool write(const uint8_t* data, size_t len);
+	// Makes everything written so far durable, the file stays open.
+	bool sync();
+	// Writes the tail, syncs the data and closes the file.
+	bool finish();
+	// Closes the file without syncing it.
+	void abort();
+
+	// Whether the file is still written with O_DIRECT, the unaligned tail
+	// and filesystems that refuse it fall back to buffered writes.
+	bool directIo() const { return direct_; }
+	uint64_t bytesWritten() const { return bytes_written_; }
+
+	// Makes renames and unlinks in the directory durable.
+	static bool syncDirectory(const std::string& path);
+private:
+	bool writeBuffer(size_t len);
+
+	std::string path_;
+	size_t buffer_size_;
+	bool direct_io_;
+	bool direct_;
+	int fd_;
+	uint8_t* buffer_;
+	size_t buffered_;
+	uint64_t bytes_written_;
+	DISALLOW_COPY_AND_ASSIGN(FlashWriter);
+};
+
+} /* namespace iqurius */
+
+#endif /* FLASHWRITER_H_ */
@@ -0,0 +1,107 @@
+/*
+ * LatencyTrace.h
+ *
+ *  Created on: Jun 2, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#ifndef LATENCYTRACE_H_
+#define LATENCYTRACE_H_
+
+#include "util.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace iqurius {
+
+// Timestamps in microseconds (timeGetTimeUs) of the first sample in an
+// audio buffer as it moves from the transport to the DAC. Zero means the
+// point was not recorded, e.g. prompts are never read from a socket.
+struct BufferTrace {
+	uint64_t read_us;
+	uint64_t decoded_us;
+	uint64_t posted_us;
+	uint64_t pulled_us;
+	uint64_t written_us;
+	uint64_t audible_us;
+
+	void reset() {
+		read_us = 0;
+		decoded_us = 0;
+		posted_us = 0;
+		pulled_us = 0;
+		written_us = 0;
+		audible_us = 0;
+	}
+};
+
+// Histogram with power of two buckets. Samples are added by a single
+// thread, the statistics can be read from any thread.
+class LatencyHistogram {
+public:
+	static constexpr size_t NUM_BUCKETS = 24;  // Last bucket is >= 4.2s
+
+	LatencyHistogram() { reset(); }
+
+	void add(uint32_t latency_us);
+	void reset();
+
+	uint32_t count() const { return count_; }
+	uint32_t max() const { return max_us_; }
+	uint32_t average() const;
+	// Upper bound of the bucket containing the given percentile, at most
+	// the largest sample.
+	uint32_t percentile(uint32_t percent) const;
+
+	std::string toString() const;
+
+private:
+	std::atomic<uint32_t> buckets_[NUM_BUCKETS];
+	std::atomic<uint32_t> count_;
+	std::atomic<uint64_t> sum_us_;
+	std::atomic<uint32_t> max_us_;
+
+	DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+};
+
+// Per stage latency of the buffers played on one mixer channel.
+class LatencyTrace {
+public:
+	enum EStage {
+		STAGE_DECODE,   // read -> decoded
+		STAGE_FILL,     // decoded -> posted to the channel
+		STAGE_QUEUE,    // posted -> pulled by the mixer
+		STAGE_MIX,      // pulled -> written to ALSA
+		STAGE_OUTPUT,   // written -> played by the DAC
+		STAGE_TOTAL,    // first recorded point -> played by the DAC
+		NUM_STAGES
+	};
+
+	LatencyTrace() {}
+
+	void record(const BufferTrace& trace);
+	void reset();
+	const LatencyHistogram& getHistogram(EStage stage) const {
+		return stages_[stage];
+	}
+	// Writes one line per stage with samples to the log.
+	void dump(const char* name) const;
+
+	static const char* stageName(EStage stage);
+
+private:
+	void addInterval(EStage stage, uint64_t start_us, uint64_t end_us);
+
+	LatencyHistogram stages_[NUM_STAGES];
+
+	DISALLOW_COPY_AND_ASSIGN(LatencyTrace);
+};
+
+} /* namespace iqurius */
+
+#endif /* LATENCYTRACE_H_ */
@@ -14,16 +14,31 @@
 #include "ObjectPath.h"
 #include "util.h"
 
+#include <googleapis/base/callback.h>
+#include <string>
+
 namespace dbus {
 
 class Connection;
 class MediaTransportProperties;
+class Message;
+class MessageArgumentBuilder;
 
 class MediaTransport {
 public:
+	// Called with success, fd, read MTU and write MTU.
+	typedef googleapis::Callback4<bool, int, int, int> OnAcquireCallback;
+	typedef googleapis::Callback1<bool> OnResultCallback;
+
 	MediaTransport(Connection* connection, const ObjectPath& path)
 	    : connection_(connection),
-	      path_(path) {
+	      path_(path),
+	      acquire_cb_(NULL),
+	      acquire_reply_cb_(NULL),
+	      acquire_timeout_msec_(-1) {
+	}
+	~MediaTransport() {
+		cancelAcquire();
 	}
 
 	bool getProperties(MediaTransportProperties* property_bag);
@@ -32,17 +47,51 @@ public:
     		int* read_mtu,
     		int* write_mtu);
     bool release(const char* accesstype);
+    // Non blocking versions, the callbacks run from the D-Bus dispatch once
+    // the reply arrives or timeout_msec expires.
+    void acquireAsync(const char* access_type,
+    		int timeout_msec,
+    		OnAcquireCallback* cb);
+    void releaseAsync(const char* access_type,
+    		int timeout_msec,
+    		OnResultCallback* cb);
+    // Forget a pending acquireAsync() request, its callback is not called.
+    void cancelAcquire();
+    bool isAcquiring() const { return acquire_cb_ != NULL; }
+    // Only the Delay property is writable.
     bool setProperty(const char* property_name,
     		const MediaTransportProperties& property_bag);
+    void setPropertyAsync(const char* property_name,
+    		const MediaTransportProperties& property_bag,
+    		int timeout_msec,
+    		OnResultCallback* cb);
 private:
 	static const char* INTERFACE;
 	static const char* GETPROPERTIES_METHOD;
 	static const char* ACQUIRE_METHOD;
 	static const char* RELEASE_METHOD;
 	static const char* SETPROPERTY_METHOD;
+	static const char* DELAY_PROPERTY;
+
+	void onAcquireReply(Message* reply);
+	static bool parseAcquireReply(Message* reply,
+			int* fd,
+			int* read_mtu,
+			int* write_mtu);
+	static bool appendProperty(const char* property_name,
+			const MediaTransportProperties& property_bag,
+			MessageArgumentBuilder* args);
+	static void onMethodReply(const char* method,
+			OnResultCallback* cb,
+			Message* reply);
 
 	Connection* connection_;
 	ObjectPath path_;
+	OnAcquireCallback* acquire_cb_;
+	googleapis::Callback1<Message*>* acquire_reply_cb_;
+	// Kept to release a transport whose acquire reply is unusable.
+	std::string acquire_access_type_;
+	int acquire_timeout_msec_;
 	DISALLOW_COPY_AND_ASSIGN(MediaTransport);
 };
 
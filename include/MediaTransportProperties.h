@@ -54,6 +54,11 @@ public:
 		return delay_;
 	}
 
+	// Transport delay in 1/10 of a millisecond.
+	void setDelay(unsigned short delay) {
+		delay_ = delay;
+	}
+
 	bool isInboundRingtones() const {
 		return inbound_ringtones_;
 	}
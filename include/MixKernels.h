@@ -0,0 +1,91 @@
+/*
+ * MixKernels.h
+ *
+ *  Created on: Jun 10, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#ifndef MIXKERNELS_H_
+#define MIXKERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Inner loops of the mixer, shared with the prompt benchmark in mkprompts.
+// Volume is 8.8 fixed point, samples are accumulated in 32 bits.
+// The loops are scalar on purpose: the ARM1176 of the Pi Zero has no NEON
+// to write vector kernels for, and ADPCM decoding is sequential anyway.
+// Hosts with SIMD get whatever the compiler vectorizes.
+namespace iqurius {
+
+static inline int16_t clip(int32_t value) {
+  if (value > 0x7fff)
+	return 0x7fff;
+  if (value < -0x7fff)
+	return -0x7fff;
+  return (int16_t)value;
+}
+
+static inline void mixSamples(int32_t* accumulator,
+		const int16_t* samples,
+		size_t num_samples,
+		int16_t volume) {
+  for (size_t idx = 0; idx < num_samples; ++idx) {
+    accumulator[idx] += ((int32_t)samples[idx] * volume) >> 8;
+  }
+}
+
+// Adds each mono sample to both the left and the right output.
+static inline void mixMonoSamples(int32_t* accumulator,
+		const int16_t* samples,
+		size_t num_frames,
+		int16_t volume) {
+  for (size_t idx = 0; idx < num_frames; ++idx) {
+    int32_t sample = ((int32_t)samples[idx] * volume) >> 8;
+    accumulator[idx * 2] += sample;
+    accumulator[idx * 2 + 1] += sample;
+  }
+}
+
+// Upsamples mono samples to the output rate and adds them to both outputs.
+// Returns the number of input frames consumed, output frames are limited
+// by *num_frames which is set to the frames produced.
+static inline size_t mixUpsampledSamples(int32_t* accumulator,
+		const int16_t* samples,
+		size_t num_samples,
+		size_t* num_frames,
+		uint32_t step,
+		uint32_t* phase,
+		int16_t* prev_sample,
+		int16_t* next_sample,
+		int16_t volume) {
+  size_t consumed = 0;
+  size_t idx = 0;
+
+  for (; idx < *num_frames; ++idx) {
+    while (*phase >= 0x10000) {
+      if (consumed == num_samples) {
+        goto exit;
+      }
+      *prev_sample = *next_sample;
+      *next_sample = samples[consumed++];
+      *phase -= 0x10000;
+    }
+    int32_t sample = *prev_sample +
+    		((((int32_t)*next_sample - *prev_sample) * (int32_t)*phase) >> 16);
+    sample = (sample * volume) >> 8;
+    accumulator[idx * 2] += sample;
+    accumulator[idx * 2 + 1] += sample;
+    *phase += step;
+  }
+exit:
+  *num_frames = idx;
+  return consumed;
+}
+
+} /* namespace iqurius */
+
+#endif /* MIXKERNELS_H_ */
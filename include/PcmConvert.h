@@ -0,0 +1,61 @@
+/*
+ * PcmConvert.h
+ *
+ *  Created on: Jun 9, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#ifndef PCMCONVERT_H_
+#define PCMCONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace iqurius {
+
+// How the samples of a buffer or a prompt are stored.
+enum SampleEncoding {
+	ENCODING_PCM_S16,
+	// Mono IMA-ADPCM in blocks of IMA_ADPCM_BLOCK_BYTES.
+	ENCODING_IMA_ADPCM,
+};
+
+static constexpr size_t IMA_ADPCM_BLOCK_BYTES = 256;
+// The header holds the first sample, every byte two more.
+static constexpr size_t IMA_ADPCM_BLOCK_SAMPLES =
+		1 + (IMA_ADPCM_BLOCK_BYTES - 4) * 2;
+
+// Decodes a whole Ogg Vorbis file into interleaved 16 bit samples.
+bool decodeVorbisFile(const char* path,
+		std::vector<int16_t>* pcm,
+		uint8_t* channels,
+		uint32_t* sample_rate);
+
+// Converts interleaved 16 bit samples in place to sample_rate. Sources
+// with more than two channels, or any source when mono is set, are
+// folded to mono.
+bool normalizePcm(std::vector<int16_t>* pcm,
+		uint8_t* channels,
+		uint32_t* sample_rate,
+		uint32_t out_sample_rate,
+		bool mono);
+
+// Encodes mono samples into IMA-ADPCM blocks, the last block is padded
+// with silence.
+void imaAdpcmEncode(const int16_t* samples,
+		size_t num_samples,
+		std::vector<uint8_t>* blocks);
+// Decodes a single block into IMA_ADPCM_BLOCK_SAMPLES samples.
+size_t imaAdpcmDecodeBlock(const uint8_t* block, int16_t* samples);
+// Decodes all blocks.
+void imaAdpcmDecode(const uint8_t* blocks,
+		size_t len,
+		std::vector<int16_t>* samples);
+
+} /* namespace iqurius */
+
+#endif /* PCMCONVERT_H_ */
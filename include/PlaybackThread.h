@@ -12,15 +12,38 @@
 #define PLAYBACKTHREAD_H_
 
 #include "AudioMixer.h"
+#include "LatencyTrace.h"
 #include "MediaTransport.h"
 #include "util.h"
 
+#include <atomic>
+#include <googleapis/base/mutex.h>
 #include <soxr.h>
 #include <pthread.h>
 
 namespace dbus {
 
 class ObjectPath;
+
+// Counters for one streaming session, reset when the transport is acquired.
+struct PlaybackStats {
+  uint64_t bytes_in;
+  uint32_t packets_in;
+  uint32_t frames_decoded;
+  uint32_t decode_errors;
+  uint32_t concealed_frames;
+  uint32_t config_changes;
+  uint32_t bitpool;  // Of the last SBC frame, 0 for other codecs.
+  uint32_t buffer_waits;
+  uint64_t buffer_wait_us;
+  uint32_t first_packet_time;
+  uint32_t last_packet_time;
+
+  void reset();
+  // Average bits per second of the received stream.
+  uint32_t bitrate() const;
+};
+
 class PlaybackThread {
 public:
   enum ECodecID {
@@ -34,7 +57,6 @@ public:
 		  int sampling_rate);
   virtual ~PlaybackThread() {
     stop();
-    delete [] audo_channel_buffer_;
     if (resampler_) {
     	soxr_delete(resampler_);
     }
@@ -44,17 +66,51 @@ public:
   virtual ECodecID codecId() const = 0;
   void playPcm(const uint8_t* buffer, size_t size);
 
+  // Requests the transport from BlueZ without blocking, streaming starts
+  // once the transport fd arrives.
   void start();
   void stop();
 
   bool ok() const { return running_ && decoding_ok_; }
+  bool isStarting() const { return transport_.isAcquiring(); }
+
+  // Milliseconds from start() until the first buffer reached the mixer,
+  // or 0 if nothing was played yet.
+  uint32_t timeToFirstAudio() const { return time_to_first_audio_; }
+  // Mixer underruns during the fast start ramp and in total.
+  uint32_t earlyUnderruns() const { return early_underruns_; }
+  uint32_t underruns() const { return underruns_; }
+  // Measured decode to speaker delay in 1/10 ms, the unit of the A2DP
+  // Delay transport property.
+  uint32_t pipelineDelay() const { return pipeline_delay_; }
+
+  PlaybackStats stats() const;
+  // Time to decode one codec frame.
+  const iqurius::LatencyHistogram& decodeTimeHistogram() const {
+	return decode_time_;
+  }
+
+protected:
+  // Statistics reported by the codecs from decode().
+  void frameDecoded(uint64_t decode_start_us);
+  void decodeError();
+  void configChanged(uint32_t bitpool);
+  // Plays silence in place of frames that could not be decoded.
+  void concealFrames(size_t frames, size_t frame_bytes);
 
 private:
   iqurius::AudioBuffer* waitForFreeBuffer();
   void freeTransport();
-  bool acqureTransport();
+  void onTransportAcquired(bool success, int fd, int read_mtu, int write_mtu);
   void postBuffer(iqurius::AudioBuffer*);
+  void releasePreroll();
   void flush();
+  size_t depthTarget() const;
+  size_t fillTarget() const;
+  void updatePipelineDelay();
+  void reportDelay();
+  void packetReceived(size_t size);
+  void logStats();
 
   bool running_;
   bool signal_stop_;
@@ -67,13 +123,26 @@ private:
   int write_mtu_;
   int sampling_rate_;
   iqurius::AudioChannel* audio_channel_;
-  uint8_t* audo_channel_buffer_;
-  size_t audo_buffer_len_;
+  iqurius::AudioBuffer* current_buffer_;
   soxr_t resampler_;
   bool in_preroll_;
   static constexpr int preroll_size_ = iqurius::AudioChannel::NUM_AUDIO_BUFFERS - 4;
   iqurius::AudioBuffer* preroll_[preroll_size_];
   size_t preroll_filled_;
+  size_t preroll_bytes_;
+  uint32_t start_time_;
+  uint32_t first_audio_time_;
+  uint32_t time_to_first_audio_;
+  uint32_t channel_underruns_;
+  uint32_t early_underruns_;
+  uint32_t underruns_;
+  std::atomic<uint32_t> pipeline_delay_;
+  uint32_t reported_delay_;
+  uint32_t delay_report_token_;
+  uint64_t packet_read_us_;
+  mutable googleapis::Mutex stats_mutex_;
+  PlaybackStats stats_;
+  iqurius::LatencyHistogram decode_time_;
 
   static void* threadProc(void *);
   void run();
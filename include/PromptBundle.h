@@ -0,0 +1,123 @@
+/*
+ * PromptBundle.h
+ *
+ *  Created on: Jun 6, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#ifndef PROMPTBUNDLE_H_
+#define PROMPTBUNDLE_H_
+
+#include "util.h"
+
+#include <list>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace iqurius {
+
+#define PROMPT_BUNDLE_MAGIC_NUMBER 0x50515149
+
+class SoundFragment;
+
+/*
+ * Bundle structure, all values little endian:
+ *
+ * [Header]
+ *   MAGIC_NUMBER(4 bytes)
+ *   version(4 bytes)
+ *   num_prompts(4 bytes)
+ *   alignment(4 bytes)
+ *
+ * [Index]
+ *   num_prompts entries of
+ *     name(64 bytes, zero padded file name without directory)
+ *     offset(4 bytes, multiple of alignment)
+ *     size(4 bytes)
+ *     channels(4 bytes)
+ *     sample_rate(4 bytes)
+ *
+ * [PCM data 1]
+ *   signed 16 bit interleaved samples, padded up to alignment
+ * ...
+ * [PCM data N]
+ */
+struct PromptBundleHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_prompts;
+	uint32_t alignment;
+};
+
+struct PromptBundleEntry {
+	static constexpr size_t MAX_NAME_LEN = 64;
+
+	char name[MAX_NAME_LEN];
+	uint32_t offset;
+	uint32_t size;
+	uint32_t channels;
+	uint32_t sample_rate;
+};
+
+// Read only mapping of a prompt bundle. Fragments returned by getFragment
+// point into the mapping, so the bundle must outlive them.
+class PromptBundle {
+public:
+	static constexpr uint32_t VERSION = 1;
+
+	PromptBundle()
+		: data_(nullptr),
+		  data_len_(0),
+		  index_(nullptr),
+		  num_prompts_(0) {
+	}
+	~PromptBundle() { close(); }
+
+	bool open(const char* path);
+	void close();
+	bool isOpen() const { return data_ != nullptr; }
+
+	// Looks up the prompt by file name, the directory part of the path is
+	// ignored. Returns nullptr if the bundle does not have the prompt.
+	SoundFragment* getFragment(const std::string& path) const;
+
+private:
+	uint8_t* data_;
+	size_t data_len_;
+	const PromptBundleEntry* index_;
+	uint32_t num_prompts_;
+
+	DISALLOW_COPY_AND_ASSIGN(PromptBundle);
+};
+
+class PromptBundleWriter {
+public:
+	static constexpr uint32_t ALIGNMENT = 4096;
+
+	PromptBundleWriter() {}
+
+	bool addPrompt(const char* name,
+			const uint8_t* pcm_data,
+			size_t pcm_len,
+			uint32_t channels,
+			uint32_t sample_rate);
+	bool writeBundle(const char* path);
+private:
+	struct PromptInfo {
+		std::string name_;
+		std::vector<uint8_t> pcm_;
+		uint32_t channels_;
+		uint32_t sample_rate_;
+	};
+
+	std::list<PromptInfo> prompts_;
+	DISALLOW_COPY_AND_ASSIGN(PromptBundleWriter);
+};
+
+} /* namespace iqurius */
+
+#endif /* PROMPTBUNDLE_H_ */
@@ -0,0 +1,103 @@
+/*
+ * PromptCache.h
+ *
+ *  Created on: Jun 4, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#ifndef PROMPTCACHE_H_
+#define PROMPTCACHE_H_
+
+#include "PcmConvert.h"
+#include "util.h"
+
+#include <googleapis/base/mutex.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace iqurius {
+
+class PromptBundle;
+class SoundFragment;
+
+// Decoded voice prompts shared by all queued playbacks. The least recently
+// used prompts are dropped once the decoded size exceeds the budget, a
+// fragment that is still playing stays alive until its last user lets go.
+// Prompts found in the prompt bundle are played from the mapping and do
+// not count against the budget.
+class PromptCache {
+public:
+	typedef std::shared_ptr<SoundFragment> FragmentPtr;
+
+	PromptCache();
+	explicit PromptCache(size_t budget_bytes);
+	~PromptCache();
+
+	// Returns the decoded prompt, decoding it on a miss. Returns an empty
+	// pointer if the file can not be decoded.
+	FragmentPtr get(const std::string& path);
+	// Returns the prompts rendered back to back with silence_ms between
+	// them. The rendering is cached under sequenceKey().
+	FragmentPtr getSequence(const std::vector<std::string>& paths,
+			uint32_t silence_ms);
+	static std::string sequenceKey(const std::vector<std::string>& paths,
+			uint32_t silence_ms);
+
+	// The bundle must outlive the cache.
+	void setBundle(const PromptBundle* bundle) { bundle_ = bundle; }
+	// How the prompt is kept once decoded, PCM unless set. Prompts played
+	// from the bundle stay PCM.
+	void setEncoding(const std::string& path, SampleEncoding encoding);
+
+	// Decodes the prompts on a background thread until the budget is full.
+	void startPreload(const std::vector<std::string>& paths);
+	void stopPreload();
+
+	size_t getCachedBytes() const;
+	uint32_t getHits() const { return hits_; }
+	uint32_t getMisses() const { return misses_; }
+
+private:
+	struct Entry {
+		FragmentPtr fragment;
+		size_t size;
+		std::list<std::string>::iterator lru_position;
+	};
+
+	static void* threadProc(void *);
+	void preload();
+	FragmentPtr lookup(const std::string& path);
+	SoundFragment* load(const std::string& path, size_t* size);
+	FragmentPtr insert(const std::string& path,
+			const FragmentPtr& fragment,
+			size_t size);
+	void evict();
+
+	const size_t budget_bytes_;
+	const PromptBundle* bundle_;
+	size_t cached_bytes_;
+	uint32_t hits_;
+	uint32_t misses_;
+	std::map<std::string, Entry> entries_;
+	std::map<std::string, SampleEncoding> encodings_;
+	std::list<std::string> lru_;  // Most recently used first.
+	mutable googleapis::Mutex mutex_;
+
+	std::vector<std::string> preload_paths_;
+	bool preload_running_;
+	volatile bool signal_stop_;
+	pthread_t thread_;
+
+	DISALLOW_COPY_AND_ASSIGN(PromptCache);
+};
+
+} /* namespace iqurius */
+
+#endif /* PROMPTCACHE_H_ */
@@ -27,8 +27,14 @@ public:
 	virtual void decode(const uint8_t* buffer, size_t size);
 	virtual ECodecID codecId() const { return E_SBC; }
 private:
+	static constexpr uint8_t SBC_SYNCWORD = 0x9c;
+
+	void checkFrameConfig(const uint8_t* frame, size_t size);
+
 	sbc_t codec_;
 	uint8_t pcm_buffer_[8192];
+	uint16_t frame_config_;
+	size_t frame_pcm_size_;
 
 	DISALLOW_COPY_AND_ASSIGN(SbcDecodeThread);
 };
@@ -11,12 +11,16 @@
 #ifndef SOUNDFRAGMENT_H_
 #define SOUNDFRAGMENT_H_
 
+#include "PcmConvert.h"
 #include "util.h"
 
+#include <vector>
+
 namespace iqurius {
 
 class AudioChannel;
 class AudioBuffer;
+class BorrowedBufferPool;
 class SoundFragment {
 public:
 	virtual ~SoundFragment();
@@ -24,17 +28,56 @@ public:
 	virtual const uint8_t* getBuffer() const { return sample_buffer_; }
 	virtual size_t getBufferSize() const = 0;
 	virtual uint8_t getChannels() const = 0;
-	virtual void playFragment(AudioChannel* audio_channel) = 0;
+	uint32_t getSampleRate() const { return sample_rate_; }
+	SampleEncoding getEncoding() const { return encoding_; }
+	// Posts borrowed buffers that point into the samples and returns once
+	// the mixer has released all of them. A cancelled fragment, or one the
+	// mixer stops playing, is dropped from the channel.
+	virtual void playFragment(AudioChannel* audio_channel);
 	void cancelPlayback() { cancel_playback_ = true; }
+	// Fragments are shared, a cancelled one has to be rearmed before it
+	// is played again.
+	void resetCancel() { cancel_playback_ = false; }
 
-	static SoundFragment* fromVorbisFile(const char* path);
+	// Converts the prompt to the mixer output format, or to mono at
+	// --prompt_sample_rate. Long prompts are streamed unless
+	// allow_streaming is false. IMA-ADPCM prompts are always mono.
+	static SoundFragment* fromVorbisFile(const char* path,
+			bool allow_streaming = true,
+			SampleEncoding encoding = ENCODING_PCM_S16);
+	// Renders the fragments one after the other into a new fragment, with
+	// silence_ms of silence between them. The fragments must hold their
+	// samples, see getBuffer().
+	static SoundFragment* concatenate(
+			const std::vector<const SoundFragment*>& fragments,
+			uint32_t silence_ms);
+	// The fragment plays the samples in place, the data must outlive it.
+	static SoundFragment* fromMemory(const uint8_t* data,
+			size_t len,
+			uint8_t channels,
+			uint32_t sample_rate);
 
 protected:
-	SoundFragment() : sample_buffer_(nullptr), cancel_playback_(false) {}
-	AudioBuffer* waitForFreeBuffer(AudioChannel* audio_channel);
+	// Tells a mixer that plays the channel from one that stopped, e.g.
+	// because the audio output could not be opened.
+	struct MixerProgress {
+		size_t queued_bytes_;
+		uint64_t changed_us_;
+		bool stalled_;
+	};
+
+	SoundFragment();
+	AudioBuffer* waitForFreeBuffer(AudioChannel* audio_channel,
+			MixerProgress* progress);
+	bool waitForMixer(AudioChannel* audio_channel, MixerProgress* progress);
+	void finishPlayback(AudioChannel* audio_channel, MixerProgress* progress);
 
 	uint8_t* sample_buffer_;
+	uint32_t sample_rate_;
+	SampleEncoding encoding_;
+	bool owns_buffer_;
 	bool cancel_playback_;
+	BorrowedBufferPool* borrowed_buffers_;
 private:
 	DISALLOW_COPY_AND_ASSIGN(SoundFragment);
 };
@@ -11,8 +11,14 @@
 #ifndef SOUNDMANAGER_H_
 #define SOUNDMANAGER_H_
 
+#include "PcmConvert.h"
+#include "PromptBundle.h"
 #include "util.h"
 
+#include <map>
+#include <string>
+#include <vector>
+
 namespace iqurius {
 
 class SoundManager {
@@ -39,7 +45,17 @@ public:
 	~SoundManager() {};
 
 	const char* getSoundPath(ESoundID sound_id) const;
+	// Paths of all prompts, in the order they should be preloaded.
+	std::vector<std::string> getSoundPaths() const;
+	// Prompts kept in a compact encoding once decoded, by path.
+	std::map<std::string, SampleEncoding> getSoundEncodings() const;
+	// The mapped prompt bundle, or nullptr if it could not be loaded.
+	const PromptBundle* getBundle() const {
+		return bundle_.isOpen() ? &bundle_ : nullptr;
+	}
 private:
+	PromptBundle bundle_;
+
 	DISALLOW_COPY_AND_ASSIGN(SoundManager);
 };
 
@@ -11,11 +11,15 @@
 #ifndef SOUNDQUEUE_H_
 #define SOUNDQUEUE_H_
 
+#include "LatencyTrace.h"
+#include "PromptCache.h"
 #include "util.h"
 
 #include <googleapis/base/mutex.h>
 #include <list>
 #include <pthread.h>
+#include <string>
+#include <vector>
 
 namespace iqurius {
 
@@ -23,63 +27,128 @@ class AudioChannel;
 class SoundFragment;
 class SoundQueue {
 public:
+	// Pending prompts play in priority order. A prompt preempts a playing
+	// prompt of lower priority.
+	enum EPriority {
+		PRIORITY_LOW,
+		PRIORITY_NORMAL,
+		PRIORITY_HIGH,
+	};
+
 	SoundQueue(AudioChannel* effect_audio_channel,
-			AudioChannel* music_audio_channel)
+			AudioChannel* music_audio_channel,
+			PromptCache* prompt_cache)
       : effect_audio_channel_(effect_audio_channel),
 		music_audio_channel_(music_audio_channel),
+		prompt_cache_(prompt_cache),
 		replay_(false),
 		auto_replay_(false),
 		running_(false),
 		signal_stop_(false),
+		fragment_playback_(false),
+		preempted_(false),
+		current_fragment_(nullptr),
 		thread_() {
 	}
 	~SoundQueue() {
 	  stop();
 	}
 
-	void scheduleFragment(const char* path, uint32_t repeat = 1, uint32_t delay = 0);
-	void replay() { replay_ = true; }
+	// delay is the pause between repeats in microseconds, gap_ms the pause
+	// after the message, -1 for --prompt_gap_ms. A prompt already pending
+	// with the same or higher priority absorbs the new one.
+	void scheduleFragment(const char* path,
+			uint32_t repeat = 1,
+			uint32_t delay = 0,
+			int32_t gap_ms = -1,
+			EPriority priority = PRIORITY_NORMAL);
+	void scheduleFragment(const char* path, EPriority priority) {
+		scheduleFragment(path, 1, 0, -1, priority);
+	}
+	// Plays the prompts as one fragment, with silence_ms between them.
+	void scheduleSequence(const std::vector<std::string>& paths,
+			uint32_t silence_ms = 0,
+			EPriority priority = PRIORITY_NORMAL);
+	void replay();
 	void autoReplay(bool auto_replay) { auto_replay_ = auto_replay; replay_ = auto_replay;}
 	void waitQueueEmpty();
 	void start();
 	void stop();
+
+	// Time from scheduleFragment until the prompt reaches the DAC.
+	const LatencyHistogram& getScheduleLatency() const {
+		return schedule_latency_;
+	}
 private:
+	class FragmentInfo;
+
 	static void* threadProc(void *);
 	void run();
+	void playFragment(FragmentInfo* fragment_info);
+	void waitFor(uint32_t time_ms);
+	void schedule(FragmentInfo* fragment_info);
+	bool makeRoom(EPriority priority);
 
 	class FragmentInfo
 	{
 	public:
-		FragmentInfo(const char* path, uint32_t repeat = 1, uint32_t delay = 0)
-		    : fragment_path_(path),
-			  fragment_(nullptr),
-			  repeat_num_(repeat),
-			  repeat_delay_(delay) {
-		}
-		~FragmentInfo();
+		FragmentInfo(const char* path,
+				uint32_t repeat,
+				uint32_t delay,
+				uint32_t gap_ms,
+				EPriority priority);
 
+		void setSequence(const std::vector<std::string>& parts,
+				uint32_t silence_ms);
+		PromptCache::FragmentPtr fetch(PromptCache* prompt_cache) const;
+		bool loaded() const { return fragment_ != nullptr; }
+		bool setFragment(const PromptCache::FragmentPtr& fragment);
 		void playFragment(AudioChannel*);
+		void cancel();
+		void rearm();
 
+		const std::string& path() const { return fragment_path_; }
+		EPriority priority() const { return priority_; }
 		uint32_t repeatLeft() const { return repeat_num_; }
 		uint32_t delay() const { return repeat_delay_; }
+		uint32_t gap() const { return gap_ms_; }
+		uint64_t scheduleTime() const { return schedule_time_us_; }
+		bool played() const { return played_; }
 	private:
 		std::string fragment_path_;
-		SoundFragment* fragment_;
+		// Prompts of a sequence, fragment_path_ is the sequence key.
+		std::vector<std::string> parts_;
+		uint32_t silence_ms_;
+		PromptCache::FragmentPtr fragment_;
 		uint32_t repeat_num_;
 		uint32_t repeat_delay_;
+		uint32_t gap_ms_;
+		EPriority priority_;
+		uint64_t schedule_time_us_;
+		bool played_;
 
 		DISALLOW_COPY_AND_ASSIGN(FragmentInfo);
 	};
 	std::list<FragmentInfo*> scheduled_fragments_;
 	AudioChannel* effect_audio_channel_;
 	AudioChannel* music_audio_channel_;
+	PromptCache* prompt_cache_;
 	bool replay_;
 	bool auto_replay_;
 	bool running_;
 	bool signal_stop_;
-	volatile bool fragment_playback_;
+	bool fragment_playback_;
+	// Set when a higher priority prompt cancels current_fragment_.
+	bool preempted_;
+	// The fragment being played or in its gap, guarded by mutex_.
+	FragmentInfo* current_fragment_;
 	pthread_t thread_;
 	googleapis::Mutex mutex_;
+	// Signaled when a fragment is scheduled, replayed or on stop.
+	googleapis::CondVar queue_cond_;
+	// Signaled when the queue is empty and nothing is playing.
+	googleapis::CondVar idle_cond_;
+	LatencyHistogram schedule_latency_;
 
 	DISALLOW_COPY_AND_ASSIGN(SoundQueue);
 };
@@ -0,0 +1,75 @@
+/*
+ * UpdateJournal.h
+ *
+ *  Created on: Jul 2, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#ifndef UPDATEJOURNAL_H_
+#define UPDATEJOURNAL_H_
+
+#include "util.h"
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace iqurius {
+
+#define UPDATE_JOURNAL_MAGIC_NUMBER 0x4A465149
+constexpr size_t JOURNAL_DIGEST_SIZE = 256 / 8;
+
+/*
+ * Progress of an update, so an update interrupted by a power loss resumes
+ * where it stopped instead of starting over.
+ *
+ * Journal file structure, all records are appended and synced:
+ *  MAGIC_NUMBER(4 bytes)
+ *  manifest digest(32 bytes), the container the progress belongs to
+ *  [Record 1] ... [Record N]
+ *    file index(4 bytes), in manifest order, 0xffffffff for the commit
+ *        record written once every file is complete
+ *    length(8 bytes), bytes of the .updated file that are on the media
+ *    digest(32 bytes), SHA-256 of those bytes
+ *    checksum(4 bytes), CRC-32 of the record, a torn record ends the log
+ */
+class UpdateJournal {
+public:
+	explicit UpdateJournal(const std::string& path);
+	~UpdateJournal();
+
+	// Loads the progress left by an interrupted update of the container
+	// with this manifest digest, starts an empty journal otherwise.
+	bool open(const uint8_t* manifest_digest);
+	// Every file was written and verified, only the renames are left.
+	bool committed() const { return committed_; }
+	// Last recorded length and digest of a file, false if there are none.
+	bool progress(uint32_t file, uint64_t* length, uint8_t* digest) const;
+	// The first length bytes of the file are durable and hash to digest.
+	bool record(uint32_t file, uint64_t length, const uint8_t* digest);
+	bool commit();
+	// The update is over, either way.
+	void remove();
+private:
+	struct Progress {
+		uint64_t length_;
+		uint8_t digest_[JOURNAL_DIGEST_SIZE];
+	};
+
+	bool load(const uint8_t* manifest_digest);
+	bool append(uint32_t file, uint64_t length, const uint8_t* digest);
+
+	std::string path_;
+	int fd_;
+	bool committed_;
+	std::map<uint32_t, Progress> progress_;
+	DISALLOW_COPY_AND_ASSIGN(UpdateJournal);
+};
+
+} /* namespace iqurius */
+
+#endif /* UPDATEJOURNAL_H_ */
@@ -15,5 +15,6 @@
 
 uint32_t timeGetTime();  // returns current time in milliseconds.
 uint32_t elapsedTime(uint32_t time);
+uint64_t timeGetTimeUs();  // returns monotonic time in microseconds.
 
 #endif /* TIME_UTIL_H_ */
@@ -9,6 +9,7 @@
  */
 
 #include "AacDecodeThread.h"
+#include "time_util.h"
 
 #include <glog/logging.h>
 #include <stdio.h>
@@ -19,7 +20,8 @@ AacDecodeThread::AacDecodeThread(Connection* connection,
 		const ObjectPath& path,
 		iqurius::AudioChannel* audio_channel,
 		int sampling_rate)
-    : PlaybackThread(connection, path, audio_channel, sampling_rate) {
+    : PlaybackThread(connection, path, audio_channel, sampling_rate),
+      frame_pcm_size_(0) {
 	decoder_ = aacDecoder_Open(TT_MP4_LATM_MCP1, 1);
 }
 
@@ -75,13 +77,20 @@ void AacDecodeThread::decode(const uint8_t* buffer, size_t size) {
     if (err != 0) {
 		LOG(WARNING) << "Decoder Fill err = " << err;
 	} else {
+		uint64_t decode_start_us = timeGetTimeUs();
 		err = aacDecoder_DecodeFrame(decoder_, pcm_buffer_, sizeof(pcm_buffer_), 0);
 		if (err != 0) {
-			LOG(WARNING) << "Decode Frame err = %d\n" << err;
+			LOG(WARNING) << "Decode Frame err = " << err;
+			decodeError();
+			if (frame_pcm_size_) {
+				concealFrames(1, frame_pcm_size_);
+			}
 		} else {
+			frameDecoded(decode_start_us);
 			CStreamInfo* info = aacDecoder_GetStreamInfo(decoder_);
 			const uint8_t* pcm_data = reinterpret_cast<const uint8_t*>(pcm_buffer_);
-			playPcm(pcm_data, info->numChannels * info->frameSize * sizeof(INT_PCM));
+			frame_pcm_size_ = info->numChannels * info->frameSize * sizeof(INT_PCM);
+			playPcm(pcm_data, frame_pcm_size_);
 		}
 	}
 }
@@ -9,6 +9,7 @@
  */
 
 #include "AudioMixer.h"
+#include "MixKernels.h"
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -21,19 +22,6 @@ DEFINE_bool(dbg_audio_output, false, "Write audio output to a file for debugging
 
 namespace iqurius {
 
-class SilenceAudioBuffer : public AudioBuffer {
-public:
-  SilenceAudioBuffer(size_t size) : AudioBuffer(size) {
-    memset(getData(), 0, size);
-    setDataSize(size);
-  }
-private:
-  DISALLOW_COPY_AND_ASSIGN(SilenceAudioBuffer);
-};
-
-static const SilenceAudioBuffer SILENCE_BUFFER(AudioMixer::AUDIO_BUFFER_SIZE);
-const AudioBuffer* AudioMixer::SILENCE = &SILENCE_BUFFER;
-
 int16_t AudioChannel::setVolume(int16_t value) {
   int16_t old_volume = volume_;
   if (value >= 0 && value <= 0x200) {
@@ -47,15 +35,46 @@ float AudioChannel::setVolume(float value) {
   return ((double)old_volume) / (double)0x100;
 }
 
+bool AudioChannel::flush(uint32_t timeout_ms) {
+  const uint64_t deadline_us = timeGetTimeUs() + (uint64_t)timeout_ms * 1000;
+
+  flush_requested_ = true;
+  while (flush_requested_) {
+    if (!mixing_) {
+      // Nothing else takes buffers out of the queue.
+      dropQueued();
+      flush_requested_ = false;
+      return true;
+    }
+    if (timeGetTimeUs() >= deadline_us) {
+      flush_requested_ = false;
+      LOG(ERROR) << "The mixer did not flush the audio channel.";
+      return false;
+    }
+    usleep(1000);
+  }
+  return true;
+}
+
+void AudioChannel::dropQueued() {
+  AudioBuffer* audio_buffer = nullptr;
+  while (audio_buffers_.dequeue(&audio_buffer)) {
+    consumed(audio_buffer->getDataLen());
+    releaseBuffer(audio_buffer);
+  }
+}
+
 AudioMixer::AudioMixer(size_t num_channels)
     : running_(false),
     signal_stop_(false),
+    idle_(true),
     thread_(),
     num_channels_(num_channels),
     channels_(nullptr),
     pcm_handle_(nullptr),
 	dbg_handle_(-1),
-	idle_(true) {
+	pcm_buffer_size_(0),
+	pcm_tstamp_(false) {
   CHECK(num_channels > 0);
   channels_ = new AudioChannel*[num_channels_];
   for (size_t idx = 0; idx < num_channels_; ++idx) {
@@ -119,7 +138,7 @@ void AudioMixer::start() {
           SND_PCM_FORMAT_S16_LE,
           SND_PCM_ACCESS_RW_INTERLEAVED,
           2,
-          44100,
+          OUTPUT_SAMPLE_RATE,
           0,
           250000);
     if (err < 0) {
@@ -127,6 +146,7 @@ void AudioMixer::start() {
       snd_pcm_close(pcm_handle_);
       pcm_handle_ = nullptr;
     } else {
+      enableTimestamps();
       signal_stop_ = false;
       idle_ = true;
       pthread_create(&thread_, NULL, threadProc, this);
@@ -140,131 +160,199 @@ void AudioMixer::start() {
   }
 }
 
+// Monotonic timestamps let the trace line up snd_pcm_htimestamp with
+// timeGetTimeUs.
+void AudioMixer::enableTimestamps() {
+  snd_pcm_uframes_t period_size;
+  snd_pcm_sw_params_t* sw_params = nullptr;
+
+  pcm_tstamp_ = false;
+  if (snd_pcm_get_params(pcm_handle_, &pcm_buffer_size_, &period_size) < 0) {
+	pcm_buffer_size_ = 0;
+	return;
+  }
+  if (snd_pcm_sw_params_malloc(&sw_params) < 0) {
+	return;
+  }
+  if (snd_pcm_sw_params_current(pcm_handle_, sw_params) >= 0 &&
+	  snd_pcm_sw_params_set_tstamp_mode(pcm_handle_, sw_params,
+			  SND_PCM_TSTAMP_ENABLE) >= 0 &&
+	  snd_pcm_sw_params_set_tstamp_type(pcm_handle_, sw_params,
+			  SND_PCM_TSTAMP_TYPE_MONOTONIC) >= 0 &&
+	  snd_pcm_sw_params(pcm_handle_, sw_params) >= 0) {
+	pcm_tstamp_ = true;
+  } else {
+	LOG(WARNING) << "Monotonic pcm timestamps are not supported, "
+			"the latency trace will use snd_pcm_delay.";
+  }
+  snd_pcm_sw_params_free(sw_params);
+}
+
 void* AudioMixer::threadProc(void *ctx) {
   AudioMixer* pThis = reinterpret_cast<AudioMixer*>(ctx);
   pThis->run();
   return NULL;
 }
 
-static inline int16_t clip(int32_t value) {
-  if (value > 0x7fff)
-	return 0x7fff;
-  if (value < -0x7fff)
-	return -0x7fff;
-  return (int16_t)value;
+// Returns the rest of the buffer to the channel.
+void AudioMixer::finishBuffer(AudioChannel* channel, ChannelState* state) {
+  channel->consumed(state->buffer->getDataLen() - state->offset);
+  channel->releaseBuffer(state->buffer);
+  state->buffer = nullptr;
 }
 
-void AudioMixer::run() {
-  AudioBuffer** mix_list = new AudioBuffer*[num_channels_];
-  AudioChannel** mix_channel_owner = new AudioChannel*[num_channels_];
-  AudioBuffer mix_buffer(AUDIO_BUFFER_SIZE);
-  constexpr size_t mix_buffer_len = AUDIO_BUFFER_SIZE / 2;
-  mix_buffer.setDataSize(mix_buffer_len * 2);
+size_t AudioMixer::mixChannel(AudioChannel* channel,
+		ChannelState* state,
+		int32_t* accumulator,
+		size_t frames) {
+  const int16_t volume = channel->getVolume();
+  size_t mixed = 0;
 
-  while(!signal_stop_) {
-    size_t num_mix_channels = 0;
-    for (size_t idx = 0; idx < num_channels_; ++idx) {
-      mix_channel_owner[num_mix_channels] = channels_[idx];
-      mix_list[num_mix_channels] = channels_[idx]->pullBuffer();
-      if (mix_list[num_mix_channels]) {
-        num_mix_channels++;
-      }
+  if (channel->flushRequested()) {
+    if (state->buffer) {
+      finishBuffer(channel, state);
     }
-    const AudioBuffer* play_buffer;
-    // Home heuristic optimizations
-    if (num_mix_channels == 0) {  // Nothing to mix, play silence
-      play_buffer = SILENCE;
-      idle_ = true;
-      //LOG(INFO) << "Mix silence";
-    } else if (num_mix_channels == 1) { // Only one channel
-      idle_ = false;
-      int16_t* mixed_samples = (int16_t *)mix_buffer.getData();
-      int16_t* buffer_samples = (int16_t *)mix_list[0]->getData();
-      size_t buffer_len = mix_list[0]->getDataLen() / 2;
-      int16_t channel_volume = mix_channel_owner[0]->getVolume();
-      int sample_no;
-
-      // Nothing to mix, just apply the volume correction
-      for (sample_no = 0; sample_no < buffer_len; ++sample_no) {
-        int32_t sample = ((int32_t)buffer_samples[sample_no] * channel_volume)
-        		>> 8;
-        mixed_samples[sample_no] = (int16_t)sample;
+    channel->dropQueued();
+    // A cut off stream is not an underrun.
+    state->active = false;
+    state->trace_pending = false;
+    channel->flushed();
+  }
+  while (mixed < frames) {
+    if (!state->buffer) {
+      state->buffer = channel->pullBuffer();
+      state->offset = 0;
+      state->decoded_len = 0;
+      state->decoded_pos = 0;
+      if (!state->buffer) {
+        break;
       }
-      // Fill with silence, if needed
-      for (; sample_no < mix_buffer_len; ++sample_no) {
-        mixed_samples[sample_no] = 0;
+      state->buffer->trace().pulled_us = timeGetTimeUs();
+      if (!state->active) {
+        // A new stream, do not interpolate from the previous one.
+        state->phase = 0x10000;
+        state->prev_sample = 0;
+        state->next_sample = 0;
       }
-      play_buffer = &mix_buffer;
-    } else if (num_mix_channels == 2) { // Two channels
-      idle_ = false;
-      int16_t* mixed_samples = (int16_t *)mix_buffer.getData();
-      size_t buffer_len1 = mix_list[0]->getDataLen() / 2;
-      size_t buffer_len2 = mix_list[1]->getDataLen() / 2;
-      int16_t* buffer_samples1;
-      int16_t* buffer_samples2;
-      int16_t channel_volume2;
-      int16_t channel_volume1;
-
-      // Make sure xxx1 point to the shortest channel
-      if (buffer_len2 < buffer_len1) {
-          buffer_len1 = mix_list[1]->getDataLen() / 2;
-          buffer_len2 = mix_list[0]->getDataLen() / 2;
-          buffer_samples1 = (int16_t *)mix_list[1]->getData();
-          buffer_samples2 = (int16_t *)mix_list[0]->getData();
-          channel_volume1 = mix_channel_owner[1]->getVolume();
-          channel_volume2 = mix_channel_owner[0]->getVolume();
-      } else {
-          buffer_samples1 = (int16_t *)mix_list[0]->getData();
-          buffer_samples2 = (int16_t *)mix_list[1]->getData();
-          channel_volume1 = mix_channel_owner[0]->getVolume();
-          channel_volume2 = mix_channel_owner[1]->getVolume();
+      if (!state->trace_pending) {
+        state->trace = state->buffer->trace();
+        state->trace_frame = mixed;
+        state->trace_pending = true;
       }
-
-      int sample_no;
-      // Mix up to the shortest channel
-      for (sample_no = 0; sample_no < buffer_len1; ++sample_no) {
-        int32_t sample;
-        sample = ((int32_t)buffer_samples1[sample_no] * channel_volume1) >> 8;
-        sample += ((int32_t)buffer_samples2[sample_no] * channel_volume2) >> 8;
-        mixed_samples[sample_no] = clip(sample);
+    }
+    AudioBuffer* buffer = state->buffer;
+    const bool adpcm = buffer->getEncoding() == ENCODING_IMA_ADPCM;
+    const size_t frame_size = buffer->getFrameSize();
+    const int16_t* samples;
+    size_t available;
+    if (adpcm) {
+      // Mono blocks, decoded one at a time as the mixer reaches them.
+      if (state->decoded_pos == state->decoded_len) {
+        if (state->offset + IMA_ADPCM_BLOCK_BYTES > buffer->getDataLen()) {
+          finishBuffer(channel, state);
+          continue;
+        }
+        state->decoded_len = imaAdpcmDecodeBlock(
+        		buffer->getData() + state->offset, state->decoded);
+        state->decoded_pos = 0;
+        state->offset += IMA_ADPCM_BLOCK_BYTES;
+        channel->consumed(IMA_ADPCM_BLOCK_BYTES);
       }
-      // Mix what is left from the longer channel
-      for (; sample_no < buffer_len2; ++sample_no) {
-        int32_t sample;
-        sample = ((int32_t)buffer_samples2[sample_no] * channel_volume2) >> 8;
-        mixed_samples[sample_no] = (int16_t)sample;
+      samples = state->decoded + state->decoded_pos;
+      available = state->decoded_len - state->decoded_pos;
+    } else {
+      samples = reinterpret_cast<const int16_t*>(
+    		  buffer->getData() + state->offset);
+      available = (buffer->getDataLen() - state->offset) / frame_size;
+    }
+    size_t consumed;
+    if (buffer->getSampleRate() != OUTPUT_SAMPLE_RATE &&
+        buffer->getChannels() == 1) {
+      size_t produced = frames - mixed;
+      consumed = mixUpsampledSamples(accumulator + mixed * 2,
+    		  samples, available, &produced,
+    		  ((uint64_t)buffer->getSampleRate() << 16) / OUTPUT_SAMPLE_RATE,
+    		  &state->phase, &state->prev_sample, &state->next_sample,
+    		  volume);
+      mixed += produced;
+    } else {
+      consumed = available;
+      if (consumed > frames - mixed) {
+        consumed = frames - mixed;
       }
-      // Fill the rest with silence
-      for (; sample_no < mix_buffer_len; ++sample_no) {
-        mixed_samples[sample_no] = 0;
+      if (buffer->getChannels() == 1) {
+        mixMonoSamples(accumulator + mixed * 2, samples, consumed, volume);
+      } else {
+        mixSamples(accumulator + mixed * 2, samples, consumed * 2, volume);
       }
-      play_buffer = &mix_buffer;
-    } else {  // Generic N channel mix
-      idle_ = false;
-      int16_t* mixed_samples = (int16_t *)mix_buffer.getData();
-      for (int sample_no = 0; sample_no < mix_buffer_len; ++sample_no) {
-        int32_t sample = 0;
-        for (int buffer_idx = 0; buffer_idx < num_mix_channels; ++buffer_idx) {
-          int16_t* buffer_samples = (int16_t *)mix_list[buffer_idx]->getData();
-          size_t buffer_len = mix_list[buffer_idx]->getDataLen() / 2;
-          int16_t channel_volume = mix_channel_owner[buffer_idx]->getVolume();
+      mixed += consumed;
+    }
+    if (adpcm) {
+      state->decoded_pos += consumed;
+    } else {
+      state->offset += consumed * frame_size;
+      channel->consumed(consumed * frame_size);
+      if (state->offset + frame_size > buffer->getDataLen()) {
+        finishBuffer(channel, state);
+      }
+    }
+  }
+  // The channel was playing, but the producer did not keep up.
+  if (state->active && mixed < frames) {
+    channel->underrun();
+  }
+  state->active = mixed == frames;
+  return mixed;
+}
 
-          if (sample_no < buffer_len) {
-            sample += ((int32_t)buffer_samples[sample_no] * channel_volume)
-            		>> 8;
-          }
-        }
-        mixed_samples[sample_no] = clip(sample);
+void AudioMixer::run() {
+  ChannelState* channel_state = new ChannelState[num_channels_];
+  int32_t* accumulator = new int32_t[MIX_BLOCK_FRAMES * 2];
+  int16_t* mixed_samples = new int16_t[MIX_BLOCK_FRAMES * 2];
+
+  for (size_t idx = 0; idx < num_channels_; ++idx) {
+    channel_state[idx].buffer = nullptr;
+    channel_state[idx].offset = 0;
+    channel_state[idx].active = false;
+    channel_state[idx].trace_pending = false;
+    channel_state[idx].phase = 0x10000;
+    channel_state[idx].prev_sample = 0;
+    channel_state[idx].next_sample = 0;
+    channel_state[idx].decoded_len = 0;
+    channel_state[idx].decoded_pos = 0;
+    channels_[idx]->setMixing(true);
+  }
+  while(!signal_stop_) {
+    size_t num_mix_channels = 0;
+
+    memset(accumulator, 0, MIX_BLOCK_FRAMES * 2 * sizeof(int32_t));
+    for (size_t idx = 0; idx < num_channels_; ++idx) {
+      if (mixChannel(channels_[idx], &channel_state[idx], accumulator,
+    		  MIX_BLOCK_FRAMES)) {
+        num_mix_channels++;
       }
-      play_buffer = &mix_buffer;
     }
-    playPcm(play_buffer->getData(), play_buffer->getDataLen());
-    for (size_t idx = 0; idx < num_mix_channels; ++idx) {
-      mix_channel_owner[idx]->releaseBuffer(mix_list[idx]);
+    // When nothing is mixed the accumulator is all zeros, play silence.
+    idle_ = num_mix_channels == 0;
+    for (size_t sample_no = 0; sample_no < MIX_BLOCK_FRAMES * 2; ++sample_no) {
+      mixed_samples[sample_no] = clip(accumulator[sample_no]);
     }
+    playPcm(reinterpret_cast<const uint8_t*>(mixed_samples),
+    		MIX_BLOCK_FRAMES * 4);
+    updateOutputDelay();
+    traceBlock(channel_state);
   }
-  delete [] mix_channel_owner;
-  delete [] mix_list;
+  for (size_t idx = 0; idx < num_channels_; ++idx) {
+    if (channel_state[idx].buffer) {
+      channels_[idx]->consumed(channel_state[idx].buffer->getDataLen() -
+    		  channel_state[idx].offset);
+      channels_[idx]->releaseBuffer(channel_state[idx].buffer);
+    }
+    channels_[idx]->setMixing(false);
+  }
+  delete [] mixed_samples;
+  delete [] accumulator;
+  delete [] channel_state;
 }
 
 void AudioMixer::playPcm(const uint8_t* buffer, size_t size) {
@@ -291,6 +379,60 @@ void AudioMixer::playPcm(const uint8_t* buffer, size_t size) {
   }
 }
 
+void AudioMixer::updateOutputDelay() {
+  snd_pcm_sframes_t pcm_delay = 0;
+
+  if (NULL == pcm_handle_ || snd_pcm_delay(pcm_handle_, &pcm_delay) < 0 ||
+	  pcm_delay < 0) {
+	pcm_delay = 0;
+  }
+  for (size_t idx = 0; idx < num_channels_; ++idx) {
+	channels_[idx]->setOutputDelay(pcm_delay + MIX_BLOCK_FRAMES);
+  }
+}
+
+// Completes the traces of the buffers that started in the block just
+// written. The first frame of the block plays after everything queued
+// in ALSA ahead of it.
+void AudioMixer::traceBlock(ChannelState* channel_state) {
+  uint64_t written_us = timeGetTimeUs();
+  uint64_t block_start_us = 0;
+  snd_pcm_sframes_t queued = -1;
+
+  if (NULL == pcm_handle_) {
+	return;
+  }
+  if (pcm_tstamp_) {
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t tstamp;
+	if (snd_pcm_htimestamp(pcm_handle_, &avail, &tstamp) >= 0 &&
+		avail <= pcm_buffer_size_ && (tstamp.tv_sec || tstamp.tv_nsec)) {
+	  block_start_us = (uint64_t)tstamp.tv_sec * 1000000 +
+			  tstamp.tv_nsec / 1000;
+	  queued = pcm_buffer_size_ - avail;
+	}
+  }
+  if (queued < 0) {
+	if (snd_pcm_delay(pcm_handle_, &queued) < 0 || queued < 0) {
+	  queued = 0;
+	}
+	block_start_us = written_us;
+  }
+  if (queued > (snd_pcm_sframes_t)MIX_BLOCK_FRAMES) {
+	block_start_us += (uint64_t)(queued - MIX_BLOCK_FRAMES) * 1000000 / 44100;
+  }
+  for (size_t idx = 0; idx < num_channels_; ++idx) {
+	ChannelState* state = &channel_state[idx];
+	if (state->trace_pending) {
+	  state->trace.written_us = written_us;
+	  state->trace.audible_us = block_start_us +
+			  (uint64_t)state->trace_frame * 1000000 / 44100;
+	  channels_[idx]->getLatencyTrace()->record(state->trace);
+	  state->trace_pending = false;
+	}
+  }
+}
+
 void AudioMixer::waitForIdle() {
   int max_wait_cnt = 0;
   while (!idle_ && max_wait_cnt < 50) {  // Max wait 5s
@@ -0,0 +1,280 @@
+/*
+ * BlockCodec.cpp
+ *
+ *  Created on: Jun 24, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "BlockCodec.h"
+
+#include "config.h"
+
+#include <gcrypt.h>
+#include <glog/logging.h>
+#include <lzo/lzo1x.h>
+#include <string.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace iqurius {
+
+// Containers are compressed once and decoded on every device, so the
+// encoders run at their slowest settings.
+#ifdef HAVE_LZ4
+static const int g_Lz4Level = LZ4HC_CLEVEL_MAX;
+#endif
+#ifdef HAVE_ZSTD
+static const int g_ZstdLevel = 19;
+#endif
+
+// Tried in this order, the first of equally small results wins, so it is
+// also the order of decoding speed on the device.
+static const BlockCodec g_CompressingCodecs[] = {
+	CODEC_LZ4, CODEC_LZO1X, CODEC_ZSTD,
+};
+
+const char* codecName(BlockCodec codec) {
+	switch (codec) {
+	case CODEC_STORED: return "stored";
+	case CODEC_LZO1X: return "lzo1x";
+	case CODEC_UNCHANGED: return "unchanged";
+	case CODEC_XOR_LZO1X: return "xor-lzo1x";
+	case CODEC_LZ4: return "lz4";
+	case CODEC_ZSTD: return "zstd";
+	default: return "unknown";
+	}
+}
+
+bool codecAvailable(BlockCodec codec) {
+	switch (codec) {
+	case CODEC_STORED:
+	case CODEC_LZO1X:
+	case CODEC_UNCHANGED:
+	case CODEC_XOR_LZO1X:
+		return true;
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool parseCodecPolicy(const char* name, CodecPolicy* policy) {
+	static const struct {
+		const char* name_;
+		CodecPolicy policy_;
+		BlockCodec codec_;
+	} policies[] = {
+		{ "lzo", POLICY_LZO, CODEC_LZO1X },
+		{ "lz4", POLICY_LZ4, CODEC_LZ4 },
+		{ "zstd", POLICY_ZSTD, CODEC_ZSTD },
+		{ "store", POLICY_STORE, CODEC_STORED },
+		{ "ratio", POLICY_BEST_RATIO, CODEC_STORED },
+		{ "decode", POLICY_FASTEST_DECODE, CODEC_STORED },
+	};
+
+	for (const auto& entry : policies) {
+		if (0 != strcmp(name, entry.name_)) {
+			continue;
+		}
+		if (!codecAvailable(entry.codec_)) {
+			LOG(ERROR) << "Not built with " << codecName(entry.codec_);
+			return false;
+		}
+		*policy = entry.policy_;
+		return true;
+	}
+	LOG(ERROR) << "Unknown codec policy " << name;
+	return false;
+}
+
+size_t compressWorkMemory() {
+	size_t size = LZO1X_999_MEM_COMPRESS;
+#ifdef HAVE_LZ4
+	if ((size_t)LZ4_sizeofStateHC() > size) {
+		size = LZ4_sizeofStateHC();
+	}
+#endif
+	return size;
+}
+
+bool compressBlock(BlockCodec codec,
+		const uint8_t* input, size_t input_len,
+		uint8_t* output, size_t* output_len,
+		uint8_t* work_memory) {
+	lzo_uint len;
+	int rc;
+
+	switch (codec) {
+	case CODEC_LZO1X:
+		len = *output_len;
+		rc = lzo1x_999_compress(input, input_len, output, &len, work_memory);
+		if (rc != LZO_E_OK) {
+			break;
+		}
+		*output_len = len;
+		return true;
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		rc = LZ4_compress_HC_extStateHC(work_memory,
+				reinterpret_cast<const char*>(input),
+				reinterpret_cast<char*>(output),
+				input_len, *output_len, g_Lz4Level);
+		if (rc <= 0) {
+			break;
+		}
+		*output_len = rc;
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD: {
+		size_t zrc = ZSTD_compress(output, *output_len, input, input_len,
+				g_ZstdLevel);
+		if (ZSTD_isError(zrc)) {
+			break;
+		}
+		*output_len = zrc;
+		return true;
+	}
+#endif
+	default:
+		LOG(ERROR) << "Can not compress with " << codecName(codec);
+		return false;
+	}
+	LOG(ERROR) << "Error compressing file buffer with " << codecName(codec);
+	return false;
+}
+
+bool compressBlockWithPolicy(CodecPolicy policy,
+		const uint8_t* input, size_t input_len,
+		uint8_t* output, size_t* output_len,
+		BlockCodec* codec,
+		uint8_t* work_memory,
+		uint8_t* scratch) {
+	const size_t output_size = *output_len;
+	BlockCodec single = CODEC_LZO1X;
+
+	*codec = CODEC_STORED;
+	*output_len = input_len;
+	switch (policy) {
+	case POLICY_STORE:
+		return true;
+	case POLICY_LZ4:
+		single = CODEC_LZ4;
+		break;
+	case POLICY_ZSTD:
+		single = CODEC_ZSTD;
+		break;
+	case POLICY_FASTEST_DECODE:
+		single = codecAvailable(CODEC_LZ4) ? CODEC_LZ4 : CODEC_LZO1X;
+		break;
+	case POLICY_BEST_RATIO:
+		for (BlockCodec candidate : g_CompressingCodecs) {
+			size_t len = output_size;
+			if (!codecAvailable(candidate)) {
+				continue;
+			}
+			if (!compressBlock(candidate, input, input_len, scratch, &len,
+					work_memory)) {
+				return false;
+			}
+			if (len < *output_len) {
+				memcpy(output, scratch, len);
+				*output_len = len;
+				*codec = candidate;
+			}
+		}
+		return true;
+	default:
+		break;
+	}
+	size_t len = output_size;
+	if (!compressBlock(single, input, input_len, output, &len,
+			work_memory)) {
+		return false;
+	}
+	if (len < input_len) {
+		*output_len = len;
+		*codec = single;
+	}
+	return true;
+}
+
+bool decompressBlock(BlockCodec codec,
+		const uint8_t* input, size_t input_len,
+		uint8_t* output, size_t output_len) {
+	lzo_uint len;
+	int rc;
+
+	switch (codec) {
+	case CODEC_STORED:
+		if (input_len != output_len) {
+			break;
+		}
+		memcpy(output, input, output_len);
+		return true;
+	case CODEC_LZO1X:
+		len = output_len;
+		rc = lzo1x_decompress_safe(input, input_len, output, &len, NULL);
+		if (rc != LZO_E_OK || len != output_len) {
+			break;
+		}
+		return true;
+	case CODEC_XOR_LZO1X:
+		return decompressBlock(CODEC_LZO1X, input, input_len,
+				output, output_len);
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		rc = LZ4_decompress_safe(reinterpret_cast<const char*>(input),
+				reinterpret_cast<char*>(output), input_len, output_len);
+		if (rc < 0 || (size_t)rc != output_len) {
+			break;
+		}
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD: {
+		size_t zrc = ZSTD_decompress(output, output_len, input, input_len);
+		if (ZSTD_isError(zrc) || zrc != output_len) {
+			break;
+		}
+		return true;
+	}
+#endif
+	default:
+		LOG(ERROR) << "Unsupported block codec " << codec << " ("
+				<< codecName(codec) << ")";
+		return false;
+	}
+	LOG(ERROR) << "Error decompressing a file block";
+	return false;
+}
+
+void xorBlock(uint8_t* data, const uint8_t* base, size_t base_len) {
+	for (size_t idx = 0; idx < base_len; ++idx) {
+		data[idx] ^= base[idx];
+	}
+}
+
+uint32_t blockChecksum(const uint8_t* data, size_t len) {
+	uint8_t crc[4];
+
+	gcry_md_hash_buffer(GCRY_MD_CRC32, crc, data, len);
+	return ((uint32_t)crc[0] << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+}
+
+} /* namespace iqurius */
@@ -0,0 +1,285 @@
+/*
+ * BlockPool.cpp
+ *
+ *  Created on: Jun 22, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "BlockPool.h"
+
+#include <glog/logging.h>
+#include <string.h>
+
+namespace iqurius {
+
+BlockPool::BlockPool(size_t threads,
+		size_t input_size,
+		size_t output_size,
+		size_t base_size)
+	: input_size_(input_size),
+	  output_size_(output_size),
+	  base_size_(base_size),
+	  num_threads_(threads ? threads : 1),
+	  stopping_(false) {
+	// Two blocks per thread keep every worker busy while the oldest block
+	// is taken out and the next one is filled.
+	slots_.resize(num_threads_ * 2);
+	for (Slot& slot : slots_) {
+		slot.block_.input_ = NULL;
+		slot.block_.output_ = NULL;
+		slot.block_.input_len_ = 0;
+		slot.block_.source_ = NULL;
+		slot.block_.output_len_ = 0;
+		slot.block_.base_ = NULL;
+		slot.block_.base_len_ = 0;
+		slot.block_.codec_ = CODEC_STORED;
+		slot.block_.checksum_ = 0;
+		slot.block_.has_checksum_ = true;
+		slot.block_.base_checksum_ = 0;
+		slot.block_.failed_ = false;
+		slot.done_ = false;
+	}
+}
+
+void BlockPool::setMemoryBudget(size_t bytes) {
+	size_t slot_size = input_size_ + output_size_ + base_size_;
+	size_t slots = bytes / slot_size;
+
+	if (slots < num_threads_ + 1) {
+		slots = num_threads_ + 1;
+	}
+	// Nothing is allocated before start(), every slot is still empty.
+	Slot empty = slots_.front();
+	slots_.resize(slots, empty);
+}
+
+BlockPool::~BlockPool() {
+	stop();
+	for (Slot& slot : slots_) {
+		delete [] slot.block_.input_;
+		delete [] slot.block_.output_;
+		delete [] slot.block_.base_;
+	}
+}
+
+bool BlockPool::start() {
+	for (Slot& slot : slots_) {
+		slot.block_.input_ = new uint8_t[input_size_];
+		slot.block_.output_ = new uint8_t[output_size_];
+		if (NULL == slot.block_.input_ || NULL == slot.block_.output_) {
+			LOG(ERROR) << "Out of memory";
+			return false;
+		}
+		if (base_size_ > 0) {
+			slot.block_.base_ = new uint8_t[base_size_];
+		}
+		free_.push_back(&slot);
+	}
+	stopping_ = false;
+	for (size_t idx = 0; idx < num_threads_; ++idx) {
+		pthread_t thread;
+		if (0 != pthread_create(&thread, NULL, threadProc, this)) {
+			LOG(ERROR) << "Can not start a worker thread errno=" << errno;
+			stop();
+			return false;
+		}
+		threads_.push_back(thread);
+	}
+	return true;
+}
+
+void BlockPool::stop() {
+	{
+		googleapis::MutexLock lock(&mutex_);
+		stopping_ = true;
+		queued_cond_.SignalAll();
+	}
+	for (pthread_t thread : threads_) {
+		pthread_join(thread, NULL);
+	}
+	threads_.clear();
+}
+
+BlockPool::Block* BlockPool::getFreeBlock() {
+	googleapis::MutexLock lock(&mutex_);
+	if (free_.empty()) {
+		return NULL;
+	}
+	Slot* slot = free_.back();
+	free_.pop_back();
+	slot->block_.input_len_ = 0;
+	slot->block_.source_ = NULL;
+	slot->block_.output_len_ = 0;
+	slot->block_.base_len_ = 0;
+	slot->block_.codec_ = CODEC_STORED;
+	slot->block_.checksum_ = 0;
+	slot->block_.has_checksum_ = true;
+	slot->block_.base_checksum_ = 0;
+	slot->block_.failed_ = false;
+	slot->done_ = false;
+	return &slot->block_;
+}
+
+void BlockPool::submit(Block* block) {
+	Slot* slot = reinterpret_cast<Slot*>(block);
+	googleapis::MutexLock lock(&mutex_);
+	queued_.push_back(slot);
+	in_flight_.push_back(slot);
+	queued_cond_.Signal();
+}
+
+BlockPool::Block* BlockPool::takeCompleted(bool wait) {
+	googleapis::MutexLock lock(&mutex_);
+	if (in_flight_.empty()) {
+		return NULL;
+	}
+	Slot* slot = in_flight_.front();
+	while (!slot->done_) {
+		if (!wait) {
+			return NULL;
+		}
+		done_cond_.Wait(&mutex_);
+	}
+	in_flight_.pop_front();
+	return &slot->block_;
+}
+
+void BlockPool::releaseBlock(Block* block) {
+	googleapis::MutexLock lock(&mutex_);
+	free_.push_back(reinterpret_cast<Slot*>(block));
+}
+
+void* BlockPool::threadProc(void* arg) {
+	static_cast<BlockPool*>(arg)->processBlocks();
+	return NULL;
+}
+
+void BlockPool::processBlocks() {
+	uint8_t* state = createThreadState();
+
+	while (true) {
+		Slot* slot;
+		{
+			googleapis::MutexLock lock(&mutex_);
+			while (queued_.empty() && !stopping_) {
+				queued_cond_.Wait(&mutex_);
+			}
+			if (stopping_) {
+				break;
+			}
+			slot = queued_.front();
+			queued_.pop_front();
+		}
+
+		bool ok = processBlock(&slot->block_, state);
+
+		googleapis::MutexLock lock(&mutex_);
+		slot->block_.failed_ = !ok;
+		slot->done_ = true;
+		done_cond_.SignalAll();
+	}
+	delete [] state;
+}
+
+// Work memory, then a compressed candidate, then the XOR of a block and
+// its compressed form when xor_blocks_ is set.
+uint8_t* CompressionPool::createThreadState() {
+	size_t size = compressWorkMemory() + compressedBound(blockSize());
+	if (xor_blocks_) {
+		size += blockSize() + compressedBound(blockSize());
+	}
+	return new uint8_t[size];
+}
+
+bool CompressionPool::processBlock(Block* block, uint8_t* work_memory) {
+	if (block->base_len_ > 0 &&
+		block->base_len_ >= block->input_len_ &&
+		0 == memcmp(block->base_, block->input_, block->input_len_)) {
+		block->codec_ = CODEC_UNCHANGED;
+		block->output_len_ = 0;
+		block->checksum_ = 0;
+		block->base_checksum_ = blockChecksum(block->base_,
+				block->input_len_);
+		return true;
+	}
+	block->output_len_ = compressedBound(block->input_len_);
+	if (!compressBlockWithPolicy(policy_,
+			block->input_, block->input_len_,
+			block->output_, &block->output_len_, &block->codec_,
+			work_memory, work_memory + compressWorkMemory())) {
+		return false;
+	}
+	if (xor_blocks_ && block->base_len_ > 0 && policy_ != POLICY_STORE &&
+		!compressDelta(block, work_memory)) {
+		return false;
+	}
+	block->checksum_ = blockChecksum(data(block), dataLen(block));
+	return true;
+}
+
+// Keeps the compressed XOR with the installed block when it beats the
+// block compressed on its own.
+bool CompressionPool::compressDelta(Block* block, uint8_t* state) {
+	size_t base_len = block->base_len_ < block->input_len_ ?
+			block->base_len_ : block->input_len_;
+	uint8_t* delta = state + compressWorkMemory() +
+			compressedBound(blockSize());
+	uint8_t* output = delta + blockSize();
+	size_t output_len = compressedBound(block->input_len_);
+
+	memcpy(delta, block->input_, block->input_len_);
+	xorBlock(delta, block->base_, base_len);
+	if (!compressBlock(CODEC_LZO1X, delta, block->input_len_,
+			output, &output_len, state)) {
+		return false;
+	}
+	if (output_len < dataLen(block)) {
+		memcpy(block->output_, output, output_len);
+		block->output_len_ = output_len;
+		block->codec_ = CODEC_XOR_LZO1X;
+		block->base_checksum_ = blockChecksum(block->base_, base_len);
+	}
+	return true;
+}
+
+bool DecompressionPool::processBlock(Block* block, uint8_t* state) {
+	const uint8_t* input = block->source_ ? block->source_ : block->input_;
+
+	if (block->has_checksum_ &&
+		blockChecksum(input, block->input_len_) != block->checksum_) {
+		LOG(ERROR) << "Block checksum mismatch";
+		return false;
+	}
+	if (block->codec_ == CODEC_STORED) {
+		return block->input_len_ == block->output_len_;
+	}
+	if (!isDeltaCodec(block->codec_)) {
+		return decompressBlock(block->codec_, input, block->input_len_,
+				block->output_, block->output_len_);
+	}
+	if (NULL == block->base_ ||
+		blockChecksum(block->base_, block->base_len_) !=
+				block->base_checksum_) {
+		LOG(ERROR) << "Installed block does not match the update base";
+		return false;
+	}
+	if (block->codec_ == CODEC_UNCHANGED) {
+		if (block->base_len_ != block->output_len_) {
+			LOG(ERROR) << "Installed block does not match the update base";
+			return false;
+		}
+		memcpy(block->output_, block->base_, block->output_len_);
+		return true;
+	}
+	if (!decompressBlock(block->codec_, input, block->input_len_,
+			block->output_, block->output_len_)) {
+		return false;
+	}
+	xorBlock(block->output_, block->base_, block->base_len_);
+	return true;
+}
+
+} /* namespace iqurius */
@@ -116,6 +116,17 @@ void Connection::send(Message& msg, int timeout_msec,
 	pending_responses_.push_back(response);
 }
 
+void Connection::cancel(googleapis::Callback1<Message*>* cb) {
+	if (NULL == cb) return;
+	for (auto it = pending_responses_.begin(); it != pending_responses_.end(); ++it) {
+		if (it->cb == cb) {
+			pending_responses_.erase(it);
+			delete cb;
+			return;
+		}
+	}
+}
+
 static void buildSignalRule(const char* path, const char* interface,
 		const char* method, std::string* rule) {
 	rule->append("type='signal',path='");
@@ -194,9 +205,10 @@ void Connection::process(int time_out) {
 			bool found = false;
 			for (auto it = pending_responses_.begin(); it != pending_responses_.end(); ++it) {
 				if (it->serial == serial) {
-					if (NULL != it->cb) it->cb->Run(&msg);
+					googleapis::Callback1<Message*>* cb = it->cb;
 					found = true;
 					pending_responses_.erase(it);
+					if (NULL != cb) cb->Run(&msg);
 					break;
 				}
 			}
@@ -218,9 +230,14 @@ void Connection::process(int time_out) {
 
 void Connection::processTimeouts() {
 	uint32_t time = timeGetTime();
-	for (const auto& p : pending_responses_) {
-		if (p.has_expiration && p.expiration > time) {
-			p.cb->Run(NULL);
+	auto it = pending_responses_.begin();
+	while (it != pending_responses_.end()) {
+		if (it->has_expiration && (int32_t)(time - it->expiration) >= 0) {
+			googleapis::Callback1<Message*>* cb = it->cb;
+			it = pending_responses_.erase(it);
+			if (NULL != cb) cb->Run(NULL);
+		} else {
+			++it;
 		}
 	}
 }
@@ -0,0 +1,179 @@
+/*
+ * ContainerSource.cpp
+ *
+ *  Created on: Jun 26, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "ContainerSource.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace iqurius {
+
+static bool readSysfsFlag(const std::string& path) {
+	FILE* file = fopen(path.c_str(), "r");
+	int value = 0;
+
+	if (NULL == file) {
+		return false;
+	}
+	if (1 != fscanf(file, "%d", &value)) {
+		value = 0;
+	}
+	fclose(file);
+	return 0 != value;
+}
+
+// Whether the filesystem on dev lives on a USB or removable disk.
+// Filesystems without a block device, tmpfs or NFS, are not.
+static bool onRemovableMedia(dev_t dev) {
+	char link[64];
+	char device[PATH_MAX];
+
+	snprintf(link, sizeof(link), "/sys/dev/block/%u:%u",
+			major(dev), minor(dev));
+	if (NULL == realpath(link, device)) {
+		return false;
+	}
+	// USB disks do not always set the removable flag.
+	if (NULL != strstr(device, "/usb")) {
+		return true;
+	}
+	// Partitions have the flag on their disk.
+	return readSysfsFlag(std::string(device) + "/removable") ||
+			readSysfsFlag(std::string(device) + "/../removable");
+}
+
+ContainerSource::ContainerSource(const std::string& path)
+	: path_(path),
+	  fd_(-1),
+	  size_(0),
+	  map_(NULL) {
+}
+
+ContainerSource::~ContainerSource() {
+	close();
+}
+
+bool ContainerSource::open(bool use_mmap) {
+	struct stat stat_buf;
+	void* map;
+
+	close();
+	fd_ = ::open(path_.c_str(), O_RDONLY);
+	if (fd_ < 0) {
+		LOG(ERROR) << "Unable to open container " << path_;
+		return false;
+	}
+	if (0 != fstat(fd_, &stat_buf)) {
+		LOG(ERROR) << "Can not stat " << path_ << " errno=" << errno;
+		close();
+		return false;
+	}
+	size_ = stat_buf.st_size;
+	// The container is read front to back, a larger read-ahead window
+	// lets the kernel keep the USB stick busy while blocks are decoded.
+	posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (!use_mmap || 0 == size_ || size_ > SIZE_MAX) {
+		return true;
+	}
+	// A read error or a pulled stick raises SIGBUS on a mapping, pread()
+	// just fails and the update is rolled back.
+	if (onRemovableMedia(stat_buf.st_dev)) {
+		LOG(INFO) << path_ << " is on removable media, using buffered reads";
+		return true;
+	}
+	map = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd_, 0);
+	if (MAP_FAILED == map) {
+		LOG(WARNING) << "Can not map " << path_ << " errno=" << errno
+				<< ", using buffered reads";
+		return true;
+	}
+	map_ = static_cast<uint8_t*>(map);
+	madvise(map_, size_, MADV_SEQUENTIAL);
+	return true;
+}
+
+void ContainerSource::close() {
+	if (map_) {
+		munmap(map_, size_);
+		map_ = NULL;
+	}
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+	size_ = 0;
+}
+
+const uint8_t* ContainerSource::read(uint64_t offset,
+		size_t len,
+		uint8_t* scratch) {
+	if (offset > size_ || len > size_ - offset) {
+		LOG(ERROR) << "Read past the end of the container";
+		return NULL;
+	}
+	if (map_) {
+		return map_ + offset;
+	}
+	for (size_t done = 0; done < len;) {
+		ssize_t rc = pread(fd_, scratch + done, len - done, offset + done);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			LOG(ERROR) << "Error reading the container errno=" << errno;
+			return NULL;
+		}
+		done += rc;
+	}
+	return scratch;
+}
+
+void ContainerSource::willNeed(uint64_t offset, size_t len) {
+	if (offset >= size_) {
+		return;
+	}
+	if (len > size_ - offset) {
+		len = size_ - offset;
+	}
+	if (map_) {
+		long page_size = sysconf(_SC_PAGESIZE);
+		uint64_t start = offset & ~((uint64_t)page_size - 1);
+		madvise(map_ + start, len + (offset - start), MADV_WILLNEED);
+	} else {
+		posix_fadvise(fd_, offset, len, POSIX_FADV_WILLNEED);
+	}
+}
+
+void ContainerSource::dontNeed(uint64_t offset, size_t len) {
+	if (map_) {
+		// Only whole pages, the last one may still hold the next block.
+		long page_size = sysconf(_SC_PAGESIZE);
+		uint64_t start = (offset + page_size - 1) & ~((uint64_t)page_size - 1);
+		uint64_t end = (offset + len) & ~((uint64_t)page_size - 1);
+		if (end > start) {
+			madvise(map_ + start, end - start, MADV_DONTNEED);
+		}
+	}
+	if (fd_ >= 0) {
+		posix_fadvise(fd_, offset, len, POSIX_FADV_DONTNEED);
+	}
+}
+
+} /* namespace iqurius */
@@ -10,9 +10,16 @@
 
 #include "FirmwareContainer.h"
 
-#include <lzo/lzo1x.h>
+#include "BlockCodec.h"
+#include "BlockPool.h"
+#include "ContainerSource.h"
+#include "FlashWriter.h"
+#include "UpdateJournal.h"
+#include "time_util.h"
+
 #include <gcrypt.h>
 #include <glog/logging.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -21,6 +28,12 @@ namespace iqurius {
 
 static const int g_HashAlgo = GCRY_MD_SHA256;
 static constexpr uint32_t g_BlockSize = 1024*1024;
+static constexpr size_t g_IndexEntrySize = 8 + 4 + 4 + 1 + 4 + 4;
+// Entries written before delta blocks existed have no base checksum.
+static constexpr size_t g_MinIndexEntrySize = 8 + 4 + 4 + 1 + 4;
+static constexpr size_t g_FooterSize =
+		8 + 4 + 4 + 1 + MAX_DIGEST_SIZE + 8 + 4 + 2 + 4 + 4 + 4;
+static const char g_JournalName[] = "update.journal";
 
 static void writeUint64(uint64_t value, uint8_t* buffer) {
 	buffer[0] = value & 0xff;
@@ -33,12 +46,12 @@ static void writeUint64(uint64_t value, uint8_t* buffer) {
 	buffer[7] = (value >> 56) & 0xff;
 }
 
-/*static void writeUint32(uint32_t value, uint8_t* buffer) {
+static void writeUint32(uint32_t value, uint8_t* buffer) {
 	buffer[0] = value & 0xff;
 	buffer[1] = (value >> 8) & 0xff;
 	buffer[2] = (value >> 16) & 0xff;
 	buffer[3] = (value >> 24) & 0xff;
-}*/
+}
 
 static void writeUint16(uint16_t value, uint8_t* buffer) {
 	buffer[0] = value & 0xff;
@@ -63,43 +76,6 @@ static bool writeString(const std::string& value, uint8_t** buffer,
     return true;
 }
 
-bool FirmwareContainerWriter::calculateFileDigest(const char* path,
-		uint8_t* digest) {
-	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
-	unsigned char buffer[16384];
-	FILE* input = NULL;
-	gcry_md_hd_t hd = NULL;
-	gcry_error_t error;
-	unsigned char *file_digest;
-	int len;
-	bool result = false;
-
-	input = fopen(path, "rb");
-	if (NULL == input) {
-		LOG(ERROR) << "Can not open the input file: " << path;
-		goto exit;
-	}
-
-	error = gcry_md_open(&hd, g_HashAlgo, 0);
-	if (error != 0) {
-		LOG(ERROR) << "Can not initialize the gcrypt hash library: " << error;
-		goto exit;
-	}
-
-	while (true) {
-		len = fread(buffer, 1, sizeof(buffer), input);
-		if (len <= 0) break;
-		gcry_md_write(hd, buffer, len);
-	}
-	file_digest = gcry_md_read(hd, g_HashAlgo);
-	memcpy(digest, file_digest, digest_len);
-	result = true;
-exit:
-    if (hd) gcry_md_close(hd);
-    if (input) fclose(input);
-	return result;
-}
-
 bool FirmwareContainerWriter::addFile(const char* path,
 		size_t prefix_len,
 		bool to_storage) {
@@ -133,10 +109,8 @@ bool FirmwareContainerWriter::addFile(const char* path,
     fi.path_ = path;
     fi.archive_path_ = archive_path;
     fi.file_size_ = stat_buf.st_size;
+    // The digest is calculated while the file is compressed.
     memset(fi.digest_, 0, sizeof(fi.digest_));
-    if (!calculateFileDigest(path, fi.digest_)) {
-    	return false;
-    }
     manifest_.push_back(fi);
     return true;
 }
@@ -184,213 +158,402 @@ static bool fwriteUint32(uint32_t value, FILE* output) {
     return true;
 }
 
+static bool fwriteBuffer(const uint8_t* buffer, size_t len, FILE* output) {
+	if (fwrite(buffer, 1, len, output) != len) {
+		LOG(ERROR) << "Error writing to the output file";
+		return false;
+	}
+	return true;
+}
+
+// Version 1 frames every block with its sizes, version 2 writes the bare
+// block and remembers it for the index.
+bool FirmwareContainerWriter::writeBlock(const BlockPool::Block* block,
+		FILE* output,
+		uint64_t* bytes_written) {
+	const uint8_t* data = CompressionPool::data(block);
+	size_t data_len = CompressionPool::dataLen(block);
+
+	if (block->failed_) {
+		return false;
+	}
+	if (format_version_ == 1) {
+		if (!fwriteUint32(block->input_len_, output)) {
+			return false;
+		}
+		if (!fwriteUint32(data_len, output)) {
+			return false;
+		}
+		*bytes_written += 8;
+	} else {
+		ContainerBlock entry;
+		entry.offset_ = *bytes_written;
+		entry.stored_len_ = data_len;
+		entry.len_ = block->input_len_;
+		entry.codec_ = block->codec_;
+		entry.checksum_ = block->checksum_;
+		entry.base_checksum_ = block->base_checksum_;
+		blocks_.push_back(entry);
+		codec_blocks_[block->codec_]++;
+	}
+	if (!fwriteBuffer(data, data_len, output)) {
+		return false;
+	}
+	*bytes_written += data_len;
+	return true;
+}
+
 bool FirmwareContainerWriter::writeContainer(const char* path) {
+	CompressionPool pool(threads_, g_BlockSize, codec_policy_,
+			!delta_base_.empty(), delta_xor_);
 	FILE* output = NULL;
 	bool result = false;
-	uint8_t* input_buffer = NULL;
-	size_t input_buffer_len;
-	lzo_uint output_buffer_len;
-	size_t write_len;
-	uint8_t* compression_buffer = NULL;
-	uint8_t* work_memory = NULL;
-	uint8_t  manifest_digest[MAX_DIGEST_SIZE];
-	int rc;
+	uint64_t bytes_read = 0;
+	uint64_t bytes_written = 0;
+	uint64_t start_time = timeGetTimeUs();
+	uint64_t elapsed_us;
 
-	output = fopen(path, "wb");
-	if (NULL == output) {
-		LOG(ERROR) << "Error opening the output file: " << output;
+	if (format_version_ != 1 && format_version_ != 2) {
+		LOG(ERROR) << "Unsupported container version " << format_version_;
 		goto exit;
 	}
-	input_buffer = new uint8_t[g_BlockSize];
-	if (NULL == input_buffer) {
-		LOG(ERROR) << "Out of memory";
+	if (format_version_ == 1 && !delta_base_.empty()) {
+		LOG(ERROR) << "Delta updates need a version 2 container";
 		goto exit;
 	}
-	compression_buffer = new uint8_t[g_BlockSize + g_BlockSize / 16 + 64 + 3];
-	if (NULL == compression_buffer) {
-		LOG(ERROR) << "Out of memory";
+	if (format_version_ == 1 && codec_policy_ != POLICY_LZO) {
+		LOG(ERROR) << "Version 1 containers only hold LZO1X blocks";
 		goto exit;
 	}
-	work_memory = new uint8_t[LZO1X_999_MEM_COMPRESS];
-	if (NULL == work_memory) {
-		LOG(ERROR) << "Out of memory";
+	output = fopen(path, "wb");
+	if (NULL == output) {
+		LOG(ERROR) << "Error opening the output file: " << path;
 		goto exit;
 	}
-
-	if (!fwriteUint32(CONTAINER_MAGIC_NUMBER, output)) {
+	if (!pool.start()) {
 		goto exit;
 	}
 
-	input_buffer_len = g_BlockSize;
-	if (!serializeManifest(input_buffer, &input_buffer_len)) {
-		LOG(ERROR) << "Can not serialize the manifest.";
-		goto exit;
-	}
-	input_buffer_len = g_BlockSize - input_buffer_len;
-	gcry_md_hash_buffer(g_HashAlgo, manifest_digest, input_buffer,
-			input_buffer_len);
-	write_len = fwrite(manifest_digest, 1, sizeof(manifest_digest), output);
-	if (write_len != sizeof(manifest_digest)) {
-		LOG(ERROR) << "Error writing to the output file";
+	if (!fwriteUint32(format_version_ == 1 ?
+			CONTAINER_MAGIC_NUMBER : CONTAINER_MAGIC_NUMBER_V2, output)) {
 		goto exit;
 	}
+	bytes_written += 4;
+	blocks_.clear();
+	memset(codec_blocks_, 0, sizeof(codec_blocks_));
 
-	output_buffer_len = g_BlockSize + g_BlockSize / 16 + 64 + 3;
-	rc = lzo1x_999_compress(input_buffer, input_buffer_len,
-			compression_buffer, &output_buffer_len, work_memory);
-    if (rc != LZO_E_OK) {
-		LOG(ERROR) << "Error compressing the manifest buffer";
-		goto exit;
-    }
-
-    if (!fwriteUint32(input_buffer_len, output)) {
+	if (format_version_ == 1 && !writeManifest(output, &bytes_written)) {
 		goto exit;
 	}
-	if (output_buffer_len < input_buffer_len) {
-	    if (!fwriteUint32((uint32_t)output_buffer_len, output)) {
-			goto exit;
-		}
-		write_len = fwrite(compression_buffer,
-				1,
-				(size_t)output_buffer_len,
-				output);
-		if (write_len != output_buffer_len) {
-			LOG(ERROR) << "Error writing to the output file";
-			goto exit;
-		}
-	} else {
-	    if (!fwriteUint32(input_buffer_len, output)) {
-			goto exit;
-		}
-		write_len = fwrite(input_buffer, 1, input_buffer_len, output);
-		if (write_len != input_buffer_len) {
-			LOG(ERROR) << "Error writing to the output file";
-			goto exit;
-		}
-	}
-    for (const auto& file_info : manifest_) {
-    	if (!compressFile(file_info,
-    			output,
-				input_buffer,
-				g_BlockSize,
-				compression_buffer,
-				g_BlockSize + g_BlockSize/16 + 64 + 3,
-				work_memory)) {
+
+    for (auto& file_info : manifest_) {
+    	if (!compressFile(&file_info, output, &pool, &bytes_written)) {
     		goto exit;
     	}
+    	bytes_read += file_info.file_size_;
+    }
+    // Now with the digests.
+    if (format_version_ == 1 &&
+    	(0 != fseek(output, 4, SEEK_SET) || !writeManifest(output, NULL))) {
+    	goto exit;
+    }
+    if (format_version_ == 2 &&
+    	!writeTrailer(output, &pool, &bytes_written)) {
+    	goto exit;
+    }
+    elapsed_us = timeGetTimeUs() - start_time;
+    LOG(INFO) << "Compressed " << (bytes_read >> 20) << "MB into "
+    		<< (bytes_written >> 20) << "MB in " << elapsed_us / 1000
+			<< "ms, " << (elapsed_us ? bytes_read / elapsed_us : 0)
+			<< "MB/s using " << pool.threads() << " threads";
+    for (int codec = 0; codec < CODEC_COUNT && format_version_ == 2; ++codec) {
+    	if (codec_blocks_[codec]) {
+    		LOG(INFO) << codec_blocks_[codec] << " of " << blocks_.size()
+    				<< " blocks " << codecName((BlockCodec)codec);
+    	}
     }
     result = true;
 exit:
-    delete [] work_memory;
-    delete [] compression_buffer;
-    delete [] input_buffer;
+    pool.stop();
     if (output) fclose(output);
 	return result;
 }
 
-bool FirmwareContainerWriter::compressFile(const FileInfo& file_info,
+// Version 1 containers start with the manifest, which holds the digests
+// of the files that follow it. It is stored uncompressed so its size does
+// not depend on the digests, written with blank digests first and again
+// in place once the files are compressed. bytes_written is NULL then.
+bool FirmwareContainerWriter::writeManifest(FILE* output,
+		uint64_t* bytes_written) {
+	std::vector<uint8_t> manifest(g_BlockSize);
+	uint8_t manifest_digest[MAX_DIGEST_SIZE];
+	size_t manifest_len = manifest.size();
+
+	if (!serializeManifest(manifest.data(), &manifest_len)) {
+		LOG(ERROR) << "Can not serialize the manifest.";
+		return false;
+	}
+	manifest_len = manifest.size() - manifest_len;
+	gcry_md_hash_buffer(g_HashAlgo, manifest_digest, manifest.data(),
+			manifest_len);
+	// A stored block has the same compressed and uncompressed size.
+	if (!fwriteBuffer(manifest_digest, sizeof(manifest_digest), output) ||
+		!fwriteUint32(manifest_len, output) ||
+		!fwriteUint32(manifest_len, output) ||
+		!fwriteBuffer(manifest.data(), manifest_len, output)) {
+		return false;
+	}
+	if (bytes_written) {
+		*bytes_written += sizeof(manifest_digest) + 8 + manifest_len;
+	}
+	return true;
+}
+
+// The reader and the ordered writer share the calling thread, the pool
+// keeps the compressors busy in between. The file is hashed as it is read,
+// so it is read once.
+bool FirmwareContainerWriter::compressFile(FileInfo* file_info,
 		FILE* output,
-		uint8_t* input_buffer,
-		size_t input_buffer_len,
-		uint8_t* output_buffer,
-		size_t output_buffer_len,
-		uint8_t* work_memory) {
+		CompressionPool* pool,
+		uint64_t* bytes_written) {
+	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
+	BlockPool::Block* block;
 	FILE* input = NULL;
-	size_t len;
-	lzo_uint output_len;
-	size_t write_len;
-	int rc;
+	FILE* base = NULL;
+	gcry_md_hd_t hd = NULL;
+	gcry_error_t error;
+	uint64_t bytes_read = 0;
 	bool result = false;
 
-	input = fopen(file_info.path_.c_str(), "rb");
+	error = gcry_md_open(&hd, g_HashAlgo, 0);
+	if (error != 0) {
+		LOG(ERROR) << "Can not initialize the gcrypt hash library: " << error;
+		goto exit;
+	}
+	input = fopen(file_info->path_.c_str(), "rb");
 	if (NULL == input) {
-		LOG(ERROR) << "Can not open " << file_info.path_;
+		LOG(ERROR) << "Can not open " << file_info->path_;
 		goto exit;
 	}
-	while (true) {
-		len = fread(input_buffer, 1, input_buffer_len, input);
-		if (len <= 0) break;
-
-		if (!fwriteUint32(len, output)) {
-			goto exit;
+	if (!delta_base_.empty()) {
+		std::string base_path(delta_base_);
+		base_path.append("/");
+		base_path.append(file_info->archive_path_);
+		base = fopen(base_path.c_str(), "rb");
+		if (NULL == base) {
+			LOG(INFO) << "No installed " << file_info->archive_path_
+					<< ", shipping it whole";
 		}
-		output_len = output_buffer_len;
-		rc = lzo1x_999_compress(input_buffer, len,
-				output_buffer, &output_len, work_memory);
-	    if (rc != LZO_E_OK) {
-			LOG(ERROR) << "Error compressing file buffer";
-			goto exit;
-	    }
-		if (output_len < len) {
-			if (!fwriteUint32((uint32_t)output_len, output)) {
-				goto exit;
-			}
-			write_len = fwrite(output_buffer, 1, (size_t)output_len, output);
-			if (write_len != output_len) {
-				LOG(ERROR) << "Error writing to the output file";
-				goto exit;
-			}
-		} else {
-			if (!fwriteUint32(len, output)) {
-				goto exit;
-			}
-			write_len = fwrite(input_buffer, 1, len, output);
-			if (write_len != len) {
-				LOG(ERROR) << "Error writing to the output file";
+	}
+	while (true) {
+		block = pool->getFreeBlock();
+		if (NULL == block) {
+			block = pool->takeCompleted(true);
+			if (!writeBlock(block, output, bytes_written)) {
 				goto exit;
 			}
+			pool->releaseBlock(block);
+			continue;
 		}
+		block->input_len_ = fread(block->input_, 1, pool->blockSize(), input);
+		if (block->input_len_ == 0) {
+			pool->releaseBlock(block);
+			break;
+		}
+		gcry_md_write(hd, block->input_, block->input_len_);
+		bytes_read += block->input_len_;
+		if (base) {
+			block->base_len_ = fread(block->base_, 1, block->input_len_, base);
+		}
+		pool->submit(block);
+	}
+	if (ferror(input)) {
+		LOG(ERROR) << "Error reading " << file_info->path_;
+		goto exit;
 	}
-	if (!fwriteUint32(0, output)) {
+	if (bytes_read != file_info->file_size_) {
+		LOG(ERROR) << file_info->path_ << " changed while it was added";
 		goto exit;
 	}
+	memcpy(file_info->digest_, gcry_md_read(hd, g_HashAlgo), digest_len);
+	while (NULL != (block = pool->takeCompleted(true))) {
+		if (!writeBlock(block, output, bytes_written)) {
+			goto exit;
+		}
+		pool->releaseBlock(block);
+	}
+	if (format_version_ == 1) {
+		if (!fwriteUint32(0, output)) {
+			goto exit;
+		}
+		*bytes_written += 4;
+	}
 	result = true;
 exit:
+    if (hd) gcry_md_close(hd);
+    if (base) fclose(base);
     if (input) fclose(input);
 	return result;
 }
 
-static bool freadUint32(uint32_t* value, FILE* input) {
-    uint8_t buffer[4];
-    size_t read_len;
+// Writes the manifest, the block index and the footer of a version 2
+// container.
+bool FirmwareContainerWriter::writeTrailer(FILE* output,
+		CompressionPool* pool,
+		uint64_t* bytes_written) {
+	BlockPool::Block* block;
+	size_t manifest_len;
+	uint8_t manifest_digest[MAX_DIGEST_SIZE];
+	uint64_t manifest_offset;
+	uint64_t index_offset;
+	std::vector<uint8_t> index(blocks_.size() * g_IndexEntrySize);
+	uint8_t footer[g_FooterSize];
+	uint8_t* entry;
+	uint8_t* field;
 
-    read_len = fread(buffer, 1, 4, input);
-    if (read_len != 4) {
-    	LOG(ERROR) << "Error reading from the input file";
+	block = pool->getFreeBlock();
+	manifest_len = g_BlockSize;
+	if (!serializeManifest(block->input_, &manifest_len)) {
+		LOG(ERROR) << "Can not serialize the manifest.";
+		pool->releaseBlock(block);
+		return false;
+	}
+	block->input_len_ = g_BlockSize - manifest_len;
+	gcry_md_hash_buffer(g_HashAlgo, manifest_digest, block->input_,
+			block->input_len_);
+	pool->submit(block);
+	block = pool->takeCompleted(true);
+	if (block->failed_) {
+		LOG(ERROR) << "Error compressing the manifest buffer";
+		return false;
+	}
+	manifest_offset = *bytes_written;
+	if (!fwriteBuffer(CompressionPool::data(block),
+			CompressionPool::dataLen(block), output)) {
+		return false;
+	}
+	*bytes_written += CompressionPool::dataLen(block);
+
+	entry = index.data();
+	for (const ContainerBlock& info : blocks_) {
+		writeUint64(info.offset_, entry);
+		writeUint32(info.stored_len_, entry + 8);
+		writeUint32(info.len_, entry + 12);
+		entry[16] = info.codec_;
+		writeUint32(info.checksum_, entry + 17);
+		writeUint32(info.base_checksum_, entry + 21);
+		entry += g_IndexEntrySize;
+	}
+	index_offset = *bytes_written;
+	if (!fwriteBuffer(index.data(), index.size(), output)) {
+		return false;
+	}
+	*bytes_written += index.size();
+
+	field = footer;
+	writeUint64(manifest_offset, field);
+	field += 8;
+	writeUint32(CompressionPool::dataLen(block), field);
+	field += 4;
+	writeUint32(block->input_len_, field);
+	field += 4;
+	*field++ = block->codec_;
+	memcpy(field, manifest_digest, MAX_DIGEST_SIZE);
+	field += MAX_DIGEST_SIZE;
+	writeUint64(index_offset, field);
+	field += 8;
+	writeUint32(blocks_.size(), field);
+	field += 4;
+	writeUint16(g_IndexEntrySize, field);
+	field += 2;
+	writeUint32(g_BlockSize, field);
+	field += 4;
+	writeUint32(blockChecksum(index.data(), index.size()), field);
+	field += 4;
+	writeUint32(CONTAINER_MAGIC_NUMBER_V2, field);
+	pool->releaseBlock(block);
+	if (!fwriteBuffer(footer, sizeof(footer), output)) {
+		return false;
+	}
+	*bytes_written += sizeof(footer);
+	return true;
+}
+
+static bool readUint32At(ContainerSource* source,
+		uint64_t* offset,
+		uint32_t* value) {
+    uint8_t scratch[4];
+    const uint8_t* buffer = source->read(*offset, 4, scratch);
+
+    if (NULL == buffer) {
     	return false;
     }
     *value = buffer[0] |
     		(buffer[1] << 8) |
 			(buffer[2] << 16) |
 			(buffer[3] << 24);
+    *offset += 4;
     return true;
 }
 
+// Reads the version 1 block record at *offset and advances past it. Sets
+// *len to 0 at the end of the file. *data points at the block contents,
+// which stored blocks keep in the container itself.
+static bool readBlock(ContainerSource* source,
+		uint64_t* offset,
+		uint8_t* compressed_buffer,
+		uint8_t* output_buffer,
+		const uint8_t** data,
+		uint32_t* len) {
+	uint32_t compressed_len;
+	const uint8_t* compressed;
+
+	if (!readUint32At(source, offset, len)) {
+		return false;
+	}
+	if (0 == *len) {
+		return true;
+	}
+	if (!readUint32At(source, offset, &compressed_len)) {
+		return false;
+	}
+	if (*len > g_BlockSize || compressed_len > g_BlockSize) {
+		LOG(ERROR) << "Corrupted block header";
+		return false;
+	}
+	compressed = source->read(*offset, compressed_len, compressed_buffer);
+	if (NULL == compressed) {
+		return false;
+	}
+	source->willNeed(*offset + compressed_len, g_BlockSize);
+	*offset += compressed_len;
+	if (compressed_len >= *len) {
+		*data = compressed;
+		return compressed_len == *len;
+	}
+	*data = output_buffer;
+	return decompressBlock(CODEC_LZO1X, compressed, compressed_len,
+			output_buffer, *len);
+}
+
 bool FirmwareContainerReader::loadManifest() {
-	FILE* input = NULL;
+	ContainerSource source(container_path_);
 	bool result = false;
 	uint8_t* compressed_buffer = NULL;
 	uint8_t* output_buffer = NULL;
 	uint8_t  manifest_digest[MAX_DIGEST_SIZE];
 	uint8_t  buffer_digest[MAX_DIGEST_SIZE];
 	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
+	const uint8_t* manifest;
+	const uint8_t* digest;
+	uint64_t offset = 0;
 	uint32_t magic;
 	uint32_t input_len;
-	uint32_t compressed_len;
-	lzo_uint output_len;
-	size_t read_len;
-	int rc;
 
-	input = fopen(container_path_.c_str(), "rb");
-	if (NULL == input) {
-		LOG(ERROR) << "Unable to open container " << container_path_;
-		goto exit;
-	}
-	if (!freadUint32(&magic, input)) {
+	if (!source.open(use_mmap_)) {
 		goto exit;
 	}
-	if (magic != CONTAINER_MAGIC_NUMBER) {
-		LOG(ERROR) << "Invalid signature";
+	if (!readUint32At(&source, &offset, &magic)) {
 		goto exit;
 	}
 	output_buffer = new uint8_t[g_BlockSize];
@@ -403,54 +566,51 @@ bool FirmwareContainerReader::loadManifest() {
 		LOG(ERROR) << "Out of memory";
 		goto exit;
 	}
-	read_len = fread(manifest_digest, 1, sizeof(manifest_digest), input);
-	if (read_len != sizeof(manifest_digest)) {
-		LOG(ERROR) << "Error reading input file.";
-		goto exit;
-	}
-	if (!freadUint32(&input_len, input)) {
-		goto exit;
-	}
-	if (!freadUint32(&compressed_len, input)) {
-		goto exit;
-	}
-	read_len = fread(compressed_buffer, 1, compressed_len, input);
-	if (read_len != compressed_len) {
-		LOG(ERROR) << "Error reading input file.";
-		goto exit;
-	}
-	if (compressed_len < input_len) {
-		output_len = g_BlockSize;
-		rc = lzo1x_decompress_safe(compressed_buffer,
-				compressed_len,
-				output_buffer,
-				&output_len,
-				NULL);
-		if (rc != LZO_E_OK || output_len != input_len) {
-			LOG(ERROR) << "Error decompressin ght manifest";
+	if (magic == CONTAINER_MAGIC_NUMBER) {
+		format_version_ = 1;
+		digest = source.read(offset, MAX_DIGEST_SIZE, manifest_digest);
+		if (NULL == digest) {
+			goto exit;
+		}
+		memcpy(manifest_digest, digest, MAX_DIGEST_SIZE);
+		offset += MAX_DIGEST_SIZE;
+		if (!readBlock(&source, &offset, compressed_buffer, output_buffer,
+				&manifest, &input_len)) {
+			goto exit;
+		}
+		files_offset_ = offset;
+	} else if (magic == CONTAINER_MAGIC_NUMBER_V2) {
+		format_version_ = 2;
+		if (!loadIndex(&source, compressed_buffer, output_buffer,
+				manifest_digest, &input_len)) {
 			goto exit;
 		}
+		manifest = output_buffer;
+		files_offset_ = offset;
 	} else {
-		memcpy(output_buffer, compressed_buffer, input_len);
+		LOG(ERROR) << "Invalid signature";
+		goto exit;
 	}
-	gcry_md_hash_buffer(g_HashAlgo, buffer_digest, output_buffer,
-				input_len);
+	gcry_md_hash_buffer(g_HashAlgo, buffer_digest, manifest, input_len);
 	if (0 != memcmp(buffer_digest, manifest_digest, digest_len)) {
 		LOG(ERROR) << "Manifest signature does not match";
 		goto exit;
 	}
-	if (!deserializeManifest(output_buffer, input_len)) {
+	if (!deserializeManifest(manifest, input_len)) {
+		goto exit;
+	}
+	memcpy(manifest_digest_, manifest_digest, MAX_DIGEST_SIZE);
+	if (format_version_ == 2 && !mapBlocks()) {
 		goto exit;
 	}
 	result = true;
 exit:
     delete [] compressed_buffer;
     delete [] output_buffer;
-    if (input) fclose(input);
 	return result;
 }
 
-static void readUint64(uint64_t* value, uint8_t* buffer) {
+static void readUint64(uint64_t* value, const uint8_t* buffer) {
 	*value = buffer[0] |
 			((uint64_t)buffer[1] << 8) |
 			((uint64_t)buffer[2] << 16) |
@@ -461,18 +621,18 @@ static void readUint64(uint64_t* value, uint8_t* buffer) {
 			((uint64_t)buffer[7] << 56);
 }
 
-/*static void readUint32(uint32_t* value, uint8_t* buffer) {
+static void readUint32(uint32_t* value, const uint8_t* buffer) {
 	*value = buffer[0] |
 			((uint64_t)buffer[1] << 8) |
 			((uint64_t)buffer[2] << 16) |
 			((uint64_t)buffer[3] << 24);
-}*/
+}
 
-static void readUint16(uint16_t* value, uint8_t* buffer) {
+static void readUint16(uint16_t* value, const uint8_t* buffer) {
 	*value = buffer[0] | ((uint64_t)buffer[1] << 8);
 }
 
-static bool readString(std::string* value, uint8_t** buffer,
+static bool readString(std::string* value, const uint8_t** buffer,
 		size_t* buffer_len) {
     if (*buffer_len < 1) {
     	return false;
@@ -489,7 +649,7 @@ static bool readString(std::string* value, uint8_t** buffer,
     return true;
 }
 
-bool FirmwareContainerReader::deserializeManifest(uint8_t* buffer,
+bool FirmwareContainerReader::deserializeManifest(const uint8_t* buffer,
 		size_t buffer_len) {
 	uint16_t file_cnt;
 	readString(&version_, &buffer, &buffer_len);
@@ -503,6 +663,8 @@ bool FirmwareContainerReader::deserializeManifest(uint8_t* buffer,
 	for (;file_cnt; --file_cnt) {
 		FileInfo fi;
 
+		fi.first_block_ = 0;
+		fi.block_count_ = 0;
 		readString(&fi.archive_path_, &buffer, &buffer_len);
 		if (buffer_len < MAX_DIGEST_SIZE + 9) return false;
 		readUint64(&fi.file_size_, buffer);
@@ -517,92 +679,400 @@ bool FirmwareContainerReader::deserializeManifest(uint8_t* buffer,
 	return buffer_len == 0;
 }
 
+// Reads the footer of a version 2 container, its block index and the
+// manifest. The manifest ends up in output_buffer.
+bool FirmwareContainerReader::loadIndex(ContainerSource* source,
+		uint8_t* compressed_buffer,
+		uint8_t* output_buffer,
+		uint8_t* manifest_digest,
+		uint32_t* manifest_len) {
+	uint8_t footer_buffer[g_FooterSize];
+	const uint8_t* footer;
+	const uint8_t* field;
+	const uint8_t* manifest;
+	const uint8_t* index;
+	std::vector<uint8_t> index_buffer;
+	size_t index_len;
+	uint64_t container_size = source->size();
+	uint64_t manifest_offset;
+	uint32_t manifest_stored_len;
+	uint8_t manifest_codec;
+	uint64_t index_offset;
+	uint32_t index_entries;
+	uint16_t entry_size;
+	uint32_t block_size;
+	uint32_t index_checksum;
+	uint32_t magic;
+
+	if (container_size < 4 + g_FooterSize) {
+		LOG(ERROR) << "Can't read the container footer";
+		return false;
+	}
+	footer = source->read(container_size - g_FooterSize, g_FooterSize,
+			footer_buffer);
+	if (NULL == footer) {
+		return false;
+	}
+	field = footer;
+	readUint64(&manifest_offset, field);
+	field += 8;
+	readUint32(&manifest_stored_len, field);
+	field += 4;
+	readUint32(manifest_len, field);
+	field += 4;
+	manifest_codec = *field++;
+	memcpy(manifest_digest, field, MAX_DIGEST_SIZE);
+	field += MAX_DIGEST_SIZE;
+	readUint64(&index_offset, field);
+	field += 8;
+	readUint32(&index_entries, field);
+	field += 4;
+	readUint16(&entry_size, field);
+	field += 2;
+	readUint32(&block_size, field);
+	field += 4;
+	readUint32(&index_checksum, field);
+	field += 4;
+	readUint32(&magic, field);
+	if (magic != CONTAINER_MAGIC_NUMBER_V2 ||
+		entry_size < g_MinIndexEntrySize ||
+		block_size == 0 || block_size > g_BlockSize ||
+		manifest_stored_len > g_BlockSize || *manifest_len > g_BlockSize ||
+		manifest_offset + manifest_stored_len > index_offset ||
+		index_offset + (uint64_t)index_entries * entry_size !=
+				container_size - g_FooterSize) {
+		LOG(ERROR) << "Corrupted container footer";
+		return false;
+	}
+
+	manifest = source->read(manifest_offset, manifest_stored_len,
+			compressed_buffer);
+	if (NULL == manifest ||
+		!decompressBlock((BlockCodec)manifest_codec,
+			manifest, manifest_stored_len,
+			output_buffer, *manifest_len)) {
+		return false;
+	}
+
+	index_len = (size_t)index_entries * entry_size;
+	if (!source->mapped()) {
+		index_buffer.resize(index_len);
+	}
+	index = source->read(index_offset, index_len, index_buffer.data());
+	if (NULL == index) {
+		return false;
+	}
+	if (blockChecksum(index, index_len) != index_checksum) {
+		LOG(ERROR) << "Block index checksum mismatch";
+		return false;
+	}
+	blocks_.resize(index_entries);
+	field = index;
+	for (ContainerBlock& block : blocks_) {
+		readUint64(&block.offset_, field);
+		readUint32(&block.stored_len_, field + 8);
+		readUint32(&block.len_, field + 12);
+		block.codec_ = field[16];
+		readUint32(&block.checksum_, field + 17);
+		block.base_checksum_ = 0;
+		if (entry_size >= g_IndexEntrySize) {
+			readUint32(&block.base_checksum_, field + 21);
+		}
+		field += entry_size;
+		if (block.len_ > block_size || block.stored_len_ > block_size ||
+			block.offset_ + block.stored_len_ > manifest_offset) {
+			LOG(ERROR) << "Corrupted block index";
+			return false;
+		}
+	}
+	block_size_ = block_size;
+	return true;
+}
+
+// Hands every file its run of index entries and checks that they add up
+// to the file sizes in the manifest.
+bool FirmwareContainerReader::mapBlocks() {
+	uint32_t next_block = 0;
+
+	delta_ = false;
+	for (FileInfo& fi : manifest_) {
+		uint64_t remaining = fi.file_size_;
+
+		fi.first_block_ = next_block;
+		fi.has_delta_ = false;
+		fi.block_count_ = (fi.file_size_ + block_size_ - 1) / block_size_;
+		if (next_block + (uint64_t)fi.block_count_ > blocks_.size()) {
+			LOG(ERROR) << "Block index does not match the manifest";
+			return false;
+		}
+		for (uint32_t idx = 0; idx < fi.block_count_; ++idx) {
+			uint32_t len = remaining < block_size_ ? remaining : block_size_;
+			const ContainerBlock& entry = blocks_[next_block + idx];
+			if (entry.len_ != len) {
+				LOG(ERROR) << "Block index does not match the manifest";
+				return false;
+			}
+			if (isDeltaCodec((BlockCodec)entry.codec_)) {
+				fi.has_delta_ = true;
+				delta_ = true;
+			}
+			remaining -= len;
+		}
+		next_block += fi.block_count_;
+	}
+	if (next_block != blocks_.size()) {
+		LOG(ERROR) << "Block index does not match the manifest";
+		return false;
+	}
+	return true;
+}
+
+// Reads up to len bytes of an installed file, fewer only at its end.
+static ssize_t readInstalled(int fd, uint64_t offset, uint8_t* buffer,
+		size_t len) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rc = pread(fd, buffer + done, len - done, offset + done);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0) {
+			LOG(ERROR) << "Error reading an installed file errno=" << errno;
+			return -1;
+		}
+		if (rc == 0) {
+			break;
+		}
+		done += rc;
+	}
+	return done;
+}
+
+// Opens the installed copy of a file that has delta blocks, *fd is -1 for
+// files shipped whole.
+bool FirmwareContainerReader::openInstalledFile(const FileInfo& file_info,
+		const char* flash_path,
+		const char* storage_path,
+		int* fd) {
+	std::string installed_file_name;
+
+	*fd = -1;
+	if (!file_info.has_delta_) {
+		return true;
+	}
+	const char* prefix = file_info.to_storage_ ? storage_path : flash_path;
+	if (NULL == prefix) {
+		LOG(ERROR) << file_info.archive_path_ << " is a delta against the "
+				"installed file, pass the install paths to verify it";
+		return false;
+	}
+	installed_file_name = prefix;
+	installed_file_name.append("/");
+	installed_file_name.append(file_info.archive_path_);
+	*fd = open(installed_file_name.c_str(), O_RDONLY);
+	if (*fd < 0) {
+		LOG(ERROR) << "The update is a delta against " << installed_file_name
+				<< " which can not be opened, errno=" << errno;
+		return false;
+	}
+	return true;
+}
+
+// Starts reading the blocks of a file from block on. stream->offset_
+// has to point at the block record of a version 1 container.
+void FirmwareContainerReader::startFile(BlockStream* stream,
+		const FileInfo& file_info,
+		int base_fd,
+		uint32_t block) {
+	stream->file_info_ = &file_info;
+	stream->base_fd_ = base_fd;
+	stream->next_block_ = block;
+	stream->queued_all_ = false;
+	stream->current_ = NULL;
+	stream->ends_.clear();
+	stream->consumed_ = stream->offset_;
+}
+
+// Reads the next block of the file into block and submits it, or sets
+// queued_all_ past the last block. The block goes back to the pool when
+// it is not submitted. Version 1 containers are walked record by record
+// and have no block checksums, version 2 blocks are read by index. Delta
+// blocks also get the installed block, which the pool checks against the
+// one they were made against.
+bool FirmwareContainerReader::queueFileBlock(BlockStream* stream,
+		BlockPool::Block* block) {
+	ContainerSource* source = stream->source_;
+	const FileInfo& file_info = *stream->file_info_;
+	uint32_t len;
+	uint32_t compressed_len;
+	ssize_t base_len;
+
+	if (format_version_ == 1) {
+		if (!readUint32At(source, &stream->offset_, &len)) {
+			goto error;
+		}
+		if (0 == len) {
+			stream->queued_all_ = true;
+			stream->pool_->releaseBlock(block);
+			return true;
+		}
+		if (!readUint32At(source, &stream->offset_, &compressed_len)) {
+			goto error;
+		}
+		if (len > g_BlockSize || compressed_len > g_BlockSize) {
+			LOG(ERROR) << "Corrupted block header";
+			goto error;
+		}
+		block->input_len_ = compressed_len;
+		block->output_len_ = len;
+		block->codec_ = compressed_len >= len ? CODEC_STORED : CODEC_LZO1X;
+		block->has_checksum_ = false;
+	} else {
+		if (stream->next_block_ >= file_info.block_count_) {
+			stream->queued_all_ = true;
+			stream->pool_->releaseBlock(block);
+			return true;
+		}
+		const ContainerBlock& entry =
+				blocks_[file_info.first_block_ + stream->next_block_];
+		stream->offset_ = entry.offset_;
+		block->input_len_ = entry.stored_len_;
+		block->output_len_ = entry.len_;
+		block->codec_ = (BlockCodec)entry.codec_;
+		block->checksum_ = entry.checksum_;
+		block->base_checksum_ = entry.base_checksum_;
+		if (isDeltaCodec(block->codec_)) {
+			if (stream->base_fd_ < 0 || NULL == block->base_) {
+				LOG(ERROR) << "No installed file to rebuild "
+						<< file_info.archive_path_ << " from";
+				goto error;
+			}
+			base_len = readInstalled(stream->base_fd_,
+					(uint64_t)stream->next_block_ * block_size_,
+					block->base_, entry.len_);
+			if (base_len < 0) {
+				goto error;
+			}
+			block->base_len_ = base_len;
+		}
+	}
+	block->source_ = source->read(stream->offset_, block->input_len_,
+			block->input_);
+	if (NULL == block->source_) {
+		goto error;
+	}
+	stream->offset_ += block->input_len_;
+	source->willNeed(stream->offset_, g_BlockSize);
+	stream->ends_.push_back(stream->offset_);
+	stream->next_block_++;
+	stream->pool_->submit(block);
+	return true;
+error:
+	stream->pool_->releaseBlock(block);
+	return false;
+}
+
+// Returns the next decoded block of the file, *len is 0 past its last
+// block. Every free slot of the pool is filled first, so the next blocks
+// are read and decoded while the caller writes this one. The block stays
+// valid until the next call.
+bool FirmwareContainerReader::nextFileBlock(BlockStream* stream,
+		const uint8_t** data,
+		uint32_t* len) {
+	DecompressionPool* pool = stream->pool_;
+	BlockPool::Block* block;
+
+	if (stream->current_) {
+		pool->releaseBlock(stream->current_);
+		stream->current_ = NULL;
+	}
+	while (!stream->queued_all_) {
+		block = pool->getFreeBlock();
+		if (NULL == block) {
+			break;
+		}
+		if (!queueFileBlock(stream, block)) {
+			return false;
+		}
+	}
+	block = pool->takeCompleted(true);
+	if (NULL == block) {
+		stream->consumed_ = stream->offset_;
+		*len = 0;
+		return true;
+	}
+	stream->current_ = block;
+	if (block->failed_) {
+		LOG(ERROR) << "Block " << stream->next_block_ - stream->ends_.size()
+				<< " of " << stream->file_info_->archive_path_
+				<< " is corrupted";
+		return false;
+	}
+	stream->consumed_ = stream->ends_.front();
+	stream->ends_.pop_front();
+	*data = DecompressionPool::data(block);
+	*len = block->output_len_;
+	return true;
+}
+
 bool FirmwareContainerReader::verifyFiles() {
-	FILE* input = NULL;
+	return verifyFiles(NULL, NULL);
+}
+
+bool FirmwareContainerReader::verifyFiles(const char* flash_path,
+		const char* storage_path) {
+	ContainerSource source(container_path_);
+	DecompressionPool pool(threads_,
+			format_version_ == 2 ? block_size_ : g_BlockSize, delta_);
+	BlockStream stream;
+	const uint8_t* data;
 	uint32_t input_len;
-	uint32_t compressed_len;
 	gcry_md_hd_t hd = NULL;
 	gcry_error_t error;
-	uint8_t* compressed_buffer = NULL;
-	uint8_t* output_buffer = NULL;
 	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
 	unsigned char *file_digest;
-	size_t read_len;
-	lzo_uint output_len;
-	int rc;
+	int base_fd = -1;
 	bool result = false;
 
 	if (manifest_.size() == 0) {
 		LOG(ERROR) << "Please call loadManifest first";
 		goto exit;
 	}
-	input = fopen(container_path_.c_str(), "rb");
-	if (NULL == input) {
-		LOG(ERROR) << "Unable to open container " << container_path_;
-		goto exit;
-	}
-	if (0 != fseek(input, MAX_DIGEST_SIZE + 8, SEEK_SET)) {
-		LOG(ERROR) << "Can't seek in the container errno=" << errno;
+	if (!source.open(use_mmap_)) {
 		goto exit;
 	}
-	if (!freadUint32(&compressed_len, input)) {
-		goto exit;
-	}
-	if (0 != fseek(input, compressed_len, SEEK_CUR)) {
-		LOG(ERROR) << "Can't seek in the container errno=" << errno;
-		goto exit;
+	if (memory_budget_ > 0) {
+		pool.setMemoryBudget(memory_budget_);
 	}
-
-	output_buffer = new uint8_t[g_BlockSize];
-	if (NULL == output_buffer) {
-		LOG(ERROR) << "Out of memory";
+	if (!pool.start()) {
 		goto exit;
 	}
-	compressed_buffer = new uint8_t[g_BlockSize];
-	if (NULL == compressed_buffer) {
-		LOG(ERROR) << "Out of memory";
+	error = gcry_md_open(&hd, g_HashAlgo, 0);
+	if (error != 0) {
+		LOG(ERROR) << "Can not initialize the gcrypt hash library: "
+				<< error;
 		goto exit;
 	}
-	for (FileInfo fi : manifest_) {
-		if (hd) {
-			gcry_md_close(hd);
-			hd = NULL;
-		}
-		error = gcry_md_open(&hd, g_HashAlgo, 0);
-		if (error != 0) {
-			LOG(ERROR) << "Can not initialize the gcrypt hash library: "
-					<< error;
+	stream.pool_ = &pool;
+	stream.source_ = &source;
+	stream.offset_ = files_offset_;
+	for (const FileInfo& fi : manifest_) {
+		if (!openInstalledFile(fi, flash_path, storage_path, &base_fd)) {
 			goto exit;
 		}
+		gcry_md_reset(hd);
+		startFile(&stream, fi, base_fd, 0);
 		do {
-			if (!freadUint32(&input_len, input)) {
-				goto exit;
-			}
-			if (0 == input_len) break;
-			if (!freadUint32(&compressed_len, input)) {
+			if (!nextFileBlock(&stream, &data, &input_len)) {
 				goto exit;
 			}
-			read_len = fread(compressed_buffer, 1, compressed_len, input);
-			if (read_len != compressed_len) {
-				LOG(ERROR) << "Error reading input file.";
-				goto exit;
-			}
-			if (compressed_len < input_len) {
-				output_len = g_BlockSize;
-				rc = lzo1x_decompress_safe(compressed_buffer,
-						compressed_len,
-						output_buffer,
-						&output_len,
-						NULL);
-				if (rc != LZO_E_OK || output_len != input_len) {
-					LOG(ERROR) << "Error decompressin ght manifest";
-					goto exit;
-				}
-			} else {
-				memcpy(output_buffer, compressed_buffer, input_len);
-			}
-			gcry_md_write(hd, output_buffer, input_len);
-		} while (true);
+			gcry_md_write(hd, data, input_len);
+		} while (input_len != 0);
+		if (base_fd >= 0) {
+			close(base_fd);
+			base_fd = -1;
+		}
 		file_digest = gcry_md_read(hd, g_HashAlgo);
 		if (0 != memcmp(fi.digest_, file_digest, digest_len)) {
 			LOG(ERROR) << "File checksum mismatch.";
@@ -611,24 +1081,152 @@ bool FirmwareContainerReader::verifyFiles() {
 	}
 	result = true;
 exit:
-	delete [] compressed_buffer;
-	delete [] output_buffer;
+	pool.stop();
+	if (base_fd >= 0) close(base_fd);
 	if (hd) gcry_md_close(hd);
-    if (input) fclose(input);
 	return result;
 }
 
+// Skips blocks the .updated file already holds. Version 1 containers
+// have to walk the block records, version 2 blocks are read by index.
+bool FirmwareContainerReader::skipFileBlocks(ContainerSource* source,
+		uint64_t* offset,
+		uint32_t blocks) {
+	uint32_t len;
+	uint32_t compressed_len;
+
+	if (format_version_ != 1) {
+		return true;
+	}
+	for (uint32_t idx = 0; idx < blocks; ++idx) {
+		if (!readUint32At(source, offset, &len)) {
+			return false;
+		}
+		if (0 == len) {
+			// Only the terminator of a complete file may be skipped.
+			if (idx + 1 == blocks) {
+				return true;
+			}
+			LOG(ERROR) << "The update journal does not match the container";
+			return false;
+		}
+		if (!readUint32At(source, offset, &compressed_len)) {
+			return false;
+		}
+		if (len > g_BlockSize || compressed_len > g_BlockSize) {
+			LOG(ERROR) << "Corrupted block header";
+			return false;
+		}
+		*offset += compressed_len;
+	}
+	return true;
+}
+
+// The digest of what has been hashed so far, hd keeps going.
+static bool currentDigest(gcry_md_hd_t hd, uint8_t* digest) {
+	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
+	gcry_md_hd_t copy;
+
+	if (0 != gcry_md_copy(&copy, hd)) {
+		LOG(ERROR) << "Can not copy the hash state";
+		return false;
+	}
+	memcpy(digest, gcry_md_read(copy, g_HashAlgo), digest_len);
+	gcry_md_close(copy);
+	return true;
+}
+
+// Picks up a file an interrupted update left behind. The hash state can
+// not be saved, so the part of the .updated file the journal vouches for
+// is read back into hd, which also proves it survived the power loss.
+// Returns the number of bytes to keep, 0 starts the file over.
+uint64_t FirmwareContainerReader::resumeFile(const UpdateJournal& journal,
+		uint32_t file_index,
+		const FileInfo& file_info,
+		const std::string& file_path,
+		gcry_md_hd_t hd) {
+	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
+	const uint32_t block_size = format_version_ == 2 ? block_size_ : g_BlockSize;
+	uint8_t journal_digest[JOURNAL_DIGEST_SIZE];
+	uint8_t digest[MAX_DIGEST_SIZE];
+	uint8_t buffer[16384];
+	uint64_t length;
+	uint64_t done = 0;
+	int fd;
+
+	if (!journal.progress(file_index, &length, journal_digest) ||
+			0 == length || length > file_info.file_size_ ||
+			(length != file_info.file_size_ && 0 != length % block_size)) {
+		return 0;
+	}
+	fd = open(file_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOG(WARNING) << "Journaled file " << file_path << " is gone";
+		return 0;
+	}
+	// Read what is on the media, not what the page cache remembers.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	while (done < length) {
+		size_t chunk = length - done < sizeof(buffer) ?
+				length - done : sizeof(buffer);
+		ssize_t rc = pread(fd, buffer, chunk, done);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			break;
+		}
+		gcry_md_write(hd, buffer, rc);
+		done += rc;
+	}
+	close(fd);
+	if (done != length || !currentDigest(hd, digest) ||
+			0 != memcmp(digest, journal_digest, digest_len)) {
+		LOG(WARNING) << "Journaled part of " << file_path
+				<< " does not verify, starting it over";
+		gcry_md_reset(hd);
+		return 0;
+	}
+	LOG(INFO) << "Resuming " << file_path << " at " << length << " bytes";
+	return length;
+}
+
+// Every block is decompressed once, written to the .updated file and
+// hashed as written. The digest is checked against the manifest when the
+// file ends, before anything is renamed, so the container does not need
+// a separate verifyFiles() pass. Each file is synced on its own and the
+// directories after the renames, nothing waits for a global sync().
+// With the journal enabled the progress is recorded as it goes and an
+// interrupted update of the same container carries on from there.
+// Blocks are decoded on the pool, so while one block is written and
+// hashed the next ones are read from the container and decoded.
 bool FirmwareContainerReader::performUpdate(const char* flash_path,
 		const char* storage_path) {
-	FILE* input = NULL;
-	FILE* output = NULL;
+	ContainerSource source(container_path_);
+	DecompressionPool pool(threads_,
+			format_version_ == 2 ? block_size_ : g_BlockSize, delta_);
+	BlockStream stream;
+	UpdateJournal journal(std::string(storage_path) + "/" + g_JournalName);
+	uint64_t offset = files_offset_;
+	uint64_t released = files_offset_;
+	const uint8_t* data;
+	FlashWriter output(g_BlockSize, direct_io_);
+	uint64_t bytes_written = 0;
+	uint64_t start_time = timeGetTimeUs();
+	uint64_t elapsed_us;
 	uint32_t input_len;
-	uint32_t compressed_len;
-	uint8_t* compressed_buffer = NULL;
-	uint8_t* output_buffer = NULL;
-	size_t read_len;
-	lzo_uint output_len;
-	int rc;
+	uint32_t block;
+	gcry_md_hd_t hd = NULL;
+	gcry_error_t error;
+	const unsigned int digest_len = gcry_md_get_algo_dlen(g_HashAlgo);
+	unsigned char *file_digest;
+	uint8_t journal_digest[JOURNAL_DIGEST_SIZE];
+	const uint32_t block_size =
+			format_version_ == 2 ? block_size_ : g_BlockSize;
+	uint32_t file_index = 0;
+	bool renames_only = false;
+	bool direct_io = false;
+	int base_fd = -1;
 	bool result = false;
     struct stat stat_buf;
 
@@ -636,35 +1234,41 @@ bool FirmwareContainerReader::performUpdate(const char* flash_path,
 		LOG(ERROR) << "Please call loadManifest first";
 		goto exit;
 	}
-	input = fopen(container_path_.c_str(), "rb");
-	if (NULL == input) {
-		LOG(ERROR) << "Unable to open container " << container_path_;
-		goto exit;
-	}
-	if (0 != fseek(input, MAX_DIGEST_SIZE + 8, SEEK_SET)) {
-		LOG(ERROR) << "Can't seek in the container errno=" << errno;
+	if (!source.open(use_mmap_)) {
 		goto exit;
 	}
-	if (!freadUint32(&compressed_len, input)) {
-		goto exit;
+	// The pool holds every block buffer, a block is written while the
+	// next ones are read and decoded.
+	if (memory_budget_ > 0) {
+		pool.setMemoryBudget(memory_budget_);
 	}
-	if (0 != fseek(input, compressed_len, SEEK_CUR)) {
-		LOG(ERROR) << "Can't seek in the container errno=" << errno;
+	if (!pool.start()) {
 		goto exit;
 	}
-
-	output_buffer = new uint8_t[g_BlockSize];
-	if (NULL == output_buffer) {
-		LOG(ERROR) << "Out of memory";
+	error = gcry_md_open(&hd, g_HashAlgo, 0);
+	if (error != 0) {
+		LOG(ERROR) << "Can not initialize the gcrypt hash library: "
+				<< error;
 		goto exit;
 	}
-	compressed_buffer = new uint8_t[g_BlockSize];
-	if (NULL == compressed_buffer) {
-		LOG(ERROR) << "Out of memory";
-		goto exit;
+	stream.pool_ = &pool;
+	stream.source_ = &source;
+	if (journal_blocks_ > 0) {
+		if (!journal.open(manifest_digest_)) {
+			goto exit;
+		}
+		// Every file was written and verified before the power went.
+		renames_only = journal.committed();
 	}
 	for (FileInfo fi : manifest_) {
 		std::string output_file_name;
+		uint64_t file_bytes = 0;
+		uint32_t pending = 0;
+		bool complete;
+
+		if (renames_only) {
+			break;
+		}
 		if (fi.to_storage_) {
 			output_file_name = storage_path;
 		} else {
@@ -674,63 +1278,104 @@ bool FirmwareContainerReader::performUpdate(const char* flash_path,
 		output_file_name.append(fi.archive_path_);
 		output_file_name.append(".updated");
 
-		output = fopen(output_file_name.c_str(), "wb");
-		if (NULL == output) {
-			LOG(ERROR) << "Can't open output file: " << output_file_name;
+		gcry_md_reset(hd);
+		if (journal_blocks_ > 0) {
+			file_bytes = resumeFile(journal, file_index, fi, output_file_name,
+					hd);
+		}
+		complete = file_bytes != 0 && file_bytes == fi.file_size_;
+		block = (file_bytes + block_size - 1) / block_size;
+		// A complete file skips its end of file record too.
+		if (!skipFileBlocks(&source, &offset, complete ? block + 1 : block)) {
 			goto exit;
 		}
-		do {
-			if (!freadUint32(&input_len, input)) {
-				goto exit;
-			}
-			if (0 == input_len) break;
-			if (!freadUint32(&compressed_len, input)) {
+		source.dontNeed(released, offset - released);
+		released = offset;
+		if (!complete) {
+			// The installed file stays in place until every file is written.
+			if (!openInstalledFile(fi, flash_path, storage_path, &base_fd)) {
 				goto exit;
 			}
-			read_len = fread(compressed_buffer, 1, compressed_len, input);
-			if (read_len != compressed_len) {
-				LOG(ERROR) << "Error reading input file.";
+			if (!output.openAt(output_file_name, file_bytes)) {
 				goto exit;
 			}
-			if (compressed_len < input_len) {
-				output_len = g_BlockSize;
-				rc = lzo1x_decompress_safe(compressed_buffer,
-						compressed_len,
-						output_buffer,
-						&output_len,
-						NULL);
-				if (rc != LZO_E_OK || output_len != input_len) {
-					LOG(ERROR) << "Error decompressin ght manifest";
+			stream.offset_ = offset;
+			startFile(&stream, fi, base_fd, block);
+			do {
+				if (!nextFileBlock(&stream, &data, &input_len)) {
+					goto exit;
+				}
+				if (!output.write(data, input_len)) {
 					goto exit;
 				}
-			} else {
-				memcpy(output_buffer, compressed_buffer, input_len);
+				gcry_md_write(hd, data, input_len);
+				file_bytes += input_len;
+				// The container is read once, keep the page cache for the
+				// files being written. Blocks still in the pool keep theirs.
+				if (stream.consumed_ > released) {
+					source.dontNeed(released, stream.consumed_ - released);
+					released = stream.consumed_;
+				}
+				if (journal_blocks_ > 0 && input_len != 0 &&
+						++pending == journal_blocks_) {
+					pending = 0;
+					if (!output.sync() ||
+							!currentDigest(hd, journal_digest) ||
+							!journal.record(file_index, file_bytes,
+									journal_digest)) {
+						goto exit;
+					}
+				}
+			} while (input_len != 0);
+			offset = stream.offset_;
+			if (base_fd >= 0) {
+				close(base_fd);
+				base_fd = -1;
 			}
-			output_len = fwrite(output_buffer, 1, input_len, output);
-			if (output_len != input_len) {
-				LOG(ERROR) << "Can't write to output file: "
-						<< output_file_name;
+			// Checked before the tail turns O_DIRECT off.
+			direct_io = direct_io || output.directIo();
+			if (!output.finish()) {
 				goto exit;
 			}
-		} while (true);
-		fclose(output);
-		output = NULL;
-		if (!checksumFile(output_file_name, fi.digest_)) {
+			bytes_written += output.bytesWritten();
+		}
+		file_digest = gcry_md_read(hd, g_HashAlgo);
+		if (0 != memcmp(fi.digest_, file_digest, digest_len)) {
 			LOG(ERROR) << "File checksum does not match: " << output_file_name;
 			goto exit;
 		}
+		if (!complete && readback_ &&
+				!checksumFile(output_file_name, fi.digest_)) {
+			LOG(ERROR) << "Readback checksum does not match: "
+					<< output_file_name;
+			goto exit;
+		}
+		if (journal_blocks_ > 0 && !complete &&
+				!journal.record(file_index, file_bytes, fi.digest_)) {
+			goto exit;
+		}
+		file_index++;
+	}
+	if (journal_blocks_ > 0 && !renames_only && !journal.commit()) {
+		goto exit;
 	}
 	// Delete old save files.
 	for (FileInfo fi : manifest_) {
+		std::string destination_file_name;
 		std::string saved_file_name;
 		if (fi.to_storage_) {
-			saved_file_name = storage_path;
+			destination_file_name = storage_path;
 		} else {
-			saved_file_name = flash_path;
+			destination_file_name = flash_path;
 		}
-		saved_file_name.append("/");
-		saved_file_name.append(fi.archive_path_);
+		destination_file_name.append("/");
+		destination_file_name.append(fi.archive_path_);
+		saved_file_name = destination_file_name;
 		saved_file_name.append(".old");
+		// An interrupted rename leaves the installed file only as .old.
+		if (0 != stat(destination_file_name.c_str(), & stat_buf)) {
+			continue;
+		}
 		if (0 == stat(saved_file_name.c_str(), & stat_buf)) {
 			if (0 != unlink(saved_file_name.c_str())) {
 				LOG(ERROR) << "Can not remove " << saved_file_name;
@@ -742,9 +1387,6 @@ bool FirmwareContainerReader::performUpdate(const char* flash_path,
 			}
 		}
 	}
-	sync();
-	sync();
-	sync();
 	// Rename the updates.
 	for (FileInfo fi : manifest_) {
 		std::string destination_file_name;
@@ -762,6 +1404,10 @@ bool FirmwareContainerReader::performUpdate(const char* flash_path,
 		saved_file_name.append(".old");
 		updated_file_name.append(".updated");
 
+		if (renames_only && 0 != stat(updated_file_name.c_str(), &stat_buf)) {
+			// Renamed before the power went.
+			continue;
+		}
 		if (0 == stat(destination_file_name.c_str(), &stat_buf) &&
 		    0 != rename(destination_file_name.c_str(),
 				saved_file_name.c_str())) {
@@ -774,14 +1420,26 @@ bool FirmwareContainerReader::performUpdate(const char* flash_path,
 			goto exit;
 		}
 	}
+	if (!FlashWriter::syncDirectory(flash_path) ||
+		!FlashWriter::syncDirectory(storage_path)) {
+		goto exit;
+	}
+	elapsed_us = timeGetTimeUs() - start_time;
+	LOG(INFO) << "Update wrote " << bytes_written << " bytes in "
+			<< elapsed_us / 1000 << "ms, "
+			<< (elapsed_us ? bytes_written / elapsed_us : 0) << "MB/s"
+			<< (direct_io ? " with direct I/O" : "");
+	journal.remove();
 	result = true;
 exit:
-	if (output) fclose(output);
-	delete [] compressed_buffer;
-	delete [] output_buffer;
-    if (input) fclose(input);
+	pool.stop();
+	output.abort();
+	if (base_fd >= 0) close(base_fd);
+	if (hd) gcry_md_close(hd);
+	source.close();
     if (!result) {
     	revertUpdate(flash_path, storage_path);
+    	journal.remove();
     }
 	return result;
 }
@@ -802,6 +1460,9 @@ bool FirmwareContainerReader::checksumFile(const std::string& file_path,
 		LOG(ERROR) << "Can not open the input file: " << file_path;
 		goto exit;
 	}
+	// The file has been synced, drop it from the page cache so the
+	// checksum covers what is actually stored.
+	posix_fadvise(fileno(input), 0, 0, POSIX_FADV_DONTNEED);
 
 	error = gcry_md_open(&hd, g_HashAlgo, 0);
 	if (error != 0) {
@@ -835,6 +1496,7 @@ void FirmwareContainerReader::revertUpdate(const char* flash_path,
 		} else {
 			destination_file_name = flash_path;
 		}
+		destination_file_name.append("/");
 		destination_file_name.append(fi.archive_path_);
 		saved_file_name = destination_file_name;
 		updated_file_name = destination_file_name;
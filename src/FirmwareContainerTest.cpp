@@ -0,0 +1,858 @@
+/*
+ * FirmwareContainerTest.cpp
+ *
+ *  Created on: Jul 14, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "BlockCodec.h"
+#include "ContainerSource.h"
+#include "FirmwareContainer.h"
+#include "UpdateJournal.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <ftw.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <lzo/lzoconf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using iqurius::FirmwareContainerReader;
+using iqurius::FirmwareContainerWriter;
+using iqurius::UpdateJournal;
+
+static constexpr size_t g_BlockSize = 1024*1024;
+// Match the version 2 layout in FirmwareContainer.cpp.
+static constexpr size_t g_IndexEntrySize = 8 + 4 + 4 + 1 + 4 + 4;
+static constexpr size_t g_FooterSize =
+		8 + 4 + 4 + 1 + iqurius::MAX_DIGEST_SIZE + 8 + 4 + 2 + 4 + 4 + 4;
+static constexpr size_t g_FooterIndexOffset =
+		8 + 4 + 4 + 1 + iqurius::MAX_DIGEST_SIZE;
+// Match the journal layout in UpdateJournal.cpp.
+static constexpr size_t g_JournalHeaderSize =
+		4 + iqurius::JOURNAL_DIGEST_SIZE;
+static constexpr size_t g_JournalRecordSize =
+		4 + 8 + iqurius::JOURNAL_DIGEST_SIZE + 4;
+
+struct TestFile {
+	const char* name_;
+	bool to_storage_;
+	std::vector<uint8_t> data_;
+};
+
+static std::string g_TestDir;
+static std::vector<TestFile> g_Files;
+
+// Crash points of the resume tests. The process exits at the given call
+// without cleaning up, the way an update stops on a power loss.
+static int g_SyncsLeft = -1;
+static int g_RenamesLeft = -1;
+static constexpr int g_CrashExitCode = 42;
+
+extern "C" int fdatasync(int fd) {
+	if (g_SyncsLeft >= 0 && 0 == g_SyncsLeft--) {
+		_exit(g_CrashExitCode);
+	}
+	return syscall(SYS_fdatasync, fd);
+}
+
+extern "C" int rename(const char* from, const char* to) {
+	if (g_RenamesLeft >= 0 && 0 == g_RenamesLeft--) {
+		_exit(g_CrashExitCode);
+	}
+	return renameat(AT_FDCWD, from, AT_FDCWD, to);
+}
+
+#define EXPECT(cond) \
+	do { \
+		if (!(cond)) { \
+			LOG(ERROR) << __FUNCTION__ << ": " #cond " failed"; \
+			return false; \
+		} \
+	} while (0)
+
+static bool readFile(const std::string& path, std::vector<uint8_t>* data) {
+	FILE* file = fopen(path.c_str(), "rb");
+	uint8_t buffer[65536];
+	size_t len;
+
+	data->clear();
+	if (NULL == file) {
+		return false;
+	}
+	while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data->insert(data->end(), buffer, buffer + len);
+	}
+	fclose(file);
+	return true;
+}
+
+static bool writeFile(const std::string& path,
+		const std::vector<uint8_t>& data) {
+	FILE* file = fopen(path.c_str(), "wb");
+	bool result;
+
+	if (NULL == file) {
+		return false;
+	}
+	result = fwrite(data.data(), 1, data.size(), file) == data.size();
+	return 0 == fclose(file) && result;
+}
+
+static int removeEntry(const char* path, const struct stat*, int,
+		struct FTW*) {
+	return ::remove(path);
+}
+
+static void removeTree(const std::string& path) {
+	nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void makeDir(const std::string& path) {
+	removeTree(path);
+	mkdir(path.c_str(), 0755);
+}
+
+// Compressible log like text, the last quarter zero padded like the end
+// of an image.
+static std::vector<uint8_t> textData(size_t len) {
+	std::vector<uint8_t> data;
+	char line[64];
+
+	for (uint32_t idx = 0; data.size() < len; ++idx) {
+		int line_len = snprintf(line, sizeof(line),
+				"line %u of the update log, state %u\n", idx, idx * 7 % 13);
+		data.insert(data.end(), line, line + line_len);
+	}
+	data.resize(len);
+	memset(&data[len - len / 4], 0, len / 4);
+	return data;
+}
+
+static std::vector<uint8_t> randomData(size_t len, unsigned int seed) {
+	std::vector<uint8_t> data(len);
+
+	for (uint8_t& byte : data) {
+		byte = rand_r(&seed) >> 7;
+	}
+	return data;
+}
+
+static std::string sourcePath(const TestFile& file) {
+	return g_TestDir + "/source/" + file.name_;
+}
+
+static std::string installedPath(const TestFile& file) {
+	return g_TestDir + (file.to_storage_ ? "/storage/" : "/flash/") +
+			file.name_;
+}
+
+static bool setUp() {
+	char dir[] = "/tmp/FirmwareContainerTestXXXXXX";
+
+	if (NULL == mkdtemp(dir)) {
+		return false;
+	}
+	g_TestDir = dir;
+	makeDir(g_TestDir + "/source");
+	// Several blocks of each codec outcome, a partial last block, a file
+	// shorter than a block and an empty one.
+	g_Files.push_back({ "kernel.img", false,
+			textData(2 * g_BlockSize + 12345) });
+	g_Files.push_back({ "settings.bin", true, randomData(70000, 1) });
+	g_Files.push_back({ "SYSTEM", false,
+			std::vector<uint8_t>(g_BlockSize + 100, 0) });
+	g_Files.push_back({ "empty", false, std::vector<uint8_t>() });
+	for (const TestFile& file : g_Files) {
+		if (!writeFile(sourcePath(file), file.data_)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool writeContainer(const std::string& path,
+		int format_version,
+		iqurius::CodecPolicy policy,
+		size_t threads) {
+	FirmwareContainerWriter writer("1.2.3");
+
+	writer.setFormatVersion(format_version);
+	writer.setCodecPolicy(policy);
+	writer.setThreads(threads);
+	for (const TestFile& file : g_Files) {
+		if (!writer.addFile(sourcePath(file).c_str(), file.name_,
+				file.to_storage_)) {
+			return false;
+		}
+	}
+	return writer.writeContainer(path.c_str());
+}
+
+static bool installedFilesMatch() {
+	std::vector<uint8_t> data;
+
+	for (const TestFile& file : g_Files) {
+		if (!readFile(installedPath(file), &data) || data != file.data_) {
+			LOG(ERROR) << file.name_ << " does not match the source";
+			return false;
+		}
+	}
+	return true;
+}
+
+static void makeInstallDirs() {
+	makeDir(g_TestDir + "/flash");
+	makeDir(g_TestDir + "/storage");
+}
+
+static bool updateFrom(const std::string& path, size_t threads,
+		bool use_mmap = true, uint32_t journal_blocks = 0) {
+	FirmwareContainerReader reader(path.c_str());
+
+	reader.setThreads(threads);
+	reader.setUseMmap(use_mmap);
+	reader.setDirectIo(false);
+	reader.setJournalInterval(journal_blocks);
+	return reader.loadManifest() &&
+			reader.performUpdate((g_TestDir + "/flash").c_str(),
+					(g_TestDir + "/storage").c_str());
+}
+
+static bool testRoundTrip(int format_version, iqurius::CodecPolicy policy) {
+	std::string path = g_TestDir + "/update.fwu";
+
+	EXPECT(writeContainer(path, format_version, policy, 3));
+	for (size_t threads : { 1, 4 }) {
+		for (bool use_mmap : { true, false }) {
+			FirmwareContainerReader reader(path.c_str());
+			reader.setThreads(threads);
+			reader.setUseMmap(use_mmap);
+			EXPECT(reader.loadManifest());
+			EXPECT(reader.formatVersion() == format_version);
+			EXPECT(!reader.isDelta());
+			EXPECT(reader.verifyFiles());
+		}
+	}
+	for (size_t threads : { 1, 2 }) {
+		for (bool use_mmap : { true, false }) {
+			makeInstallDirs();
+			EXPECT(updateFrom(path, threads, use_mmap));
+			EXPECT(installedFilesMatch());
+		}
+	}
+	return true;
+}
+
+// Blocks come out of the compression pool in order.
+static bool testThreadsDoNotChangeOutput(int format_version) {
+	std::vector<uint8_t> single;
+	std::vector<uint8_t> pooled;
+
+	EXPECT(writeContainer(g_TestDir + "/single.fwu", format_version,
+			iqurius::POLICY_LZO, 1));
+	EXPECT(writeContainer(g_TestDir + "/pooled.fwu", format_version,
+			iqurius::POLICY_LZO, 5));
+	EXPECT(readFile(g_TestDir + "/single.fwu", &single));
+	EXPECT(readFile(g_TestDir + "/pooled.fwu", &pooled));
+	EXPECT(single == pooled);
+	return true;
+}
+
+// Writes a copy of the container with a byte flipped.
+static std::string corruptCopy(const std::vector<uint8_t>& container,
+		size_t offset) {
+	std::string path = g_TestDir + "/corrupt.fwu";
+	std::vector<uint8_t> copy(container);
+
+	copy[offset] ^= 0x55;
+	writeFile(path, copy);
+	return path;
+}
+
+static bool loadsManifest(const std::string& path) {
+	FirmwareContainerReader reader(path.c_str());
+	return reader.loadManifest();
+}
+
+static bool verifies(const std::string& path) {
+	FirmwareContainerReader reader(path.c_str());
+	return reader.loadManifest() && reader.verifyFiles();
+}
+
+static bool testVersion1RejectsCorruption() {
+	std::string path = g_TestDir + "/update.fwu";
+	std::vector<uint8_t> container;
+
+	EXPECT(writeContainer(path, 1, iqurius::POLICY_LZO, 1));
+	EXPECT(readFile(path, &container));
+	EXPECT(!loadsManifest(corruptCopy(container, 0)));
+	EXPECT(!verifies(corruptCopy(container, container.size() / 2)));
+	return true;
+}
+
+// The files are checked before anything is renamed, a corrupted container
+// leaves the installed files and no .updated files behind.
+static bool testFailedUpdateKeepsInstalledFiles(int format_version) {
+	std::string path = g_TestDir + "/update.fwu";
+	std::vector<uint8_t> container;
+	std::vector<uint8_t> data;
+
+	EXPECT(writeContainer(path, format_version, iqurius::POLICY_LZO, 1));
+	EXPECT(readFile(path, &container));
+	makeInstallDirs();
+	for (const TestFile& file : g_Files) {
+		EXPECT(writeFile(installedPath(file), textData(5000)));
+	}
+	EXPECT(!updateFrom(corruptCopy(container, container.size() / 2), 2));
+	for (const TestFile& file : g_Files) {
+		EXPECT(readFile(installedPath(file), &data));
+		EXPECT(data == textData(5000));
+		EXPECT(0 != access((installedPath(file) + ".updated").c_str(),
+				F_OK));
+	}
+	return true;
+}
+
+static uint64_t readUint64(const uint8_t* buffer) {
+	uint64_t value = 0;
+
+	for (int idx = 7; idx >= 0; --idx) {
+		value = (value << 8) | buffer[idx];
+	}
+	return value;
+}
+
+// Offset of the block index of a version 2 container.
+static size_t indexOffset(const std::vector<uint8_t>& container) {
+	return readUint64(&container[container.size() - g_FooterSize +
+			g_FooterIndexOffset]);
+}
+
+static bool testVersion2RejectsCorruption() {
+	std::string path = g_TestDir + "/update.fwu";
+	std::vector<uint8_t> container;
+
+	EXPECT(writeContainer(path, 2, iqurius::POLICY_LZO, 1));
+	EXPECT(readFile(path, &container));
+	const size_t footer = container.size() - g_FooterSize;
+	const size_t index = indexOffset(container);
+	EXPECT(index + g_IndexEntrySize <= footer);
+
+	// Block data, caught by the block checksum.
+	EXPECT(loadsManifest(corruptCopy(container, 100)));
+	EXPECT(!verifies(corruptCopy(container, 100)));
+	// Every byte of the first index entry.
+	for (size_t offset = 0; offset < g_IndexEntrySize; ++offset) {
+		EXPECT(!loadsManifest(corruptCopy(container, index + offset)));
+	}
+	// Every byte of the footer.
+	for (size_t offset = footer; offset < container.size(); ++offset) {
+		EXPECT(!verifies(corruptCopy(container, offset)));
+	}
+	std::vector<uint8_t> truncated(container.begin(), container.end() - 1);
+	EXPECT(writeFile(g_TestDir + "/truncated.fwu", truncated));
+	EXPECT(!loadsManifest(g_TestDir + "/truncated.fwu"));
+	return true;
+}
+
+static bool testCodecs() {
+	using namespace iqurius;
+	static const BlockCodec codecs[] = {
+		CODEC_STORED, CODEC_LZO1X, CODEC_LZ4, CODEC_ZSTD,
+	};
+	std::vector<uint8_t> input = textData(g_BlockSize);
+	std::vector<uint8_t> stored(compressedBound(input.size()));
+	std::vector<uint8_t> output(input.size());
+	std::vector<uint8_t> work(compressWorkMemory());
+	size_t stored_len = 0;
+
+	for (BlockCodec codec : codecs) {
+		if (!codecAvailable(codec)) {
+			LOG(INFO) << "Skipping " << codecName(codec);
+			continue;
+		}
+		stored_len = stored.size();
+		if (codec == CODEC_STORED) {
+			memcpy(stored.data(), input.data(), input.size());
+			stored_len = input.size();
+		} else {
+			EXPECT(compressBlock(codec, input.data(), input.size(),
+					stored.data(), &stored_len, work.data()));
+			EXPECT(stored_len < input.size());
+		}
+		EXPECT(decompressBlock(codec, stored.data(), stored_len,
+				output.data(), output.size()));
+		EXPECT(output == input);
+		// A block has to expand to exactly its indexed size.
+		EXPECT(!decompressBlock(codec, stored.data(), stored_len,
+				output.data(), output.size() - 1));
+	}
+	EXPECT(!decompressBlock(CODEC_COUNT, stored.data(), stored_len,
+			output.data(), output.size()));
+	EXPECT(blockChecksum(input.data(), input.size()) ==
+			blockChecksum(output.data(), output.size()));
+	output[output.size() / 2] ^= 1;
+	EXPECT(blockChecksum(input.data(), input.size()) !=
+			blockChecksum(output.data(), output.size()));
+	return true;
+}
+
+static bool testCodecPolicies() {
+	using namespace iqurius;
+	static const char* policies[] = {
+		"lzo", "lz4", "zstd", "store", "ratio", "decode",
+	};
+	std::vector<uint8_t> text = textData(g_BlockSize);
+	std::vector<uint8_t> noise = randomData(g_BlockSize, 3);
+	std::vector<uint8_t> stored(compressedBound(g_BlockSize));
+	std::vector<uint8_t> scratch(compressedBound(g_BlockSize));
+	std::vector<uint8_t> output(g_BlockSize);
+	std::vector<uint8_t> work(compressWorkMemory());
+	CodecPolicy policy;
+	BlockCodec codec;
+	size_t stored_len;
+
+	EXPECT(!parseCodecPolicy("fastest", &policy));
+	for (const char* name : policies) {
+		if (!parseCodecPolicy(name, &policy)) {
+			LOG(INFO) << "Skipping policy " << name;
+			continue;
+		}
+		for (const std::vector<uint8_t>* input : { &text, &noise }) {
+			stored_len = stored.size();
+			EXPECT(compressBlockWithPolicy(policy,
+					input->data(), input->size(),
+					stored.data(), &stored_len, &codec,
+					work.data(), scratch.data()));
+			const uint8_t* data = codec == CODEC_STORED ?
+					input->data() : stored.data();
+			EXPECT(codec != CODEC_STORED || stored_len == input->size());
+			EXPECT(decompressBlock(codec, data, stored_len,
+					output.data(), output.size()));
+			EXPECT(output == *input);
+			// Noise is always stored, text only when asked to.
+			EXPECT((codec == CODEC_STORED) ==
+					(input == &noise || policy == POLICY_STORE));
+		}
+	}
+	return true;
+}
+
+static bool testVersion1RejectsOtherCodecs() {
+	EXPECT(!writeContainer(g_TestDir + "/store.fwu", 1,
+			iqurius::POLICY_STORE, 1));
+	return true;
+}
+
+// Mapped or not, reads return the same bytes and stop at the end.
+static bool testContainerSource() {
+	const std::string path = g_TestDir + "/source.bin";
+	const std::vector<uint8_t> data = randomData(3 * 4096 + 123, 4);
+	std::vector<uint8_t> scratch(data.size());
+	const uint8_t* read;
+
+	EXPECT(writeFile(path, data));
+	for (bool use_mmap : { true, false }) {
+		iqurius::ContainerSource source(path);
+		EXPECT(source.open(use_mmap));
+		EXPECT(use_mmap || !source.mapped());
+		EXPECT(source.size() == data.size());
+		read = source.read(0, data.size(), scratch.data());
+		EXPECT(NULL != read);
+		EXPECT(0 == memcmp(read, data.data(), data.size()));
+		read = source.read(5000, 100, scratch.data());
+		EXPECT(NULL != read);
+		EXPECT(0 == memcmp(read, &data[5000], 100));
+		source.willNeed(4096, 8192);
+		source.dontNeed(0, 8192);
+		read = source.read(data.size() - 10, 10, scratch.data());
+		EXPECT(NULL != read);
+		EXPECT(0 == memcmp(read, &data[data.size() - 10], 10));
+		EXPECT(NULL == source.read(data.size() - 10, 11, scratch.data()));
+		EXPECT(NULL == source.read(data.size() + 1, 0, scratch.data()));
+	}
+	iqurius::ContainerSource missing(g_TestDir + "/missing.bin");
+	EXPECT(!missing.open(true));
+	return true;
+}
+
+static bool testDeltaCodec() {
+	using namespace iqurius;
+	std::vector<uint8_t> base = randomData(g_BlockSize, 2);
+	std::vector<uint8_t> block(base);
+	std::vector<uint8_t> stored(compressedBound(block.size()));
+	std::vector<uint8_t> output(block.size());
+	std::vector<uint8_t> work(compressWorkMemory());
+	size_t stored_len = stored.size();
+
+	memcpy(&block[1000], "patched", 7);
+	memcpy(&block[700000], "patched", 7);
+	output = block;
+	xorBlock(output.data(), base.data(), base.size());
+	EXPECT(compressBlock(CODEC_LZO1X, output.data(), output.size(),
+			stored.data(), &stored_len, work.data()));
+	EXPECT(stored_len < block.size() / 16);
+	EXPECT(decompressBlock(CODEC_XOR_LZO1X, stored.data(), stored_len,
+			output.data(), output.size()));
+	xorBlock(output.data(), base.data(), base.size());
+	EXPECT(output == block);
+	EXPECT(isDeltaCodec(CODEC_UNCHANGED));
+	EXPECT(isDeltaCodec(CODEC_XOR_LZO1X));
+	EXPECT(!isDeltaCodec(CODEC_LZO1X));
+	return true;
+}
+
+// Codec of every block of a version 2 container.
+static std::vector<uint8_t> blockCodecs(
+		const std::vector<uint8_t>& container) {
+	std::vector<uint8_t> codecs;
+	const size_t footer = container.size() - g_FooterSize;
+
+	for (size_t entry = indexOffset(container); entry < footer;
+			entry += g_IndexEntrySize) {
+		codecs.push_back(container[entry + 16]);
+	}
+	return codecs;
+}
+
+static bool hasCodec(const std::vector<uint8_t>& codecs,
+		iqurius::BlockCodec codec) {
+	return codecs.end() != std::find(codecs.begin(), codecs.end(), codec);
+}
+
+static bool testDeltaUpdate(bool xor_blocks) {
+	const std::string path = g_TestDir + "/delta.fwu";
+	const std::string flash = g_TestDir + "/flash";
+	const std::string storage = g_TestDir + "/storage";
+	std::vector<TestFile> files;
+	std::vector<uint8_t> container;
+	std::vector<uint8_t> data;
+
+	// Unchanged blocks, a patched block, a grown last block and a file
+	// the base does not have.
+	files.push_back({ "kernel.img", false,
+			randomData(3 * g_BlockSize - 5000, 10) });
+	files.push_back({ "settings.bin", true, randomData(70000, 11) });
+	const std::vector<TestFile> base(files);
+	makeDir(g_TestDir + "/base");
+	for (const TestFile& file : base) {
+		EXPECT(writeFile(g_TestDir + "/base/" + file.name_, file.data_));
+	}
+	memcpy(&files[0].data_[g_BlockSize + 4321], "patched", 7);
+	std::vector<uint8_t> tail = randomData(20000, 12);
+	files[0].data_.insert(files[0].data_.end(), tail.begin(), tail.end());
+	memcpy(&files[1].data_[10], "patched", 7);
+	files.push_back({ "extra.bin", false, textData(50000) });
+	makeDir(g_TestDir + "/delta");
+	FirmwareContainerWriter writer("1.2.4");
+	writer.setFormatVersion(2);
+	writer.setDeltaBase((g_TestDir + "/base").c_str(), xor_blocks);
+	for (const TestFile& file : files) {
+		std::string source = g_TestDir + "/delta/" + file.name_;
+		EXPECT(writeFile(source, file.data_));
+		EXPECT(writer.addFile(source.c_str(), file.name_, file.to_storage_));
+	}
+	EXPECT(writer.writeContainer(path.c_str()));
+	EXPECT(readFile(path, &container));
+	std::vector<uint8_t> codecs = blockCodecs(container);
+	EXPECT(hasCodec(codecs, iqurius::CODEC_UNCHANGED));
+	EXPECT(hasCodec(codecs, iqurius::CODEC_XOR_LZO1X) == xor_blocks);
+	if (xor_blocks) {
+		EXPECT(container.size() < g_BlockSize / 4);
+	}
+
+	// Installed the way the base was built.
+	makeInstallDirs();
+	for (const TestFile& file : base) {
+		EXPECT(writeFile(installedPath(file), file.data_));
+	}
+	{
+		FirmwareContainerReader reader(path.c_str());
+		EXPECT(reader.loadManifest());
+		EXPECT(reader.isDelta());
+		// Without the installed files there is nothing to rebuild from.
+		EXPECT(!reader.verifyFiles());
+		EXPECT(reader.verifyFiles(flash.c_str(), storage.c_str()));
+	}
+	EXPECT(updateFrom(path, 2));
+	for (const TestFile& file : files) {
+		EXPECT(readFile(installedPath(file), &data));
+		EXPECT(data == file.data_);
+	}
+
+	// A base that differs from the one the delta was built against, in a
+	// block the delta does not store, is caught and nothing is replaced.
+	makeInstallDirs();
+	std::vector<uint8_t> other_base(base[0].data_);
+	other_base[100] ^= 1;
+	EXPECT(writeFile(installedPath(base[0]), other_base));
+	EXPECT(writeFile(installedPath(base[1]), base[1].data_));
+	{
+		FirmwareContainerReader reader(path.c_str());
+		EXPECT(reader.loadManifest());
+		EXPECT(!reader.verifyFiles(flash.c_str(), storage.c_str()));
+	}
+	EXPECT(!updateFrom(path, 2));
+	EXPECT(readFile(installedPath(base[0]), &data));
+	EXPECT(data == other_base);
+	EXPECT(readFile(installedPath(base[1]), &data));
+	EXPECT(data == base[1].data_);
+	EXPECT(0 != access(installedPath(files[2]).c_str(), F_OK));
+
+	// So is a missing one.
+	EXPECT(0 == ::remove(installedPath(files[0]).c_str()));
+	EXPECT(!updateFrom(path, 2));
+	return true;
+}
+
+static void fillDigest(uint8_t value, uint8_t* digest) {
+	memset(digest, value, iqurius::JOURNAL_DIGEST_SIZE);
+}
+
+static bool hasProgress(const UpdateJournal& journal,
+		uint32_t file,
+		uint64_t length,
+		uint8_t digest_value) {
+	uint8_t expected[iqurius::JOURNAL_DIGEST_SIZE];
+	uint8_t digest[iqurius::JOURNAL_DIGEST_SIZE];
+	uint64_t recorded;
+
+	fillDigest(digest_value, expected);
+	return journal.progress(file, &recorded, digest) &&
+			recorded == length &&
+			0 == memcmp(digest, expected, sizeof(digest));
+}
+
+static bool testJournal() {
+	const std::string path = g_TestDir + "/update.journal";
+	uint8_t manifest[iqurius::JOURNAL_DIGEST_SIZE];
+	uint8_t other_manifest[iqurius::JOURNAL_DIGEST_SIZE];
+	uint8_t digest[iqurius::JOURNAL_DIGEST_SIZE];
+	std::vector<uint8_t> log;
+	std::vector<uint8_t> complete;
+
+	fillDigest(0xa5, manifest);
+	fillDigest(0x5a, other_manifest);
+	::remove(path.c_str());
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(manifest));
+		EXPECT(!journal.committed());
+		EXPECT(!hasProgress(journal, 0, 0, 0));
+		fillDigest(1, digest);
+		EXPECT(journal.record(0, 1000, digest));
+		fillDigest(2, digest);
+		EXPECT(journal.record(1, 2000, digest));
+		fillDigest(3, digest);
+		EXPECT(journal.record(0, 3000, digest));
+	}
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(manifest));
+		EXPECT(!journal.committed());
+		EXPECT(hasProgress(journal, 0, 3000, 3));
+		EXPECT(hasProgress(journal, 1, 2000, 2));
+		EXPECT(!hasProgress(journal, 2, 0, 0));
+	}
+	EXPECT(readFile(path, &complete));
+
+	// A record cut short by a power loss is dropped, and so is everything
+	// after a record with a bad checksum.
+	log = complete;
+	log.resize(log.size() - 10);
+	EXPECT(writeFile(path, log));
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(manifest));
+		EXPECT(hasProgress(journal, 0, 1000, 1));
+		EXPECT(hasProgress(journal, 1, 2000, 2));
+		fillDigest(4, digest);
+		EXPECT(journal.record(2, 4000, digest));
+	}
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(manifest));
+		EXPECT(hasProgress(journal, 0, 1000, 1));
+		EXPECT(hasProgress(journal, 2, 4000, 4));
+	}
+	log = complete;
+	log[log.size() - 2 * g_JournalRecordSize + 5] ^= 1;
+	EXPECT(writeFile(path, log));
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(manifest));
+		EXPECT(hasProgress(journal, 0, 1000, 1));
+		EXPECT(!hasProgress(journal, 1, 0, 0));
+		EXPECT(journal.commit());
+		EXPECT(journal.committed());
+	}
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(manifest));
+		EXPECT(journal.committed());
+		EXPECT(hasProgress(journal, 0, 1000, 1));
+	}
+
+	// The progress of another container is discarded.
+	{
+		UpdateJournal journal(path);
+		EXPECT(journal.open(other_manifest));
+		EXPECT(!journal.committed());
+		EXPECT(!hasProgress(journal, 0, 0, 0));
+		journal.remove();
+	}
+	EXPECT(0 != access(path.c_str(), F_OK));
+	return true;
+}
+
+// Runs a journaled update in a child process that dies at the given
+// sync or rename, true if it did.
+static bool interruptUpdate(const std::string& path, int syncs, int renames) {
+	pid_t pid = fork();
+	int status;
+
+	if (0 == pid) {
+		g_SyncsLeft = syncs;
+		g_RenamesLeft = renames;
+		_exit(updateFrom(path, 2, true, 1) ? 0 : 1);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == g_CrashExitCode;
+}
+
+static std::string journalPath() {
+	return g_TestDir + "/storage/update.journal";
+}
+
+static size_t fileSize(const std::string& path) {
+	struct stat stat_buf;
+
+	return 0 == stat(path.c_str(), &stat_buf) ? stat_buf.st_size : 0;
+}
+
+// The installed files are replaced by the update.
+static bool installPreviousFiles() {
+	makeInstallDirs();
+	for (const TestFile& file : g_Files) {
+		if (!writeFile(installedPath(file), textData(5000))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// After the resumed update every file matches, and neither .updated files
+// nor the journal are left.
+static bool resumeUpdate(const std::string& path) {
+	EXPECT(updateFrom(path, 1, true, 1));
+	EXPECT(installedFilesMatch());
+	for (const TestFile& file : g_Files) {
+		EXPECT(0 != access((installedPath(file) + ".updated").c_str(),
+				F_OK));
+	}
+	EXPECT(0 != access(journalPath().c_str(), F_OK));
+	return true;
+}
+
+static bool testResume(int format_version) {
+	const std::string path = g_TestDir + "/update.fwu";
+	const std::string kernel = installedPath(g_Files[0]) + ".updated";
+	std::vector<uint8_t> data;
+
+	EXPECT(writeContainer(path, format_version, iqurius::POLICY_LZO, 1));
+
+	// Every block is synced and then journaled, the first sync writes
+	// the journal header.
+	for (int syncs : { 0, 1, 2, 3, 4, 5, 7, 9 }) {
+		EXPECT(installPreviousFiles());
+		EXPECT(interruptUpdate(path, syncs, -1));
+		if (syncs >= 3) {
+			EXPECT(fileSize(journalPath()) > g_JournalHeaderSize);
+			EXPECT(fileSize(kernel) >= g_BlockSize);
+		}
+		EXPECT(resumeUpdate(path));
+	}
+
+	// A journaled prefix that no longer matches is written again.
+	EXPECT(installPreviousFiles());
+	EXPECT(interruptUpdate(path, 5, -1));
+	EXPECT(readFile(kernel, &data));
+	EXPECT(data.size() >= g_BlockSize);
+	data[10] ^= 1;
+	EXPECT(writeFile(kernel, data));
+	EXPECT(resumeUpdate(path));
+
+	// A torn last record falls back to the record before it.
+	EXPECT(installPreviousFiles());
+	EXPECT(interruptUpdate(path, 5, -1));
+	EXPECT(fileSize(journalPath()) >=
+			g_JournalHeaderSize + 2 * g_JournalRecordSize);
+	EXPECT(0 == truncate(journalPath().c_str(),
+			fileSize(journalPath()) - 10));
+	EXPECT(resumeUpdate(path));
+
+	// Committed, some files renamed and some not.
+	for (int renames : { 0, 1, 2, 4, 6 }) {
+		EXPECT(installPreviousFiles());
+		EXPECT(interruptUpdate(path, -1, renames));
+		EXPECT(fileSize(journalPath()) > g_JournalHeaderSize);
+		EXPECT(resumeUpdate(path));
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	int failures = 0;
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	if (lzo_init() != LZO_E_OK) {
+		LOG(ERROR) << "Error initializing the LZO library";
+		return 1;
+	}
+	if (!setUp()) {
+		LOG(ERROR) << "Can not create the test files";
+		return 1;
+	}
+	failures += !testContainerSource();
+	failures += !testRoundTrip(1, iqurius::POLICY_LZO);
+	failures += !testThreadsDoNotChangeOutput(1);
+	failures += !testVersion1RejectsCorruption();
+	failures += !testFailedUpdateKeepsInstalledFiles(1);
+	failures += !testCodecs();
+	failures += !testCodecPolicies();
+	failures += !testVersion1RejectsOtherCodecs();
+	for (iqurius::CodecPolicy policy : { iqurius::POLICY_LZO,
+			iqurius::POLICY_STORE, iqurius::POLICY_BEST_RATIO,
+			iqurius::POLICY_FASTEST_DECODE }) {
+		failures += !testRoundTrip(2, policy);
+	}
+	failures += !testThreadsDoNotChangeOutput(2);
+	failures += !testVersion2RejectsCorruption();
+	failures += !testFailedUpdateKeepsInstalledFiles(2);
+	failures += !testDeltaCodec();
+	failures += !testDeltaUpdate(true);
+	failures += !testDeltaUpdate(false);
+	failures += !testJournal();
+	failures += !testResume(1);
+	failures += !testResume(2);
+	removeTree(g_TestDir);
+	LOG(INFO) << failures << " tests failed";
+	return failures ? 1 : 0;
+}
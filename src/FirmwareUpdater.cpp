@@ -11,13 +11,34 @@
 #include "FirmwareUpdater.h"
 
 #include "FirmwareContainer.h"
+#include "time_util.h"
 #include <dirent.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+DEFINE_bool(update_preverify, false,
+		"Decompress and verify the whole update before installing it, the "
+		"install pass verifies every file anyway.");
+DEFINE_bool(update_readback, false,
+		"Read every installed file back from the flash and verify it again.");
+DEFINE_bool(update_direct_io, true,
+		"Write the updated files with O_DIRECT where the filesystem allows.");
+DEFINE_int32(update_journal_blocks, 16,
+		"Record the update progress in a journal on the storage partition "
+		"every this many 1MB blocks, so an update cut short by a power "
+		"loss resumes instead of starting over. 0 disables the journal.");
+DEFINE_bool(update_mmap, true,
+		"Map the update container instead of reading it, falls back to "
+		"reads when the media can not be mapped.");
+DEFINE_int32(update_threads, 0,
+		"Threads decoding update blocks, 0 uses one per CPU.");
+DEFINE_int32(update_memory_mb, 8,
+		"Megabytes of block buffers the update reads ahead with.");
+
 namespace iqurius {
 
 static const char g_FlashMountPoint[] = "/flash";
@@ -25,9 +46,21 @@ static const char g_StorageMountPoint[] = "/storage";
 static const char g_MediaMountPoint[] = "/media";
 static const char g_UpdateFileName[] = "iqjs.fwu";
 
+// A single core device still gets a worker, decoding then overlaps with
+// reading the container and writing the files.
+static size_t updateThreads() {
+	if (FLAGS_update_threads > 0) {
+		return FLAGS_update_threads;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+// The update syncs every file and directory it writes itself, a
+// synchronous mount would only turn each write into many small ones.
 bool FirmwareUpdater::RemountFlash(bool read_only) {
 	int result;
-	unsigned long flags = MS_MGC_VAL | MS_REMOUNT | MS_SYNCHRONOUS;
+	unsigned long flags = MS_MGC_VAL | MS_REMOUNT;
 
 	if (read_only) {
 		flags |= MS_RDONLY;
@@ -91,25 +124,37 @@ bool FirmwareUpdater::UpdateValid() {
 	if (!update_) {
 		return false;
 	}
+	update_->setUseMmap(FLAGS_update_mmap);
+	update_->setThreads(updateThreads());
+	update_->setMemoryBudget(FLAGS_update_memory_mb > 0 ?
+			(size_t)FLAGS_update_memory_mb << 20 : 0);
 	if (!update_->loadManifest()) {
 		return false;
 	}
-	return update_->verifyFiles();
+	if (FLAGS_update_preverify) {
+		// Delta updates are checked against the installed files.
+		return update_->verifyFiles(g_FlashMountPoint, g_StorageMountPoint);
+	}
+	return true;
 }
 
 bool FirmwareUpdater::Update() {
 	bool result = false;
+	uint32_t start_time = timeGetTime();
 	if (!update_) {
 		return false;
 	}
 	if (!RemountFlash(false)) {
 		return false;
 	}
+	update_->setReadback(FLAGS_update_readback);
+	update_->setDirectIo(FLAGS_update_direct_io);
+	update_->setJournalInterval(FLAGS_update_journal_blocks > 0 ?
+			FLAGS_update_journal_blocks : 0);
 	result = update_->performUpdate(g_FlashMountPoint, g_StorageMountPoint);
-	SyncDisc();
-	SyncDisc();
-	SyncDisc();
 	RemountFlash(true);
+	LOG(INFO) << "Update " << (result ? "completed" : "failed") << " in "
+			<< elapsedTime(start_time) << "ms";
 	return result;
 }
 
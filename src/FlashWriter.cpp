@@ -0,0 +1,195 @@
+/*
+ * FlashWriter.cpp
+ *
+ *  Created on: Jun 29, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "FlashWriter.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace iqurius {
+
+// O_DIRECT wants the buffer, the file offset and the length aligned to the
+// logical block size of the device, a page covers every SD card.
+static constexpr size_t g_Alignment = 4096;
+
+FlashWriter::FlashWriter(size_t buffer_size, bool direct_io)
+	: buffer_size_((buffer_size + g_Alignment - 1) & ~(g_Alignment - 1)),
+	  direct_io_(direct_io),
+	  direct_(false),
+	  fd_(-1),
+	  buffer_(NULL),
+	  buffered_(0),
+	  bytes_written_(0) {
+}
+
+FlashWriter::~FlashWriter() {
+	abort();
+	free(buffer_);
+}
+
+bool FlashWriter::open(const std::string& path) {
+	return openAt(path, 0);
+}
+
+bool FlashWriter::openAt(const std::string& path, uint64_t offset) {
+	const int flags = O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC);
+
+	abort();
+	if (NULL == buffer_) {
+		void* buffer;
+		if (0 != posix_memalign(&buffer, g_Alignment, buffer_size_)) {
+			LOG(ERROR) << "Out of memory";
+			return false;
+		}
+		buffer_ = static_cast<uint8_t*>(buffer);
+	}
+	path_ = path;
+	buffered_ = 0;
+	bytes_written_ = 0;
+	direct_ = false;
+#ifdef O_DIRECT
+	if (direct_io_ && (offset & (g_Alignment - 1)) == 0) {
+		fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+		direct_ = fd_ >= 0;
+	}
+#endif
+	if (fd_ < 0) {
+		fd_ = ::open(path.c_str(), flags, 0644);
+	}
+	if (fd_ < 0) {
+		LOG(ERROR) << "Can't open output file: " << path << " errno=" << errno;
+		return false;
+	}
+	if (offset && (0 != ftruncate(fd_, offset) ||
+			lseek(fd_, offset, SEEK_SET) != (off_t)offset)) {
+		LOG(ERROR) << "Can't resume output file: " << path
+				<< " errno=" << errno;
+		abort();
+		return false;
+	}
+	return true;
+}
+
+bool FlashWriter::writeBuffer(size_t len) {
+	for (size_t done = 0; done < len;) {
+		ssize_t rc = ::write(fd_, buffer_ + done, len - done);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+#ifdef O_DIRECT
+		if (rc < 0 && errno == EINVAL && direct_ && done == 0) {
+			// The filesystem took O_DIRECT at open but refuses the write.
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+			direct_ = false;
+			continue;
+		}
+#endif
+		if (rc <= 0) {
+			LOG(ERROR) << "Can't write to output file: " << path_
+					<< " errno=" << errno;
+			return false;
+		}
+		done += rc;
+	}
+	bytes_written_ += len;
+	return true;
+}
+
+bool FlashWriter::write(const uint8_t* data, size_t len) {
+	while (len > 0) {
+		size_t chunk = buffer_size_ - buffered_;
+		if (chunk > len) {
+			chunk = len;
+		}
+		memcpy(buffer_ + buffered_, data, chunk);
+		buffered_ += chunk;
+		data += chunk;
+		len -= chunk;
+		if (buffered_ == buffer_size_) {
+			if (!writeBuffer(buffered_)) {
+				return false;
+			}
+			buffered_ = 0;
+		}
+	}
+	return true;
+}
+
+bool FlashWriter::sync() {
+	if (fd_ < 0) {
+		return false;
+	}
+#ifdef O_DIRECT
+	if (direct_ && (buffered_ & (g_Alignment - 1)) != 0) {
+		// The unaligned tail goes through the page cache.
+		fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+		direct_ = false;
+	}
+#endif
+	if (buffered_ > 0 && !writeBuffer(buffered_)) {
+		return false;
+	}
+	buffered_ = 0;
+	if (0 != fdatasync(fd_)) {
+		LOG(ERROR) << "Can't sync output file: " << path_ << " errno=" << errno;
+		return false;
+	}
+	return true;
+}
+
+bool FlashWriter::finish() {
+	bool result = false;
+
+	if (fd_ < 0) {
+		return false;
+	}
+	if (!sync()) {
+		goto exit;
+	}
+	result = true;
+exit:
+	if (0 != ::close(fd_) && result) {
+		LOG(ERROR) << "Can't close output file: " << path_ << " errno=" << errno;
+		result = false;
+	}
+	fd_ = -1;
+	return result;
+}
+
+void FlashWriter::abort() {
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+	buffered_ = 0;
+}
+
+bool FlashWriter::syncDirectory(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+	bool result;
+
+	if (fd < 0) {
+		LOG(ERROR) << "Can not open " << path << " errno=" << errno;
+		return false;
+	}
+	result = 0 == fsync(fd);
+	if (!result) {
+		LOG(ERROR) << "Can not sync " << path << " errno=" << errno;
+	}
+	::close(fd);
+	return result;
+}
+
+} /* namespace iqurius */
@@ -0,0 +1,118 @@
+/*
+ * LatencyTrace.cpp
+ *
+ *  Created on: Jun 2, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#include "LatencyTrace.h"
+
+#include <glog/logging.h>
+#include <sstream>
+
+namespace iqurius {
+
+void LatencyHistogram::add(uint32_t latency_us) {
+  size_t bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && (latency_us >> bucket) > 0) {
+	bucket++;
+  }
+  buckets_[bucket]++;
+  count_++;
+  sum_us_ += latency_us;
+  if (latency_us > max_us_) {
+	max_us_ = latency_us;
+  }
+}
+
+void LatencyHistogram::reset() {
+  for (size_t idx = 0; idx < NUM_BUCKETS; ++idx) {
+	buckets_[idx] = 0;
+  }
+  count_ = 0;
+  sum_us_ = 0;
+  max_us_ = 0;
+}
+
+uint32_t LatencyHistogram::average() const {
+  uint32_t count = count_;
+  return count ? sum_us_ / count : 0;
+}
+
+uint32_t LatencyHistogram::percentile(uint32_t percent) const {
+  uint64_t count = count_;
+  if (!count) {
+	return 0;
+  }
+  uint64_t limit = (count * percent + 99) / 100;
+  uint64_t seen = 0;
+  uint32_t max_us = max_us_;
+  for (size_t bucket = 0; bucket < NUM_BUCKETS - 1; ++bucket) {
+	seen += buckets_[bucket];
+	if (seen >= limit) {
+	  uint32_t bound = (1u << bucket) - 1;
+	  return bound < max_us ? bound : max_us;
+	}
+  }
+  return max_us;
+}
+
+std::string LatencyHistogram::toString() const {
+  std::ostringstream out;
+  out << "n=" << count() << " avg=" << average()
+	  << "us p50<=" << percentile(50)
+	  << "us p99<=" << percentile(99)
+	  << "us max=" << max() << "us";
+  return out.str();
+}
+
+const char* LatencyTrace::stageName(EStage stage) {
+  switch (stage) {
+  case STAGE_DECODE: return "decode";
+  case STAGE_FILL: return "fill";
+  case STAGE_QUEUE: return "queue";
+  case STAGE_MIX: return "mix";
+  case STAGE_OUTPUT: return "output";
+  case STAGE_TOTAL: return "total";
+  default: return "unknown";
+  }
+}
+
+void LatencyTrace::addInterval(EStage stage,
+		uint64_t start_us,
+		uint64_t end_us) {
+  if (start_us && end_us && end_us >= start_us) {
+	uint64_t latency = end_us - start_us;
+	stages_[stage].add(latency > UINT32_MAX ? UINT32_MAX : latency);
+  }
+}
+
+void LatencyTrace::record(const BufferTrace& trace) {
+  addInterval(STAGE_DECODE, trace.read_us, trace.decoded_us);
+  addInterval(STAGE_FILL, trace.decoded_us, trace.posted_us);
+  addInterval(STAGE_QUEUE, trace.posted_us, trace.pulled_us);
+  addInterval(STAGE_MIX, trace.pulled_us, trace.written_us);
+  addInterval(STAGE_OUTPUT, trace.written_us, trace.audible_us);
+  uint64_t start_us = trace.read_us ? trace.read_us : trace.posted_us;
+  addInterval(STAGE_TOTAL, start_us, trace.audible_us);
+}
+
+void LatencyTrace::reset() {
+  for (size_t idx = 0; idx < NUM_STAGES; ++idx) {
+	stages_[idx].reset();
+  }
+}
+
+void LatencyTrace::dump(const char* name) const {
+  for (size_t idx = 0; idx < NUM_STAGES; ++idx) {
+	if (stages_[idx].count()) {
+	  LOG(INFO) << name << " latency " << stageName((EStage)idx) << ": "
+			  << stages_[idx].toString();
+	}
+  }
+}
+
+} /* namespace iqurius */
@@ -17,6 +17,8 @@
 #include "MessageArgumentIterator.h"
 #include <glog/logging.h>
 #include <RemoteMethod.h>
+#include <string.h>
+#include <unistd.h>
 
 namespace dbus {
 
@@ -25,6 +27,7 @@ const char* MediaTransport::GETPROPERTIES_METHOD = "GetProperties";
 const char* MediaTransport::ACQUIRE_METHOD = "Acquire";
 const char* MediaTransport::RELEASE_METHOD = "Release";
 const char* MediaTransport::SETPROPERTY_METHOD = "SetProperty";
+const char* MediaTransport::DELAY_PROPERTY = "Delay";
 
 bool MediaTransport::getProperties(MediaTransportProperties* property_bag) {
 	RemoteMethod rpc(ORG_BLUEZ, path_.path(), INTERFACE, GETPROPERTIES_METHOD);
@@ -42,6 +45,32 @@ bool MediaTransport::getProperties(MediaTransportProperties* property_bag) {
 	return false;
 }
 
+// Reads the fd and the MTUs of an Acquire reply. *fd is set whenever the
+// reply carries one, even when the MTUs are missing, so that the caller
+// can close it.
+bool MediaTransport::parseAcquireReply(Message* reply,
+		int* fd,
+		int* read_mtu,
+		int* write_mtu) {
+	MessageArgumentIterator reply_args = reply->argIterator();
+
+	*fd = -1;
+	if (reply_args.getArgumentType() != DBUS_TYPE_UNIX_FD) {
+		LOG(ERROR) << "Acquire reply has no file descriptor";
+		return false;
+	}
+	*fd = reply_args.getFileDescriptor();
+	if (reply_args.next()) {
+		*read_mtu = reply_args.getWord();
+		if (reply_args.next()) {
+			*write_mtu = reply_args.getWord();
+			return true;
+		}
+	}
+	LOG(ERROR) << "Acquire reply has no MTUs";
+	return false;
+}
+
 bool MediaTransport::acquire(const char* access_type,
     		int* fd,
     		int* read_mtu,
@@ -51,20 +80,102 @@ bool MediaTransport::acquire(const char* access_type,
 	MessageArgumentBuilder args = rpc.argBuilder();
 	args.append(access_type);
 	Message reply = connection_->sendWithReplyAndBlock(rpc, -1);
-	if (reply.msg() != NULL) {
-		MessageArgumentIterator reply_args = reply.argIterator();
-		*fd = reply_args.getFileDescriptor();
-		if (reply_args.next()) {
-			*read_mtu = reply_args.getWord();
-			if (reply_args.next()) {
-				*write_mtu = reply_args.getWord();
-				return true;
-			}
-		}
+	if (reply.msg() == NULL) {
+		return false;
+	}
+	if (parseAcquireReply(&reply, fd, read_mtu, write_mtu)) {
+		return true;
+	}
+	if (*fd >= 0) {
+		// BlueZ handed the transport over, give it back.
+		close(*fd);
+		*fd = -1;
+		release(access_type);
 	}
 	return false;
 }
 
+void MediaTransport::acquireAsync(const char* access_type,
+		int timeout_msec,
+		OnAcquireCallback* cb) {
+	cancelAcquire();
+	RemoteMethod rpc(ORG_BLUEZ, path_.path(), INTERFACE, ACQUIRE_METHOD);
+	rpc.prepareCall();
+	MessageArgumentBuilder args = rpc.argBuilder();
+	args.append(access_type);
+	acquire_cb_ = cb;
+	acquire_access_type_ = access_type;
+	acquire_timeout_msec_ = timeout_msec;
+	acquire_reply_cb_ = googleapis::NewCallback(this,
+			&MediaTransport::onAcquireReply);
+	connection_->send(rpc, timeout_msec, acquire_reply_cb_);
+}
+
+void MediaTransport::onAcquireReply(Message* reply) {
+	OnAcquireCallback* cb = acquire_cb_;
+	int fd = -1;
+	int read_mtu = 0;
+	int write_mtu = 0;
+	bool result = false;
+
+	acquire_cb_ = NULL;
+	acquire_reply_cb_ = NULL;
+	if (reply == NULL) {
+		LOG(ERROR) << "Timeout acquiring transport " << path_;
+	} else if (reply->getType() != DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+		reply->dump("Error acquiring transport: ");
+	} else {
+		result = parseAcquireReply(reply, &fd, &read_mtu, &write_mtu);
+	}
+	if (!result && fd >= 0) {
+		// The callback ignores the fd on failure, BlueZ still holds the
+		// transport as acquired until it is released.
+		close(fd);
+		fd = -1;
+		releaseAsync(acquire_access_type_.c_str(), acquire_timeout_msec_,
+				NULL);
+	}
+	if (cb) {
+		cb->Run(result, fd, read_mtu, write_mtu);
+	}
+}
+
+void MediaTransport::cancelAcquire() {
+	if (acquire_reply_cb_) {
+		connection_->cancel(acquire_reply_cb_);
+		acquire_reply_cb_ = NULL;
+	}
+	if (acquire_cb_) {
+		delete acquire_cb_;
+		acquire_cb_ = NULL;
+	}
+}
+
+void MediaTransport::releaseAsync(const char* access_type,
+		int timeout_msec,
+		OnResultCallback* cb) {
+	RemoteMethod rpc(ORG_BLUEZ, path_.path(), INTERFACE, RELEASE_METHOD);
+	rpc.prepareCall();
+	MessageArgumentBuilder args = rpc.argBuilder();
+	args.append(access_type);
+	connection_->send(rpc, timeout_msec, googleapis::NewCallback(
+			&MediaTransport::onMethodReply, RELEASE_METHOD, cb));
+}
+
+void MediaTransport::onMethodReply(const char* method,
+		OnResultCallback* cb,
+		Message* reply) {
+	bool result = reply != NULL &&
+			reply->getType() == DBUS_MESSAGE_TYPE_METHOD_RETURN;
+	if (!result) {
+		LOG(WARNING) << "MediaTransport." << method
+				<< " failed or timed out.";
+	}
+	if (cb) {
+		cb->Run(result);
+	}
+}
+
 bool MediaTransport::release(const char* access_type) {
 	RemoteMethod rpc(ORG_BLUEZ, path_.path(), INTERFACE, RELEASE_METHOD);
 	rpc.prepareCall();
@@ -74,10 +185,45 @@ bool MediaTransport::release(const char* access_type) {
 	return reply.msg() != NULL;
 }
 
+bool MediaTransport::appendProperty(const char* property_name,
+		const MediaTransportProperties& property_bag,
+		MessageArgumentBuilder* args) {
+	if (strcmp(property_name, DELAY_PROPERTY) == 0) {
+		return args->append(property_name) &&
+				args->appendVariant((uint16_t)property_bag.getDelay());
+	}
+	LOG(ERROR) << "MediaTransport property " << property_name
+			<< " is not writable";
+	return false;
+}
+
 bool MediaTransport::setProperty(const char* property_name,
     		const MediaTransportProperties& property_bag) {
-    LOG(ERROR) << "MediaTransport::setProperty is not implemented yet";
-    return false;
+	RemoteMethod rpc(ORG_BLUEZ, path_.path(), INTERFACE, SETPROPERTY_METHOD);
+	rpc.prepareCall();
+	MessageArgumentBuilder args = rpc.argBuilder();
+	if (!appendProperty(property_name, property_bag, &args)) {
+		return false;
+	}
+	Message reply = connection_->sendWithReplyAndBlock(rpc, -1);
+	return reply.msg() != NULL;
+}
+
+void MediaTransport::setPropertyAsync(const char* property_name,
+		const MediaTransportProperties& property_bag,
+		int timeout_msec,
+		OnResultCallback* cb) {
+	RemoteMethod rpc(ORG_BLUEZ, path_.path(), INTERFACE, SETPROPERTY_METHOD);
+	rpc.prepareCall();
+	MessageArgumentBuilder args = rpc.argBuilder();
+	if (!appendProperty(property_name, property_bag, &args)) {
+		if (cb) {
+			cb->Run(false);
+		}
+		return;
+	}
+	connection_->send(rpc, timeout_msec, googleapis::NewCallback(
+			&MediaTransport::onMethodReply, SETPROPERTY_METHOD, cb));
 }
 
 } /* namespace dbus */
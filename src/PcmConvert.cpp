@@ -0,0 +1,236 @@
+/*
+ * PcmConvert.cpp
+ *
+ *  Created on: Jun 9, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#include "PcmConvert.h"
+
+#include <glog/logging.h>
+#include <soxr.h>
+#include <vorbis/codec.h>
+#include <vorbis/vorbisfile.h>
+
+namespace iqurius {
+
+static constexpr size_t DECODE_CHUNK_BYTES = 4096;
+
+bool decodeVorbisFile(const char* path,
+		std::vector<int16_t>* pcm,
+		uint8_t* channels,
+		uint32_t* sample_rate) {
+  OggVorbis_File vf;
+  vorbis_info *vi;
+  ogg_int64_t num_samples;
+  size_t pcm_len = 0;
+  int current_section;
+  bool result = false;
+
+  if (ov_fopen(path, &vf) < 0) {
+	LOG(ERROR) << "File " << path << " is not a valid Ogg bitstream.";
+	return false;
+  }
+  vi = ov_info(&vf, -1);
+  if (vi->channels < 1 || vi->channels > 255 || vi->rate <= 0) {
+	LOG(ERROR) << "Unsupported format " << vi->rate << "Hz "
+			<< vi->channels << " channels in " << path;
+	goto exit;
+  }
+  *channels = vi->channels;
+  *sample_rate = vi->rate;
+  num_samples = ov_pcm_total(&vf, -1);
+  pcm->clear();
+  if (num_samples > 0) {
+	pcm->reserve(num_samples * vi->channels);
+  }
+  while (true) {
+	// The total is only a hint, grow the buffer as the stream decodes.
+	if (pcm->size() - pcm_len < DECODE_CHUNK_BYTES / 2) {
+	  pcm->resize(pcm_len + DECODE_CHUNK_BYTES / 2);
+	}
+	long len = ov_read(&vf, reinterpret_cast<char*>(pcm->data() + pcm_len),
+			(pcm->size() - pcm_len) * 2, 0, 2, 1, &current_section);
+	if (len == OV_HOLE) {
+	  continue;
+	}
+	if (len < 0) {
+	  LOG(ERROR) << "Error decoding " << path;
+	  goto exit;
+	}
+	if (len == 0) {
+	  break;
+	}
+	pcm_len += len / 2;
+  }
+  pcm->resize(pcm_len - pcm_len % *channels);
+  result = true;
+exit:
+  ov_clear(&vf);
+  return result;
+}
+
+static void downmixToMono(std::vector<int16_t>* pcm, uint8_t channels) {
+  const size_t num_frames = pcm->size() / channels;
+  int16_t* samples = pcm->data();
+
+  for (size_t frame = 0; frame < num_frames; ++frame) {
+	int32_t sum = 0;
+	for (uint8_t channel = 0; channel < channels; ++channel) {
+	  sum += samples[frame * channels + channel];
+	}
+	samples[frame] = sum / channels;
+  }
+  pcm->resize(num_frames);
+}
+
+bool normalizePcm(std::vector<int16_t>* pcm,
+		uint8_t* channels,
+		uint32_t* sample_rate,
+		uint32_t out_sample_rate,
+		bool mono) {
+  if (*channels > 2 || (mono && *channels == 2)) {
+	downmixToMono(pcm, *channels);
+	*channels = 1;
+  }
+  if (*sample_rate == out_sample_rate) {
+	return true;
+  }
+  const size_t in_frames = pcm->size() / *channels;
+  // One extra frame for rounding, soxr reports what it produced.
+  const size_t out_frames =
+		  (uint64_t)in_frames * out_sample_rate / *sample_rate + 1;
+  std::vector<int16_t> resampled(out_frames * *channels);
+  size_t frames_done = 0;
+  soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_INT16_I);
+  soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_HQ, 0);
+  soxr_error_t error = soxr_oneshot(*sample_rate, out_sample_rate, *channels,
+		  pcm->data(), in_frames, nullptr,
+		  resampled.data(), out_frames, &frames_done,
+		  &io_spec, &q_spec, nullptr);
+  if (error) {
+	LOG(ERROR) << "Unable to resample from " << *sample_rate << "Hz to "
+			<< out_sample_rate << "Hz: " << error;
+	return false;
+  }
+  resampled.resize(frames_done * *channels);
+  pcm->swap(resampled);
+  *sample_rate = out_sample_rate;
+  return true;
+}
+
+static const int16_t g_ImaStepTable[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+	41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+	190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+	724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+	7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818,
+	18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t g_ImaIndexTable[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// Applies a nibble to the predictor state, shared by encoder and decoder.
+static inline int16_t imaAdpcmStep(uint8_t nibble,
+		int32_t* predictor,
+		int32_t* index) {
+  const int32_t step = g_ImaStepTable[*index];
+  int32_t diff = step >> 3;
+  if (nibble & 4) diff += step;
+  if (nibble & 2) diff += step >> 1;
+  if (nibble & 1) diff += step >> 2;
+  *predictor += (nibble & 8) ? -diff : diff;
+  if (*predictor > 32767) {
+	*predictor = 32767;
+  } else if (*predictor < -32768) {
+	*predictor = -32768;
+  }
+  *index += g_ImaIndexTable[nibble & 7];
+  if (*index < 0) {
+	*index = 0;
+  } else if (*index > 88) {
+	*index = 88;
+  }
+  return *predictor;
+}
+
+static inline uint8_t imaAdpcmNibble(int16_t sample,
+		int32_t* predictor,
+		int32_t* index) {
+  const int32_t step = g_ImaStepTable[*index];
+  int32_t diff = sample - *predictor;
+  uint8_t nibble = 0;
+  if (diff < 0) {
+	nibble = 8;
+	diff = -diff;
+  }
+  if (diff >= step) {
+	nibble |= 4;
+	diff -= step;
+  }
+  if (diff >= step >> 1) {
+	nibble |= 2;
+	diff -= step >> 1;
+  }
+  if (diff >= step >> 2) {
+	nibble |= 1;
+  }
+  imaAdpcmStep(nibble, predictor, index);
+  return nibble;
+}
+
+void imaAdpcmEncode(const int16_t* samples,
+		size_t num_samples,
+		std::vector<uint8_t>* blocks) {
+  const size_t num_blocks =
+		  (num_samples + IMA_ADPCM_BLOCK_SAMPLES - 1) / IMA_ADPCM_BLOCK_SAMPLES;
+  int32_t index = 0;
+
+  blocks->assign(num_blocks * IMA_ADPCM_BLOCK_BYTES, 0);
+  for (size_t block = 0; block < num_blocks; ++block) {
+	uint8_t* out = blocks->data() + block * IMA_ADPCM_BLOCK_BYTES;
+	size_t pos = block * IMA_ADPCM_BLOCK_SAMPLES;
+	int32_t predictor = samples[pos++];
+	out[0] = predictor & 0xff;
+	out[1] = (predictor >> 8) & 0xff;
+	out[2] = index;
+	out[3] = 0;
+	for (size_t idx = 4; idx < IMA_ADPCM_BLOCK_BYTES; ++idx) {
+	  int16_t low = pos < num_samples ? samples[pos] : 0;
+	  int16_t high = pos + 1 < num_samples ? samples[pos + 1] : 0;
+	  pos += 2;
+	  uint8_t nibble = imaAdpcmNibble(low, &predictor, &index);
+	  out[idx] = nibble | (imaAdpcmNibble(high, &predictor, &index) << 4);
+	}
+  }
+}
+
+size_t imaAdpcmDecodeBlock(const uint8_t* block, int16_t* samples) {
+  int32_t predictor = (int16_t)(block[0] | (block[1] << 8));
+  int32_t index = block[2] > 88 ? 88 : block[2];
+
+  samples[0] = predictor;
+  for (size_t idx = 4, pos = 1; idx < IMA_ADPCM_BLOCK_BYTES; ++idx, pos += 2) {
+	samples[pos] = imaAdpcmStep(block[idx] & 0x0f, &predictor, &index);
+	samples[pos + 1] = imaAdpcmStep(block[idx] >> 4, &predictor, &index);
+  }
+  return IMA_ADPCM_BLOCK_SAMPLES;
+}
+
+void imaAdpcmDecode(const uint8_t* blocks,
+		size_t len,
+		std::vector<int16_t>* samples) {
+  const size_t num_blocks = len / IMA_ADPCM_BLOCK_BYTES;
+
+  samples->resize(num_blocks * IMA_ADPCM_BLOCK_SAMPLES);
+  for (size_t block = 0; block < num_blocks; ++block) {
+	imaAdpcmDecodeBlock(blocks + block * IMA_ADPCM_BLOCK_BYTES,
+			samples->data() + block * IMA_ADPCM_BLOCK_SAMPLES);
+  }
+}
+
+} /* namespace iqurius */
@@ -0,0 +1,149 @@
+/*
+ * PcmConvertTest.cpp
+ *
+ *  Created on: Jul 14, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "PcmConvert.h"
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+using iqurius::IMA_ADPCM_BLOCK_BYTES;
+using iqurius::IMA_ADPCM_BLOCK_SAMPLES;
+
+#define EXPECT(cond) \
+	do { \
+		if (!(cond)) { \
+			LOG(ERROR) << __FUNCTION__ << ": " #cond " failed"; \
+			return false; \
+		} \
+	} while (0)
+
+static std::vector<int16_t> sine(size_t num_samples,
+		double frequency,
+		double amplitude,
+		uint32_t sample_rate) {
+	std::vector<int16_t> samples(num_samples);
+
+	for (size_t idx = 0; idx < num_samples; ++idx) {
+		samples[idx] = lrint(amplitude *
+				sin(2 * M_PI * frequency * idx / sample_rate));
+	}
+	return samples;
+}
+
+// Signal to noise ratio of the decoded samples in dB.
+static double snr(const std::vector<int16_t>& source,
+		const std::vector<int16_t>& decoded) {
+	double signal = 0;
+	double noise = 0;
+
+	for (size_t idx = 0; idx < source.size(); ++idx) {
+		double error = (double)decoded[idx] - source[idx];
+		signal += (double)source[idx] * source[idx];
+		noise += error * error;
+	}
+	return 10 * log10(signal / (noise ? noise : 1));
+}
+
+static bool testBlockLayout() {
+	// Not a whole number of blocks, the last one is padded with silence.
+	std::vector<int16_t> source = sine(3 * IMA_ADPCM_BLOCK_SAMPLES + 100,
+			440, 8000, 22050);
+	std::vector<uint8_t> blocks;
+	std::vector<int16_t> decoded;
+
+	iqurius::imaAdpcmEncode(source.data(), source.size(), &blocks);
+	EXPECT(blocks.size() == 4 * IMA_ADPCM_BLOCK_BYTES);
+	iqurius::imaAdpcmDecode(blocks.data(), blocks.size(), &decoded);
+	EXPECT(decoded.size() == 4 * IMA_ADPCM_BLOCK_SAMPLES);
+	// Each block starts from the exact sample kept in its header, so a
+	// block decodes the same on its own.
+	for (size_t block = 0; block < 4; ++block) {
+		int16_t samples[IMA_ADPCM_BLOCK_SAMPLES];
+		size_t first = block * IMA_ADPCM_BLOCK_SAMPLES;
+		EXPECT(decoded[first] == source[first]);
+		EXPECT(iqurius::imaAdpcmDecodeBlock(
+				&blocks[block * IMA_ADPCM_BLOCK_BYTES], samples) ==
+				IMA_ADPCM_BLOCK_SAMPLES);
+		EXPECT(std::equal(samples, samples + IMA_ADPCM_BLOCK_SAMPLES,
+				decoded.begin() + first));
+	}
+	// A partial block at the end is ignored.
+	iqurius::imaAdpcmDecode(blocks.data(), blocks.size() - 1, &decoded);
+	EXPECT(decoded.size() == 3 * IMA_ADPCM_BLOCK_SAMPLES);
+	return true;
+}
+
+static bool testSilence() {
+	std::vector<int16_t> source(2 * IMA_ADPCM_BLOCK_SAMPLES, 0);
+	std::vector<uint8_t> blocks;
+	std::vector<int16_t> decoded;
+
+	iqurius::imaAdpcmEncode(source.data(), source.size(), &blocks);
+	iqurius::imaAdpcmDecode(blocks.data(), blocks.size(), &decoded);
+	EXPECT(decoded == source);
+	return true;
+}
+
+static bool testSpeechBand() {
+	std::vector<uint8_t> blocks;
+	std::vector<int16_t> decoded;
+
+	for (double frequency : { 200.0, 1000.0, 3000.0 }) {
+		std::vector<int16_t> source = sine(22050, frequency, 12000, 22050);
+		iqurius::imaAdpcmEncode(source.data(), source.size(), &blocks);
+		iqurius::imaAdpcmDecode(blocks.data(), blocks.size(), &decoded);
+		EXPECT(decoded.size() >= source.size());
+		// Four bits per sample keep a tone well clear of the noise.
+		double ratio = snr(source, decoded);
+		LOG(INFO) << frequency << "Hz SNR " << ratio << "dB";
+		EXPECT(ratio > 20);
+	}
+	return true;
+}
+
+static bool testFullScale() {
+	std::vector<int16_t> source(4 * IMA_ADPCM_BLOCK_SAMPLES);
+	std::vector<uint8_t> blocks;
+	std::vector<int16_t> decoded;
+
+	// Square wave between the rails, the predictor has to clamp instead of
+	// wrapping around.
+	for (size_t idx = 0; idx < source.size(); ++idx) {
+		source[idx] = (idx / 50) % 2 ? 32767 : -32768;
+	}
+	iqurius::imaAdpcmEncode(source.data(), source.size(), &blocks);
+	iqurius::imaAdpcmDecode(blocks.data(), blocks.size(), &decoded);
+	for (size_t idx = 0; idx < source.size(); ++idx) {
+		// Once the step size caught up the output sits on the same rail.
+		if (idx % 50 >= 25) {
+			EXPECT((source[idx] > 0) == (decoded[idx] > 16384));
+			EXPECT((source[idx] < 0) == (decoded[idx] < -16384));
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	int failures = 0;
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	failures += !testBlockLayout();
+	failures += !testSilence();
+	failures += !testSpeechBand();
+	failures += !testFullScale();
+	LOG(INFO) << failures << " tests failed";
+	return failures ? 1 : 0;
+}
@@ -10,13 +10,52 @@
 
 #include "PlaybackThread.h"
 #include "AudioMixer.h"
+#include "DelayedProcessing.h"
+#include "MediaTransportProperties.h"
+#include "time_util.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <sstream>
 #include <sys/select.h>
 #include <unistd.h>
 
+DEFINE_int32(fast_start_ms, 50, "Amount of audio to buffer before playback "
+		"starts. Set to 0 to always use the steady state preroll.");
+DEFINE_int32(transport_timeout_ms, 5000, "Timeout for the BlueZ transport "
+		"acquire and release requests.");
+DEFINE_int32(fast_start_ramp_ms, 3000, "Time over which the buffered audio "
+		"grows from the fast start amount to the steady state depth.");
+DEFINE_int32(delay_report_period_ms, 1000, "How often the measured playback "
+		"delay is checked for reporting to the source. Set to 0 to disable "
+		"delay reporting.");
+DEFINE_int32(delay_report_threshold_ms, 10, "Minimum change of the playback "
+		"delay that is reported to the source.");
+
 namespace dbus {
 
+void PlaybackStats::reset() {
+  bytes_in = 0;
+  packets_in = 0;
+  frames_decoded = 0;
+  decode_errors = 0;
+  concealed_frames = 0;
+  config_changes = 0;
+  bitpool = 0;
+  buffer_waits = 0;
+  buffer_wait_us = 0;
+  first_packet_time = 0;
+  last_packet_time = 0;
+}
+
+uint32_t PlaybackStats::bitrate() const {
+  uint32_t duration = last_packet_time - first_packet_time;
+  if (packets_in < 2 || duration == 0) {
+	return 0;
+  }
+  return bytes_in * 8 * 1000 / duration;
+}
+
 PlaybackThread::PlaybackThread(Connection* connection,
     const ObjectPath& transport_path,
 	iqurius::AudioChannel* audio_channel,
@@ -31,11 +70,21 @@ PlaybackThread::PlaybackThread(Connection* connection,
         write_mtu_(0),
 		sampling_rate_(sampling_rate),
 		audio_channel_(audio_channel),
-		audo_buffer_len_(0),
+		current_buffer_(nullptr),
 		resampler_(nullptr),
+		in_preroll_(false),
 		preroll_filled_(0),
-		in_preroll_(false) {
-  audo_channel_buffer_ = new uint8_t[iqurius::AudioMixer::AUDIO_BUFFER_SIZE];
+		preroll_bytes_(0),
+		start_time_(0),
+		first_audio_time_(0),
+		time_to_first_audio_(0),
+		channel_underruns_(0),
+		early_underruns_(0),
+		underruns_(0),
+		pipeline_delay_(0),
+		reported_delay_(0),
+		delay_report_token_(0),
+		packet_read_us_(0) {
   if (sampling_rate_ != 44100) {
       soxr_error_t error;
       soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_INT16_I);
@@ -52,11 +101,13 @@ PlaybackThread::PlaybackThread(Connection* connection,
   for (int idx = 0; idx < preroll_size_; idx++) {
 	  preroll_[idx] = nullptr;
   }
+  stats_.reset();
 }
 
 void PlaybackThread::freeTransport() {
+  transport_.cancelAcquire();
   if (fd_) {
-    transport_.release("rw");
+    transport_.releaseAsync("rw", FLAGS_transport_timeout_ms, NULL);
     close(fd_);
     fd_ = 0;
     read_mtu_ = 0;
@@ -64,38 +115,99 @@ void PlaybackThread::freeTransport() {
   }
 }
 
-bool PlaybackThread::acqureTransport() {
-  freeTransport();
-  return transport_.acquire("rw", &fd_, &read_mtu_, &write_mtu_);
-}
-
 void PlaybackThread::stop() {
+  if (delay_report_token_) {
+	iqurius::RemoveTimerCallback(delay_report_token_);
+	delay_report_token_ = 0;
+  }
   if (running_) {
     signal_stop_ = true;
     pthread_join(thread_, NULL);
     flush();
     running_ = false;
+    if (first_audio_time_) {
+      LOG(INFO) << "Playback session: time to first audio "
+    		  << time_to_first_audio_ << "ms, " << early_underruns_
+			  << " early underruns, " << underruns_ << " underruns total.";
+      audio_channel_->getLatencyTrace()->dump("Playback");
+    }
+    logStats();
   }
   freeTransport();
 }
 
 void PlaybackThread::start() {
-  if (ok()) {
+  if (ok() || isStarting()) {
     LOG(WARNING) << "Playback thread already running.";
     return;
   }
   stop();
-  if (acqureTransport()) {
-    signal_stop_ = false;
-    decoding_ok_ = true;
-    preroll_filled_ = 0;
-    for (int idx = 0; idx < preroll_size_; idx++) {
-  	  preroll_[idx] = nullptr;
-    }
-    in_preroll_ = true;
-    pthread_create(&thread_, NULL, threadProc, this);
-    running_ = true;
+  start_time_ = timeGetTime();
+  transport_.acquireAsync("rw", FLAGS_transport_timeout_ms,
+		  googleapis::NewCallback(this, &PlaybackThread::onTransportAcquired));
+}
+
+void PlaybackThread::onTransportAcquired(bool success,
+		int fd,
+		int read_mtu,
+		int write_mtu) {
+  if (!success) {
+    LOG(ERROR) << "Unable to acquire the media transport.";
+    return;
+  }
+  fd_ = fd;
+  read_mtu_ = read_mtu;
+  write_mtu_ = write_mtu;
+  signal_stop_ = false;
+  decoding_ok_ = true;
+  preroll_filled_ = 0;
+  preroll_bytes_ = 0;
+  for (int idx = 0; idx < preroll_size_; idx++) {
+	preroll_[idx] = nullptr;
+  }
+  in_preroll_ = true;
+  first_audio_time_ = 0;
+  time_to_first_audio_ = 0;
+  channel_underruns_ = audio_channel_->getUnderruns();
+  early_underruns_ = 0;
+  underruns_ = 0;
+  pipeline_delay_ = 0;
+  reported_delay_ = 0;
+  audio_channel_->getLatencyTrace()->reset();
+  {
+	googleapis::MutexLock lock(&stats_mutex_);
+	stats_.reset();
+  }
+  decode_time_.reset();
+  pthread_create(&thread_, NULL, threadProc, this);
+  running_ = true;
+  if (FLAGS_delay_report_period_ms > 0) {
+	delay_report_token_ = iqurius::PostTimerCallback(
+			FLAGS_delay_report_period_ms,
+			googleapis::NewPermanentCallback(this, &PlaybackThread::reportDelay));
+  }
+}
+
+// Runs on the main loop, the delay itself is measured on the playback thread.
+void PlaybackThread::reportDelay() {
+  uint32_t delay = pipeline_delay_;
+  if (!first_audio_time_ || delay == 0) {
+	return;
+  }
+  if (delay > 0xffff) {
+	delay = 0xffff;
+  }
+  uint32_t change = delay > reported_delay_ ?
+		  delay - reported_delay_ : reported_delay_ - delay;
+  if (reported_delay_ && change < (uint32_t)FLAGS_delay_report_threshold_ms * 10) {
+	return;
   }
+  VLOG(1) << "Reporting playback delay " << delay / 10 << "ms";
+  MediaTransportProperties properties;
+  properties.setDelay(delay);
+  transport_.setPropertyAsync("Delay", properties,
+		  FLAGS_transport_timeout_ms, NULL);
+  reported_delay_ = delay;
 }
 
 void* PlaybackThread::threadProc(void *ctx) {
@@ -106,7 +218,6 @@ void* PlaybackThread::threadProc(void *ctx) {
 
 void PlaybackThread::run() {
   uint8_t* read_buffer = new uint8_t[read_mtu_];
-  audo_buffer_len_ = 0;
   while(!signal_stop_) {
     int len;
     fd_set readset;
@@ -126,7 +237,9 @@ void PlaybackThread::run() {
     }
 
     len = read(fd_, read_buffer, read_mtu_);
+    packet_read_us_ = timeGetTimeUs();
     if (len > 0) {
+      packetReceived(len);
       decode(read_buffer, len);
     } else if (errno != EAGAIN) {
       LOG(ERROR) << "read FD " << fd_ << " error = " << errno;
@@ -138,35 +251,146 @@ void PlaybackThread::run() {
 }
 
 iqurius::AudioBuffer* PlaybackThread::waitForFreeBuffer() {
-  iqurius::AudioBuffer* audio_buffer;
+  iqurius::AudioBuffer* audio_buffer = audio_channel_->getFreeBuffer();
+  if (audio_buffer) {
+	return audio_buffer;
+  }
+  uint64_t wait_start_us = timeGetTimeUs();
   do {
-	audio_buffer = audio_channel_->getFreeBuffer();
-	if (audio_buffer) break;
 	usleep(1000);
-  } while (!signal_stop_);
+	audio_buffer = audio_channel_->getFreeBuffer();
+  } while (!audio_buffer && !signal_stop_);
+  googleapis::MutexLock lock(&stats_mutex_);
+  stats_.buffer_waits++;
+  stats_.buffer_wait_us += timeGetTimeUs() - wait_start_us;
   return audio_buffer;
 }
 
+PlaybackStats PlaybackThread::stats() const {
+  googleapis::MutexLock lock(&stats_mutex_);
+  return stats_;
+}
+
+void PlaybackThread::packetReceived(size_t size) {
+  googleapis::MutexLock lock(&stats_mutex_);
+  stats_.last_packet_time = timeGetTime();
+  if (!stats_.packets_in) {
+	stats_.first_packet_time = stats_.last_packet_time;
+  }
+  stats_.packets_in++;
+  stats_.bytes_in += size;
+}
+
+void PlaybackThread::frameDecoded(uint64_t decode_start_us) {
+  decode_time_.add(timeGetTimeUs() - decode_start_us);
+  googleapis::MutexLock lock(&stats_mutex_);
+  stats_.frames_decoded++;
+}
+
+void PlaybackThread::decodeError() {
+  googleapis::MutexLock lock(&stats_mutex_);
+  stats_.decode_errors++;
+}
+
+void PlaybackThread::configChanged(uint32_t bitpool) {
+  googleapis::MutexLock lock(&stats_mutex_);
+  if (stats_.frames_decoded) {
+	stats_.config_changes++;
+  }
+  stats_.bitpool = bitpool;
+}
+
+void PlaybackThread::concealFrames(size_t frames, size_t frame_bytes) {
+  static const uint8_t silence[1024] = { 0 };
+  size_t size = frames * frame_bytes;
+  while (size > 0) {
+	size_t len = size < sizeof(silence) ? size : sizeof(silence);
+	playPcm(silence, len);
+	size -= len;
+  }
+  googleapis::MutexLock lock(&stats_mutex_);
+  stats_.concealed_frames += frames;
+}
+
+void PlaybackThread::logStats() {
+  PlaybackStats stats = this->stats();
+  if (!stats.packets_in) {
+	return;
+  }
+  std::ostringstream summary;
+  summary << stats.packets_in << " packets, " << stats.bytes_in << " bytes, "
+		  << stats.bitrate() / 1000 << " kbps, "
+		  << stats.frames_decoded << " frames decoded, "
+		  << stats.decode_errors << " decode errors, "
+		  << stats.concealed_frames << " frames concealed, "
+		  << stats.config_changes << " config changes";
+  if (stats.bitpool) {
+	summary << ", bitpool " << stats.bitpool;
+  }
+  summary << ", waited " << stats.buffer_wait_us / 1000 << "ms for "
+		  << stats.buffer_waits << " buffers.";
+  LOG(INFO) << "Playback stats: " << summary.str();
+  if (decode_time_.count()) {
+	LOG(INFO) << "Decode time per frame: " << decode_time_.toString();
+  }
+}
+
+size_t PlaybackThread::depthTarget() const {
+  constexpr size_t frame_size = 4;
+  constexpr size_t steady_depth =
+		  preroll_size_ * iqurius::AudioMixer::AUDIO_BUFFER_SIZE;
+  size_t start_depth = steady_depth;
+  if (FLAGS_fast_start_ms > 0) {
+	start_depth = (FLAGS_fast_start_ms * 44100 / 1000) * frame_size;
+	if (start_depth > steady_depth) {
+	  start_depth = steady_depth;
+	}
+  }
+  if (!first_audio_time_) {
+	return start_depth;
+  }
+  uint32_t elapsed = elapsedTime(first_audio_time_);
+  if (FLAGS_fast_start_ramp_ms <= 0 ||
+	  elapsed >= (uint32_t)FLAGS_fast_start_ramp_ms) {
+	return steady_depth;
+  }
+  size_t depth = start_depth +
+		  (steady_depth - start_depth) * elapsed / FLAGS_fast_start_ramp_ms;
+  return depth - depth % frame_size;
+}
+
+size_t PlaybackThread::fillTarget() const {
+  size_t target = depthTarget();
+  if (target > iqurius::AudioMixer::AUDIO_BUFFER_SIZE) {
+	return iqurius::AudioMixer::AUDIO_BUFFER_SIZE;
+  }
+  return target;
+}
+
 void PlaybackThread::playPcm(const uint8_t* buffer, size_t size) {
+  uint64_t decoded_us = timeGetTimeUs();
   while ((size / 4) > 0) {
-	if (!resampler_) {
-		if (audo_buffer_len_ + size > iqurius::AudioMixer::AUDIO_BUFFER_SIZE) {
-		  iqurius::AudioBuffer* audio_buffer = waitForFreeBuffer();
-		  if (!audio_buffer) return;
-		  if (audo_buffer_len_) {
-			audio_buffer->write(audo_channel_buffer_, audo_buffer_len_);
-			audo_buffer_len_ = 0;
-		  }
-		  size_t written = audio_buffer->write(buffer, size);
-		  postBuffer(audio_buffer);
-		  buffer += written;
-		  size -= written;
-		} else {
-		  memcpy(audo_channel_buffer_ + audo_buffer_len_, buffer, size);
-		  audo_buffer_len_ += size;
-		  size = 0;
+	if (!current_buffer_) {
+	  current_buffer_ = waitForFreeBuffer();
+	  if (!current_buffer_) return;
+	}
+	if (current_buffer_->getDataLen() == 0) {
+	  // The buffer is traced by its first sample.
+	  current_buffer_->trace().read_us = packet_read_us_;
+	  current_buffer_->trace().decoded_us = decoded_us;
+	}
+	size_t fill_target = fillTarget();
+	size_t buffer_len = current_buffer_->getDataLen();
+	if (buffer_len < fill_target) {
+	  if (!resampler_) {
+		size_t len = fill_target - buffer_len;
+		if (len > size) {
+		  len = size;
 		}
-	} else {
+		current_buffer_->write(buffer, len);
+		buffer += len;
+		size -= len;
+	  } else {
 		soxr_error_t error;
 		size_t input_consumed;
 		size_t output_written;
@@ -174,77 +398,121 @@ void PlaybackThread::playPcm(const uint8_t* buffer, size_t size) {
 				             buffer,
 							 size / 4,
 							 &input_consumed,
-							 audo_channel_buffer_ + audo_buffer_len_,
-							 (iqurius::AudioMixer::AUDIO_BUFFER_SIZE - audo_buffer_len_) / 4,
+							 current_buffer_->getData() + buffer_len,
+							 (fill_target - buffer_len) / 4,
 							 &output_written);
-		audo_buffer_len_ += output_written * 4;
-		if (audo_buffer_len_ == iqurius::AudioMixer::AUDIO_BUFFER_SIZE) {
-			iqurius::AudioBuffer* audio_buffer = waitForFreeBuffer();
-			if (!audio_buffer) return;
-			audio_buffer->write(audo_channel_buffer_, audo_buffer_len_);
-			postBuffer(audio_buffer);
-			audo_buffer_len_ = 0;
-		}
+		current_buffer_->setDataSize(buffer_len + output_written * 4);
 		buffer += input_consumed * 4;
 		size -= input_consumed * 4;
+	  }
 	}
+	// The fill target only grows during playback, so a buffer can not be
+	// above it by more than a partial frame.
+	if (current_buffer_->getDataLen() + 4 > fill_target) {
+	  postBuffer(current_buffer_);
+	  current_buffer_ = nullptr;
+	}
+  }
+}
+
+// Audio held by this thread, queued in the mixer channel and buffered
+// by the resampler and ALSA, converted to 1/10 ms.
+void PlaybackThread::updatePipelineDelay() {
+  uint64_t frames = preroll_bytes_ + audio_channel_->getQueuedBytes();
+  if (current_buffer_) {
+	frames += current_buffer_->getDataLen();
+  }
+  frames /= 4;
+  if (resampler_) {
+	frames += (uint64_t)soxr_delay(resampler_);
   }
+  frames += audio_channel_->getOutputDelay();
+  pipeline_delay_ = frames * 10000 / 44100;
 }
 
 void PlaybackThread::postBuffer(iqurius::AudioBuffer* audio_buffer) {
+  uint32_t channel_underruns = audio_channel_->getUnderruns();
+  if (channel_underruns != channel_underruns_) {
+	uint32_t new_underruns = channel_underruns - channel_underruns_;
+	channel_underruns_ = channel_underruns;
+	if (first_audio_time_) {
+	  bool early = elapsedTime(first_audio_time_) <
+			  (uint32_t)FLAGS_fast_start_ramp_ms;
+	  underruns_ += new_underruns;
+	  if (early) {
+		early_underruns_ += new_underruns;
+	  }
+	  LOG(WARNING) << "Audio underrun" << (early ? " during fast start" : "")
+			  << ", rebuffering.";
+	  // Re-buffer up to the current depth target, which keeps growing
+	  // during the fast start ramp.
+	  in_preroll_ = true;
+	}
+  }
   if (!in_preroll_) {
 	audio_channel_->postBuffer(audio_buffer);
+	updatePipelineDelay();
 	return;
   }
-  if (preroll_filled_ < preroll_size_) {
-	preroll_[preroll_filled_++] = audio_buffer;
-	return;
+  preroll_[preroll_filled_++] = audio_buffer;
+  preroll_bytes_ += audio_buffer->getDataLen();
+  if (preroll_bytes_ + audio_channel_->getQueuedBytes() >= depthTarget() ||
+	  preroll_filled_ == preroll_size_) {
+	releasePreroll();
   }
-  in_preroll_ = false;
-  for (int idx = 0; idx < preroll_size_; idx++) {
+}
+
+void PlaybackThread::releasePreroll() {
+  if (!first_audio_time_ && preroll_filled_) {
+	first_audio_time_ = timeGetTime();
+	time_to_first_audio_ = first_audio_time_ - start_time_;
+	LOG(INFO) << "Time to first audio " << time_to_first_audio_ << "ms";
+  }
+  for (int idx = 0; idx < preroll_filled_; idx++) {
 	audio_channel_->postBuffer(preroll_[idx]);
 	preroll_[idx] = nullptr;
   }
   preroll_filled_ = 0;
-  audio_channel_->postBuffer(audio_buffer);
+  preroll_bytes_ = 0;
+  in_preroll_ = false;
+  updatePipelineDelay();
 }
 
 void PlaybackThread::flush() {
-  if (in_preroll_) {
-    for (int idx = 0; idx < preroll_filled_; idx++) {
-	  if (preroll_[idx]) {
-	    audio_channel_->postBuffer(preroll_[idx]);
-	    preroll_[idx] = nullptr;
-	  }
-    }
-    preroll_filled_ = 0;
-  }
-
-  if (!resampler_) {
-	iqurius::AudioBuffer* audio_buffer = waitForFreeBuffer();
-	if (!audio_buffer) return;
-	if (audo_buffer_len_) {
-	  audio_buffer->write(audo_channel_buffer_, audo_buffer_len_);
-	  audo_buffer_len_ = 0;
-	}
-    audio_channel_->postBuffer(audio_buffer);
-  } else {
+  if (resampler_) {
 	soxr_error_t error;
 	size_t input_consumed;
 	size_t output_written;
-	error = soxr_process(resampler_,
-						 nullptr,
-						 0,
-						 &input_consumed,
-						 audo_channel_buffer_ + audo_buffer_len_,
-						 (iqurius::AudioMixer::AUDIO_BUFFER_SIZE - audo_buffer_len_) / 4,
-						 &output_written);
-	audo_buffer_len_ += output_written * 4;
-	iqurius::AudioBuffer* audio_buffer = waitForFreeBuffer();
-	if (!audio_buffer) return;
-	audio_buffer->write(audo_channel_buffer_, audo_buffer_len_);
-	audio_channel_->postBuffer(audio_buffer);
-	audo_buffer_len_ = 0;
+	do {
+	  if (!current_buffer_) {
+		current_buffer_ = waitForFreeBuffer();
+		if (!current_buffer_) break;
+	  }
+	  size_t buffer_len = current_buffer_->getDataLen();
+	  error = soxr_process(resampler_,
+						   nullptr,
+						   0,
+						   &input_consumed,
+						   current_buffer_->getData() + buffer_len,
+						   (current_buffer_->getSize() - buffer_len) / 4,
+						   &output_written);
+	  current_buffer_->setDataSize(buffer_len + output_written * 4);
+	  if (current_buffer_->getDataLen() + 4 > current_buffer_->getSize()) {
+		postBuffer(current_buffer_);
+		current_buffer_ = nullptr;
+	  }
+	} while (output_written > 0);
+  }
+  if (current_buffer_) {
+	if (current_buffer_->getDataLen()) {
+	  postBuffer(current_buffer_);
+	} else {
+	  audio_channel_->releaseBuffer(current_buffer_);
+	}
+	current_buffer_ = nullptr;
+  }
+  if (in_preroll_) {
+	releasePreroll();
   }
 }
 } /* namespace dbus */
@@ -0,0 +1,103 @@
+/*
+ * PromptBundle.cpp
+ *
+ *  Created on: Jun 6, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#include "PromptBundle.h"
+#include "SoundFragment.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace iqurius {
+
+bool PromptBundle::open(const char* path) {
+  const PromptBundleHeader* header;
+  struct stat st;
+  void* data;
+  bool result = false;
+
+  close();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+	LOG(WARNING) << "Can not open prompt bundle " << path << " errno=" << errno;
+	return false;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(PromptBundleHeader)) {
+	LOG(ERROR) << "Invalid prompt bundle " << path;
+	goto exit;
+  }
+  data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+	LOG(ERROR) << "Can not map prompt bundle " << path << " errno=" << errno;
+	goto exit;
+  }
+  data_ = reinterpret_cast<uint8_t*>(data);
+  data_len_ = st.st_size;
+
+  header = reinterpret_cast<const PromptBundleHeader*>(data_);
+  if (header->magic != PROMPT_BUNDLE_MAGIC_NUMBER ||
+	  header->version != VERSION ||
+	  sizeof(PromptBundleHeader) + (uint64_t)header->num_prompts *
+			  sizeof(PromptBundleEntry) > data_len_) {
+	LOG(ERROR) << "Invalid prompt bundle header in " << path;
+	close();
+	goto exit;
+  }
+  index_ = reinterpret_cast<const PromptBundleEntry*>(data_ +
+		  sizeof(PromptBundleHeader));
+  num_prompts_ = header->num_prompts;
+  for (uint32_t idx = 0; idx < num_prompts_; ++idx) {
+	const PromptBundleEntry& entry = index_[idx];
+	if ((uint64_t)entry.offset + entry.size > data_len_ ||
+		entry.channels < 1 || entry.channels > 2 ||
+		strnlen(entry.name, PromptBundleEntry::MAX_NAME_LEN) ==
+				PromptBundleEntry::MAX_NAME_LEN) {
+	  LOG(ERROR) << "Invalid prompt bundle entry " << idx << " in " << path;
+	  close();
+	  goto exit;
+	}
+  }
+  LOG(INFO) << "Mapped " << num_prompts_ << " prompts from " << path;
+  result = true;
+exit:
+  ::close(fd);
+  return result;
+}
+
+void PromptBundle::close() {
+  if (data_) {
+	munmap(data_, data_len_);
+	data_ = nullptr;
+	data_len_ = 0;
+  }
+  index_ = nullptr;
+  num_prompts_ = 0;
+}
+
+SoundFragment* PromptBundle::getFragment(const std::string& path) const {
+  size_t name_pos = path.find_last_of('/');
+  const char* name = path.c_str() +
+		  (name_pos == std::string::npos ? 0 : name_pos + 1);
+
+  for (uint32_t idx = 0; idx < num_prompts_; ++idx) {
+	const PromptBundleEntry& entry = index_[idx];
+	if (strncmp(entry.name, name, PromptBundleEntry::MAX_NAME_LEN) == 0) {
+	  return SoundFragment::fromMemory(data_ + entry.offset, entry.size,
+			  entry.channels, entry.sample_rate);
+	}
+  }
+  return nullptr;
+}
+
+} /* namespace iqurius */
@@ -0,0 +1,101 @@
+/*
+ * PromptBundleWriter.cpp
+ *
+ *  Created on: Jun 6, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#include "PromptBundle.h"
+
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace iqurius {
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+bool PromptBundleWriter::addPrompt(const char* name,
+		const uint8_t* pcm_data,
+		size_t pcm_len,
+		uint32_t channels,
+		uint32_t sample_rate) {
+  if (strlen(name) >= PromptBundleEntry::MAX_NAME_LEN) {
+	LOG(ERROR) << "Prompt name " << name << " is too long.";
+	return false;
+  }
+  prompts_.push_back(PromptInfo());
+  PromptInfo& prompt = prompts_.back();
+  prompt.name_ = name;
+  prompt.pcm_.assign(pcm_data, pcm_data + pcm_len);
+  prompt.channels_ = channels;
+  prompt.sample_rate_ = sample_rate;
+  return true;
+}
+
+bool PromptBundleWriter::writeBundle(const char* path) {
+  static const uint8_t padding[ALIGNMENT] = { 0 };
+  PromptBundleHeader header;
+  std::vector<PromptBundleEntry> index;
+  bool result = false;
+  size_t offset;
+
+  header.magic = PROMPT_BUNDLE_MAGIC_NUMBER;
+  header.version = PromptBundle::VERSION;
+  header.num_prompts = prompts_.size();
+  header.alignment = ALIGNMENT;
+
+  offset = alignUp(sizeof(header) + prompts_.size() * sizeof(PromptBundleEntry),
+		  ALIGNMENT);
+  for (const PromptInfo& prompt : prompts_) {
+	PromptBundleEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	strncpy(entry.name, prompt.name_.c_str(), sizeof(entry.name) - 1);
+	entry.offset = offset;
+	entry.size = prompt.pcm_.size();
+	entry.channels = prompt.channels_;
+	entry.sample_rate = prompt.sample_rate_;
+	index.push_back(entry);
+	offset = alignUp(offset + entry.size, ALIGNMENT);
+  }
+
+  FILE* output = fopen(path, "wb");
+  if (!output) {
+	LOG(ERROR) << "Can not create " << path << " errno=" << errno;
+	return false;
+  }
+  offset = sizeof(header) + index.size() * sizeof(PromptBundleEntry);
+  if (fwrite(&header, sizeof(header), 1, output) != 1 ||
+	  (!index.empty() && fwrite(index.data(), sizeof(PromptBundleEntry),
+			  index.size(), output) != index.size())) {
+	LOG(ERROR) << "Error writing the prompt index.";
+	goto exit;
+  }
+  for (const PromptInfo& prompt : prompts_) {
+	size_t pad_len = alignUp(offset, ALIGNMENT) - offset;
+	if (pad_len && fwrite(padding, 1, pad_len, output) != pad_len) {
+	  LOG(ERROR) << "Error writing the prompt bundle.";
+	  goto exit;
+	}
+	offset += pad_len;
+	if (!prompt.pcm_.empty() && fwrite(prompt.pcm_.data(), 1,
+			prompt.pcm_.size(), output) != prompt.pcm_.size()) {
+	  LOG(ERROR) << "Error writing prompt " << prompt.name_;
+	  goto exit;
+	}
+	offset += prompt.pcm_.size();
+  }
+  result = true;
+exit:
+  if (fclose(output) != 0) {
+	result = false;
+  }
+  return result;
+}
+
+} /* namespace iqurius */
@@ -0,0 +1,223 @@
+/*
+ * PromptCache.cpp
+ *
+ *  Created on: Jun 4, 2015
+ *      Author: Venelin Efremov
+ *
+ *  Copyright (C) Venelin Efremov 2015
+ *  All rights reserved.
+ */
+
+#include "PromptCache.h"
+#include "PromptBundle.h"
+#include "SoundFragment.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(prompt_cache_kb, 4096, "Memory budget for decoded voice "
+		"prompts in KB.");
+
+namespace iqurius {
+
+PromptCache::PromptCache()
+    : PromptCache(FLAGS_prompt_cache_kb > 0 ? FLAGS_prompt_cache_kb * 1024 : 0) {
+}
+
+PromptCache::PromptCache(size_t budget_bytes)
+    : budget_bytes_(budget_bytes),
+      bundle_(nullptr),
+      cached_bytes_(0),
+      hits_(0),
+      misses_(0),
+      preload_running_(false),
+      signal_stop_(false),
+      thread_() {
+}
+
+PromptCache::~PromptCache() {
+  stopPreload();
+}
+
+void PromptCache::startPreload(const std::vector<std::string>& paths) {
+  if (preload_running_) {
+	LOG(WARNING) << "Prompt preload already running.";
+	return;
+  }
+  preload_paths_ = paths;
+  signal_stop_ = false;
+  pthread_create(&thread_, NULL, threadProc, this);
+  preload_running_ = true;
+}
+
+void PromptCache::stopPreload() {
+  if (preload_running_) {
+	signal_stop_ = true;
+	pthread_join(thread_, nullptr);
+	preload_running_ = false;
+  }
+}
+
+void* PromptCache::threadProc(void *ctx) {
+  PromptCache* pThis = reinterpret_cast<PromptCache*>(ctx);
+  pThis->preload();
+  return NULL;
+}
+
+void PromptCache::preload() {
+  size_t loaded = 0;
+  for (const std::string& path : preload_paths_) {
+	if (signal_stop_) {
+	  break;
+	}
+	if (lookup(path)) {
+	  continue;
+	}
+	size_t size;
+	FragmentPtr fragment(load(path, &size));
+	if (!fragment) {
+	  continue;
+	}
+	// Preloading must not push out prompts that were already used.
+	if (getCachedBytes() + size > budget_bytes_) {
+	  break;
+	}
+	insert(path, fragment, size);
+	loaded++;
+  }
+  LOG(INFO) << "Preloaded " << loaded << " prompts, "
+		  << getCachedBytes() / 1024 << "KB";
+}
+
+void PromptCache::setEncoding(const std::string& path,
+		SampleEncoding encoding) {
+  googleapis::MutexLock lock(&mutex_);
+  encodings_[path] = encoding;
+}
+
+PromptCache::FragmentPtr PromptCache::lookup(const std::string& path) {
+  googleapis::MutexLock lock(&mutex_);
+  auto it = entries_.find(path);
+  if (it == entries_.end()) {
+	return FragmentPtr();
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  return it->second.fragment;
+}
+
+SoundFragment* PromptCache::load(const std::string& path, size_t* size) {
+  SoundFragment* fragment = nullptr;
+  if (bundle_) {
+	fragment = bundle_->getFragment(path);
+  }
+  if (fragment) {
+	*size = 0;
+	return fragment;
+  }
+  SampleEncoding encoding = ENCODING_PCM_S16;
+  {
+	googleapis::MutexLock lock(&mutex_);
+	auto it = encodings_.find(path);
+	if (it != encodings_.end()) {
+	  encoding = it->second;
+	}
+  }
+  fragment = SoundFragment::fromVorbisFile(path.c_str(), true, encoding);
+  // Streaming fragments decode while playing and hold no samples.
+  *size = fragment && fragment->getBuffer() ? fragment->getBufferSize() : 0;
+  return fragment;
+}
+
+PromptCache::FragmentPtr PromptCache::insert(const std::string& path,
+		const FragmentPtr& fragment,
+		size_t size) {
+  googleapis::MutexLock lock(&mutex_);
+  auto it = entries_.find(path);
+  if (it != entries_.end()) {
+	// Decoded concurrently by the preload thread and a playback.
+	return it->second.fragment;
+  }
+  lru_.push_front(path);
+  Entry& entry = entries_[path];
+  entry.fragment = fragment;
+  entry.size = size;
+  entry.lru_position = lru_.begin();
+  cached_bytes_ += entry.size;
+  evict();
+  return fragment;
+}
+
+// Called with mutex_ held. Keeps at least the most recent prompt.
+void PromptCache::evict() {
+  while (cached_bytes_ > budget_bytes_ && lru_.size() > 1) {
+	auto it = entries_.find(lru_.back());
+	VLOG(1) << "Evicting prompt " << it->first;
+	cached_bytes_ -= it->second.size;
+	entries_.erase(it);
+	lru_.pop_back();
+  }
+}
+
+PromptCache::FragmentPtr PromptCache::get(const std::string& path) {
+  FragmentPtr fragment = lookup(path);
+  if (fragment) {
+	hits_++;
+	return fragment;
+  }
+  misses_++;
+  size_t size;
+  fragment.reset(load(path, &size));
+  if (!fragment) {
+	return fragment;
+  }
+  return insert(path, fragment, size);
+}
+
+std::string PromptCache::sequenceKey(const std::vector<std::string>& paths,
+		uint32_t silence_ms) {
+  std::string key;
+  for (const std::string& path : paths) {
+	key += path;
+	key += '|';
+  }
+  return key + std::to_string(silence_ms);
+}
+
+PromptCache::FragmentPtr PromptCache::getSequence(
+		const std::vector<std::string>& paths,
+		uint32_t silence_ms) {
+  const std::string key = sequenceKey(paths, silence_ms);
+  FragmentPtr fragment = lookup(key);
+  if (fragment) {
+	hits_++;
+	return fragment;
+  }
+  misses_++;
+  std::vector<FragmentPtr> parts;
+  std::vector<const SoundFragment*> fragments;
+  for (const std::string& path : paths) {
+	FragmentPtr part = get(path);
+	if (part && !part->getBuffer()) {
+	  // Long prompts are streamed, the sequence needs their samples.
+	  part.reset(SoundFragment::fromVorbisFile(path.c_str(), false));
+	}
+	if (!part) {
+	  LOG(ERROR) << "Unable to load " << path << " for a sequence";
+	  return FragmentPtr();
+	}
+	parts.push_back(part);
+	fragments.push_back(part.get());
+  }
+  fragment.reset(SoundFragment::concatenate(fragments, silence_ms));
+  if (!fragment) {
+	return fragment;
+  }
+  return insert(key, fragment, fragment->getBufferSize());
+}
+
+size_t PromptCache::getCachedBytes() const {
+  googleapis::MutexLock lock(&mutex_);
+  return cached_bytes_;
+}
+
+} /* namespace iqurius */
@@ -9,6 +9,7 @@
  */
 
 #include "SbcDecodeThread.h"
+#include "time_util.h"
 
 #include <glog/logging.h>
 
@@ -18,7 +19,9 @@ SbcDecodeThread::SbcDecodeThread(Connection* connection,
 		const ObjectPath& path,
 		iqurius::AudioChannel* audio_channel,
 		int sampling_rate)
-    : PlaybackThread(connection, path, audio_channel, sampling_rate) {
+    : PlaybackThread(connection, path, audio_channel, sampling_rate),
+      frame_config_(0),
+      frame_pcm_size_(0) {
 	sbc_init(&codec_, 0);
 }
 
@@ -26,19 +29,49 @@ SbcDecodeThread::~SbcDecodeThread() {
 	sbc_finish(&codec_);
 }
 
+void SbcDecodeThread::checkFrameConfig(const uint8_t* frame, size_t size) {
+	// Sync word, then sampling rate, blocks, mode, allocation and
+	// subbands in one byte, followed by the bitpool.
+	if (size < 3 || frame[0] != SBC_SYNCWORD) {
+		return;
+	}
+	uint16_t config = (frame[1] << 8) | frame[2];
+	if (config != frame_config_) {
+		LOG(INFO) << "SBC frame config 0x" << std::hex << (int)frame[1]
+				<< std::dec << " bitpool " << (int)frame[2];
+		frame_config_ = config;
+		configChanged(frame[2]);
+	}
+}
+
 void SbcDecodeThread::decode(const uint8_t* buffer, size_t size) {
 	if (size < 13) return;
+	// The media payload header after the RTP header holds the frame count.
+	size_t num_frames = buffer[12] & 0x0f;
+	size_t decoded_frames = 0;
 	buffer += 13; // Skip the RTP header and the SBC header
 	size -= 13;
 	while (size > 0) {
 		size_t written;
 		ssize_t read;
+		checkFrameConfig(buffer, size);
+		uint64_t decode_start_us = timeGetTimeUs();
 		read = sbc_decode(&codec_, buffer, size,
 				pcm_buffer_, sizeof(pcm_buffer_), &written);
 		if (read > 0) {
+			frameDecoded(decode_start_us);
+			decoded_frames++;
+			frame_pcm_size_ = written;
 			playPcm(pcm_buffer_, written);
 		} else {
-			LOG(ERROR) << "Decode error, skipping packet.";
+			decodeError();
+			if (num_frames > decoded_frames && frame_pcm_size_) {
+				LOG(ERROR) << "Decode error, concealing "
+						<< num_frames - decoded_frames << " frames.";
+				concealFrames(num_frames - decoded_frames, frame_pcm_size_);
+			} else {
+				LOG(ERROR) << "Decode error, skipping packet.";
+			}
 			break;
 		}
 		buffer += read;
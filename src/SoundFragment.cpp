@@ -10,101 +10,351 @@
 
 #include "SoundFragment.h"
 #include "AudioMixer.h"
+#include "PcmConvert.h"
 
+#include <gflags/gflags.h>
+#include <algorithm>
 #include <glog/logging.h>
+#include <string.h>
+#include <string>
+#include <vector>
 #include <vorbis/codec.h>
 #include <vorbis/vorbisfile.h>
 
+DEFINE_int32(prompt_stream_threshold_ms, 3000, "Prompts longer than this "
+		"are decoded while they play instead of being loaded whole.");
+DEFINE_int32(prompt_stream_readahead_ms, 300, "Amount of decoded audio "
+		"queued ahead of the mixer when streaming a prompt.");
+DEFINE_int32(prompt_mixer_timeout_ms, 1000, "Prompts are dropped when the "
+		"mixer takes nothing from the effects channel for this long.");
+DEFINE_int32(prompt_sample_rate, 44100, "Sample rate of the decoded "
+		"prompts. Lower rates, e.g. 22050 or 16000, keep the prompts as mono "
+		"and upsample them while mixing to save memory.");
+
 namespace iqurius {
 
 class MonoSoundFragment : public SoundFragment {
 public:
-	MonoSoundFragment(size_t num_samples);
-	virtual ~MonoSoundFragment();
+	MonoSoundFragment(size_t num_samples,
+			uint32_t sample_rate,
+			const uint8_t* samples = nullptr);
 
 	virtual size_t getBufferSize() const { return num_samples_ * 2; }
 	virtual uint8_t getChannels() const { return 1; }
-	virtual void playFragment(AudioChannel* audio_channel);
 private:
 	size_t num_samples_;
-	uint8_t* conversion_buffer_;
 	DISALLOW_COPY_AND_ASSIGN(MonoSoundFragment);
 };
 
 class StereoSoundFragment : public SoundFragment {
 public:
-	StereoSoundFragment(size_t num_samples);
+	StereoSoundFragment(size_t num_samples, const uint8_t* samples = nullptr);
 
 	virtual size_t getBufferSize() const { return num_samples_ * 4; }
 	virtual uint8_t getChannels() const { return 2; }
-	virtual void playFragment(AudioChannel* audio_channel);
 private:
 	size_t num_samples_;
 	DISALLOW_COPY_AND_ASSIGN(StereoSoundFragment);
 };
 
-MonoSoundFragment::MonoSoundFragment(size_t num_samples) {
+// Mono IMA-ADPCM blocks, decoded by the mixer while the prompt plays.
+class AdpcmSoundFragment : public SoundFragment {
+public:
+	AdpcmSoundFragment(const std::vector<uint8_t>& blocks,
+			uint32_t sample_rate);
+
+	virtual size_t getBufferSize() const { return num_bytes_; }
+	virtual uint8_t getChannels() const { return 1; }
+private:
+	size_t num_bytes_;
+	DISALLOW_COPY_AND_ASSIGN(AdpcmSoundFragment);
+};
+
+// Decodes the Ogg file into channel buffers while it plays, so memory use
+// does not depend on the prompt length.
+class StreamingVorbisFragment : public SoundFragment {
+public:
+	StreamingVorbisFragment(const char* path,
+			uint8_t channels,
+			size_t num_samples)
+	    : path_(path),
+	      channels_(channels),
+	      num_samples_(num_samples) {}
+
+	virtual size_t getBufferSize() const { return num_samples_ * channels_ * 2; }
+	virtual uint8_t getChannels() const { return channels_; }
+	virtual void playFragment(AudioChannel* audio_channel);
+private:
+	std::string path_;
+	uint8_t channels_;
+	size_t num_samples_;
+	DISALLOW_COPY_AND_ASSIGN(StreamingVorbisFragment);
+};
+
+MonoSoundFragment::MonoSoundFragment(size_t num_samples,
+		uint32_t sample_rate,
+		const uint8_t* samples) {
   num_samples_ = num_samples;
-  sample_buffer_ = new uint8_t[num_samples * 2];
-  conversion_buffer_ = new uint8_t[AudioMixer::AUDIO_BUFFER_SIZE * 4];
+  sample_rate_ = sample_rate;
+  if (samples) {
+	sample_buffer_ = const_cast<uint8_t*>(samples);
+	owns_buffer_ = false;
+  } else {
+	sample_buffer_ = new uint8_t[num_samples * 2];
+  }
 }
 
-StereoSoundFragment::StereoSoundFragment(size_t num_samples) {
+StereoSoundFragment::StereoSoundFragment(size_t num_samples,
+		const uint8_t* samples) {
   num_samples_ = num_samples;
-  sample_buffer_ = new uint8_t[num_samples * 4];
+  if (samples) {
+	sample_buffer_ = const_cast<uint8_t*>(samples);
+	owns_buffer_ = false;
+  } else {
+	sample_buffer_ = new uint8_t[num_samples * 4];
+  }
+}
+
+AdpcmSoundFragment::AdpcmSoundFragment(const std::vector<uint8_t>& blocks,
+		uint32_t sample_rate) {
+  num_bytes_ = blocks.size();
+  sample_rate_ = sample_rate;
+  encoding_ = ENCODING_IMA_ADPCM;
+  sample_buffer_ = new uint8_t[num_bytes_];
+  memcpy(sample_buffer_, blocks.data(), num_bytes_);
+}
+
+SoundFragment::SoundFragment()
+    : sample_buffer_(nullptr),
+      sample_rate_(OUTPUT_SAMPLE_RATE),
+      encoding_(ENCODING_PCM_S16),
+      owns_buffer_(true),
+      cancel_playback_(false),
+      borrowed_buffers_(new BorrowedBufferPool()) {
 }
 
 SoundFragment::~SoundFragment() {
-  delete [] sample_buffer_;
+  delete borrowed_buffers_;
+  if (owns_buffer_) {
+	delete [] sample_buffer_;
+  }
 }
 
-MonoSoundFragment::~MonoSoundFragment() {
-  delete [] conversion_buffer_;
+// Rate the prompts are stored at, see --prompt_sample_rate.
+static uint32_t promptSampleRate() {
+  if (FLAGS_prompt_sample_rate < 8000 ||
+	  FLAGS_prompt_sample_rate > (int32_t)OUTPUT_SAMPLE_RATE) {
+	LOG(WARNING) << "Unsupported prompt sample rate "
+			<< FLAGS_prompt_sample_rate;
+	return OUTPUT_SAMPLE_RATE;
+  }
+  return FLAGS_prompt_sample_rate;
 }
 
-SoundFragment* SoundFragment::fromVorbisFile(const char* path) {
+SoundFragment* SoundFragment::fromVorbisFile(const char* path,
+		bool allow_streaming,
+		SampleEncoding encoding) {
   SoundFragment* result = nullptr;
   OggVorbis_File vf;
   vorbis_info *vi;
   ogg_int64_t num_samples;
-  char* buffer;
-  long len;
-  size_t buffer_len;
-  int current_section;
+  std::vector<int16_t> pcm;
+  uint8_t channels;
+  uint32_t sample_rate;
+  const uint32_t storage_rate = promptSampleRate();
 
   if(ov_fopen(path, &vf) < 0) {
 	LOG(ERROR) << "File " << path << " is not a valid Ogg bitstream.";
 	return nullptr;
   }
   vi = ov_info(&vf, -1);
-  CHECK(vi->rate == 44100);
-  CHECK(vi->channels <= 2);
   num_samples = ov_pcm_total(&vf, -1);
-  if (vi->channels == 1) {
-	  result = new MonoSoundFragment(num_samples);
+  // Only prompts that need no conversion can be decoded while they play.
+  if (allow_streaming && FLAGS_prompt_stream_threshold_ms >= 0 &&
+	  storage_rate == OUTPUT_SAMPLE_RATE &&
+	  vi->rate == OUTPUT_SAMPLE_RATE &&
+	  vi->channels >= 1 && vi->channels <= 2 &&
+	  num_samples > (ogg_int64_t)FLAGS_prompt_stream_threshold_ms *
+			OUTPUT_SAMPLE_RATE / 1000) {
+	result = new StreamingVorbisFragment(path, vi->channels, num_samples);
+  }
+  ov_clear(&vf);
+  if (result) {
+	return result;
+  }
+
+  if (!decodeVorbisFile(path, &pcm, &channels, &sample_rate)) {
+	return nullptr;
+  }
+  if (sample_rate != storage_rate || channels > 2) {
+	LOG(INFO) << "Converting " << path << " from " << sample_rate << "Hz "
+			<< (int)channels << " channels to " << storage_rate << "Hz";
+  }
+  if (!normalizePcm(&pcm, &channels, &sample_rate, storage_rate,
+		  storage_rate != OUTPUT_SAMPLE_RATE ||
+		  encoding == ENCODING_IMA_ADPCM)) {
+	return nullptr;
+  }
+  if (encoding == ENCODING_IMA_ADPCM) {
+	std::vector<uint8_t> blocks;
+	imaAdpcmEncode(pcm.data(), pcm.size(), &blocks);
+	return new AdpcmSoundFragment(blocks, sample_rate);
+  }
+  if (channels == 1) {
+	result = new MonoSoundFragment(pcm.size(), sample_rate);
   } else {
-	  result = new StereoSoundFragment(num_samples);
-  }
-
-  buffer = (char*)result->sample_buffer_;
-  buffer_len = (int)result->getBufferSize();
-  while (buffer_len > 0) {
-	len = ov_read(&vf, buffer, buffer_len, 0, 2, 1, &current_section);
-	if (len < 0) {
-	  LOG(ERROR) << "Error decoding the stream.";
-	  delete result;
-	  result = nullptr;
-	  goto exit;
+	result = new StereoSoundFragment(pcm.size() / 2);
+  }
+  memcpy(result->sample_buffer_, pcm.data(), result->getBufferSize());
+  return result;
+}
+
+SoundFragment* SoundFragment::concatenate(
+		const std::vector<const SoundFragment*>& fragments,
+		uint32_t silence_ms) {
+  SoundFragment* result = nullptr;
+  std::vector<int16_t> pcm;
+  uint8_t out_channels = 1;
+  uint32_t out_rate = 0;
+
+  // Keep the common format, anything mixed is converted to the output
+  // format. Only mono can be stored below the output rate.
+  bool adpcm = !fragments.empty();
+
+  for (const SoundFragment* fragment : fragments) {
+	if (!fragment->getBuffer()) {
+	  LOG(ERROR) << "Can not concatenate a streaming fragment.";
+	  return nullptr;
+	}
+	adpcm = adpcm && fragment->getEncoding() == ENCODING_IMA_ADPCM;
+	out_channels = std::max(out_channels, fragment->getChannels());
+	if (out_rate && out_rate != fragment->getSampleRate()) {
+	  out_rate = OUTPUT_SAMPLE_RATE;
+	} else {
+	  out_rate = fragment->getSampleRate();
 	}
-	buffer += len;
-	buffer_len -= len;
   }
-exit:
-  ov_clear(&vf);
+  if (out_channels == 2 || !out_rate) {
+	out_rate = OUTPUT_SAMPLE_RATE;
+  }
+  for (size_t idx = 0; idx < fragments.size(); ++idx) {
+	const SoundFragment* fragment = fragments[idx];
+	std::vector<int16_t> part;
+	if (fragment->getEncoding() == ENCODING_IMA_ADPCM) {
+	  imaAdpcmDecode(fragment->getBuffer(), fragment->getBufferSize(), &part);
+	} else {
+	  const int16_t* samples =
+			  reinterpret_cast<const int16_t*>(fragment->getBuffer());
+	  part.assign(samples, samples + fragment->getBufferSize() / 2);
+	}
+	uint8_t channels = fragment->getChannels();
+	uint32_t sample_rate = fragment->getSampleRate();
+	if (!normalizePcm(&part, &channels, &sample_rate, out_rate, false)) {
+	  return nullptr;
+	}
+	if (idx > 0) {
+	  pcm.resize(pcm.size() +
+			  (size_t)out_rate * silence_ms / 1000 * out_channels, 0);
+	}
+	if (channels < out_channels) {
+	  for (int16_t sample : part) {
+		pcm.push_back(sample);
+		pcm.push_back(sample);
+	  }
+	} else {
+	  pcm.insert(pcm.end(), part.begin(), part.end());
+	}
+  }
+  // Keep a sequence of compact prompts compact.
+  if (adpcm) {
+	std::vector<uint8_t> blocks;
+	imaAdpcmEncode(pcm.data(), pcm.size(), &blocks);
+	return new AdpcmSoundFragment(blocks, out_rate);
+  }
+  if (out_channels == 1) {
+	result = new MonoSoundFragment(pcm.size(), out_rate);
+  } else {
+	result = new StereoSoundFragment(pcm.size() / 2);
+  }
+  memcpy(result->sample_buffer_, pcm.data(), result->getBufferSize());
   return result;
 }
 
-AudioBuffer* SoundFragment::waitForFreeBuffer(AudioChannel* audio_channel) {
+SoundFragment* SoundFragment::fromMemory(const uint8_t* data,
+		size_t len,
+		uint8_t channels,
+		uint32_t sample_rate) {
+  if (channels == 1 && sample_rate <= OUTPUT_SAMPLE_RATE) {
+	return new MonoSoundFragment(len / 2, sample_rate, data);
+  } else if (channels == 2 && sample_rate == OUTPUT_SAMPLE_RATE) {
+	return new StereoSoundFragment(len / 4, data);
+  }
+  LOG(ERROR) << "Unsupported format " << sample_rate << "Hz "
+		  << (int)channels << " channels";
+  return nullptr;
+}
+
+void StreamingVorbisFragment::playFragment(AudioChannel* audio_channel) {
+  const size_t frame_size = channels_ * 2;
+  const size_t readahead_len = (size_t)FLAGS_prompt_stream_readahead_ms *
+		  OUTPUT_SAMPLE_RATE / 1000 * frame_size;
+  OggVorbis_File vf;
+  int current_section;
+  bool first_buffer = true;
+  bool eof = false;
+  MixerProgress progress = { 0, 0, false };
+
+  if (ov_fopen(path_.c_str(), &vf) < 0) {
+	LOG(ERROR) << "File " << path_ << " is not a valid Ogg bitstream.";
+	return;
+  }
+  while (!eof && !cancel_playback_) {
+	while (audio_channel->getQueuedBytes() >= readahead_len &&
+		   waitForMixer(audio_channel, &progress)) {
+	}
+	if (audio_channel->getQueuedBytes() >= readahead_len) {
+	  break;
+	}
+	AudioBuffer* audio_buffer = waitForFreeBuffer(audio_channel, &progress);
+	if (nullptr == audio_buffer) {
+	  break;
+	}
+	audio_buffer->setChannels(channels_);
+	// Start playing after a single mix block, later buffers are full.
+	size_t fill_len = first_buffer ?
+			AudioMixer::MIX_BLOCK_FRAMES * frame_size : audio_buffer->getSize();
+	fill_len -= fill_len % frame_size;
+	size_t buffer_len = 0;
+	while (buffer_len < fill_len) {
+	  long len = ov_read(&vf,
+			  reinterpret_cast<char*>(audio_buffer->getData()) + buffer_len,
+			  fill_len - buffer_len, 0, 2, 1, &current_section);
+	  if (len == OV_HOLE) {
+		continue;
+	  }
+	  if (len <= 0) {
+		if (len < 0) {
+		  LOG(ERROR) << "Error decoding " << path_;
+		}
+		eof = true;
+		break;
+	  }
+	  buffer_len += len;
+	}
+	audio_buffer->setDataSize(buffer_len - buffer_len % frame_size);
+	if (audio_buffer->getDataLen() == 0 ||
+		!audio_channel->postBuffer(audio_buffer)) {
+	  audio_channel->releaseBuffer(audio_buffer);
+	}
+	first_buffer = false;
+  }
+  ov_clear(&vf);
+  // Return once the prompt is mixed, like the in memory fragments.
+  finishPlayback(audio_channel, &progress);
+}
+
+AudioBuffer* SoundFragment::waitForFreeBuffer(AudioChannel* audio_channel,
+		MixerProgress* progress) {
   AudioBuffer* audio_buffer;
 
   do {
@@ -112,59 +362,90 @@ AudioBuffer* SoundFragment::waitForFreeBuffer(AudioChannel* audio_channel) {
 	if (audio_buffer) {
 		return audio_buffer;
 	}
-    usleep(10000);
-  } while (!cancel_playback_);
+  } while (waitForMixer(audio_channel, progress));
   return nullptr;
 }
 
-void MonoSoundFragment::playFragment(AudioChannel* audio_channel) {
-  const size_t frame_size = 2;
-  const uint8_t* fragment_buffer = getBuffer();
-  size_t fragment_len = getBufferSize() / frame_size;
+// Sleeps while the mixer plays the channel. Returns false when the
+// playback is cancelled, or when the mixer took nothing out of the channel
+// for --prompt_mixer_timeout_ms.
+bool SoundFragment::waitForMixer(AudioChannel* audio_channel,
+		MixerProgress* progress) {
+  const size_t queued_bytes = audio_channel->getQueuedBytes();
+  const uint64_t now_us = timeGetTimeUs();
 
-  while (fragment_len > 0) {
-    AudioBuffer* audio_buffer = waitForFreeBuffer(audio_channel);
-    if (nullptr == audio_buffer) {
-      break;
-    }
+  if (cancel_playback_ || progress->stalled_) {
+	return false;
+  }
+  if (progress->changed_us_ == 0 || queued_bytes != progress->queued_bytes_) {
+	progress->queued_bytes_ = queued_bytes;
+	progress->changed_us_ = now_us;
+  } else if (now_us - progress->changed_us_ >=
+		  (uint64_t)FLAGS_prompt_mixer_timeout_ms * 1000) {
+	LOG(ERROR) << "The mixer stopped playing prompts.";
+	progress->stalled_ = true;
+	return false;
+  }
+  usleep(10000);
+  return true;
+}
 
-    size_t buffer_len = audio_buffer->getSize() / 4;
-    if (fragment_len < buffer_len) {
-  	  buffer_len = fragment_len;
-    }
-    CHECK(buffer_len <= AudioMixer::AUDIO_BUFFER_SIZE / 4);
-    for (int idx = 0; idx < buffer_len; ++idx) {
-      conversion_buffer_[idx*4] = fragment_buffer[idx*2];
-      conversion_buffer_[idx*4 + 1] = fragment_buffer[idx*2 + 1];
-      conversion_buffer_[idx*4 + 2] = fragment_buffer[idx*2];
-      conversion_buffer_[idx*4 + 3] = fragment_buffer[idx*2 + 1];
-    }
-    audio_buffer->write(conversion_buffer_, buffer_len * 4);
-	audio_channel->postBuffer(audio_buffer);
-    fragment_buffer += buffer_len * 2;
-	fragment_len -= buffer_len;
+// Waits until the mixer is done with everything the fragment posted. What
+// is left when the playback is cancelled or the mixer stops is dropped, so
+// a preempting prompt starts at once and no borrowed buffer outlives the
+// playback.
+void SoundFragment::finishPlayback(AudioChannel* audio_channel,
+		MixerProgress* progress) {
+  while (audio_channel->getQueuedBytes() > 0 ||
+		 borrowed_buffers_->getOutstanding() > 0) {
+	if (!waitForMixer(audio_channel, progress)) {
+	  audio_channel->flush(FLAGS_prompt_mixer_timeout_ms);
+	  break;
+	}
   }
 }
 
-void StereoSoundFragment::playFragment(AudioChannel* audio_channel) {
-  const size_t frame_size = 4;
+void SoundFragment::playFragment(AudioChannel* audio_channel) {
+  const uint8_t channels = getChannels();
+  // Buffers are cut at frames, or at blocks for IMA-ADPCM.
+  const bool adpcm = encoding_ == ENCODING_IMA_ADPCM;
+  const size_t unit_size = adpcm ? IMA_ADPCM_BLOCK_BYTES : channels * 2;
+  // Same duration per buffer as the channel buffers.
+  size_t max_buffer_len = getSampleRate() / 10;
+  if (adpcm) {
+	max_buffer_len = std::max<size_t>(1,
+			max_buffer_len / IMA_ADPCM_BLOCK_SAMPLES);
+  }
   const uint8_t* fragment_buffer = getBuffer();
-  size_t frafment_len = getBufferSize() / frame_size;
+  size_t fragment_len = getBufferSize() / unit_size;
+  MixerProgress progress = { 0, 0, false };
 
-  while (frafment_len > 0) {
-    AudioBuffer* audio_buffer = waitForFreeBuffer(audio_channel);
+  while (fragment_len > 0 && !cancel_playback_) {
+    AudioBuffer* audio_buffer = borrowed_buffers_->getFreeBuffer();
     if (nullptr == audio_buffer) {
-      break;
+      if (!waitForMixer(audio_channel, &progress)) {
+        break;
+      }
+      continue;
     }
-    size_t buffer_len = audio_buffer->getSize() / 4;
-    if (frafment_len < buffer_len) {
-  	  buffer_len = frafment_len;
+    size_t buffer_len = max_buffer_len;
+    if (fragment_len < buffer_len) {
+  	  buffer_len = fragment_len;
     }
-  	audio_buffer->write(fragment_buffer, buffer_len * 4);
-	audio_channel->postBuffer(audio_buffer);
- 	fragment_buffer += buffer_len * 4;
-	frafment_len -= buffer_len;
+    audio_buffer->borrow(fragment_buffer, buffer_len * unit_size, channels,
+    		getSampleRate());
+    audio_buffer->setEncoding(encoding_);
+    if (!audio_channel->postBuffer(audio_buffer)) {
+      LOG(ERROR) << "Audio channel queue is full.";
+      borrowed_buffers_->releaseBuffer(audio_buffer);
+      break;
+    }
+    fragment_buffer += buffer_len * unit_size;
+	fragment_len -= buffer_len;
   }
+  // The mixer still reads from the posted buffers, the fragment can be
+  // released or played again only after it is done with them.
+  finishPlayback(audio_channel, &progress);
 }
 
 } /* namespace dbus */
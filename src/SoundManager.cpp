@@ -10,8 +10,15 @@
 
 #include "SoundManager.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <map>
+#include <set>
+
+DEFINE_string(prompt_bundle, DATADIR "/prompts.bin", "Prebuilt PCM bundle "
+		"with the voice prompts. The Ogg files are decoded when it is missing.");
+DEFINE_bool(compact_prompts, true, "Keep the decoded speech prompts as "
+		"IMA-ADPCM, decoded by the mixer while they play.");
 
 namespace iqurius {
 
@@ -40,7 +47,26 @@ static const std::map<SoundManager::ESoundID, std::string> g_SoundPaths = {
 		{ SoundManager::SOUND_READY_TO_PAIR, DATADIR "/Ready_to_pair1.ogg" }
 };
 
+// Speech survives IMA-ADPCM well, the short chimes stay PCM.
+static const std::set<SoundManager::ESoundID> g_CompactSounds = {
+		SoundManager::SOUND_DISABLED,
+		SoundManager::SOUND_RESTARTING,
+		SoundManager::SOUND_ENTER_CODE_522,
+		SoundManager::SOUND_UNABLE_TO_CONNECT_TO_BLUETOOTH_ADAPTER,
+		SoundManager::SOUND_UPDATE_COMPLETED,
+		SoundManager::SOUND_NO_PHONE_CONNECTED,
+		SoundManager::SOUND_UPDATE_COMPLETE,
+		SoundManager::SOUND_PLEASE_DONT_TURH_THE_POWER,
+		SoundManager::SOUND_UPDATE_IS_AVAILABLE,
+		SoundManager::SOUND_PREPARING_THE_UPDATE,
+		SoundManager::SOUND_UPDATING,
+		SoundManager::SOUND_READY_TO_PAIR
+};
+
 SoundManager::SoundManager() {
+	if (!FLAGS_prompt_bundle.empty()) {
+		bundle_.open(FLAGS_prompt_bundle.c_str());
+	}
 }
 
 const char* SoundManager::getSoundPath(ESoundID sound_id) const {
@@ -50,4 +76,22 @@ const char* SoundManager::getSoundPath(ESoundID sound_id) const {
 	}
 	return element->second.c_str();
 }
+
+std::vector<std::string> SoundManager::getSoundPaths() const {
+	std::vector<std::string> paths;
+	for (const auto& element : g_SoundPaths) {
+		paths.push_back(element.second);
+	}
+	return paths;
+}
+
+std::map<std::string, SampleEncoding> SoundManager::getSoundEncodings() const {
+	std::map<std::string, SampleEncoding> encodings;
+	if (FLAGS_compact_prompts) {
+		for (ESoundID sound_id : g_CompactSounds) {
+			encodings[getSoundPath(sound_id)] = ENCODING_IMA_ADPCM;
+		}
+	}
+	return encodings;
+}
 } /* namespace dbus */
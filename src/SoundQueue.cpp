@@ -12,18 +12,37 @@
 
 #include "AudioMixer.h"
 #include "SoundFragment.h"
+#include "time_util.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+DEFINE_int32(prompt_gap_ms, 1000, "Default pause after each voice prompt.");
+
 namespace iqurius {
 
 static constexpr size_t MAX_QUEUED_MESSAGES = 10;
 
 void SoundQueue::stop() {
   if (running_) {
-    signal_stop_ = true;
+	{
+	  googleapis::MutexLock lock(&mutex_);
+	  signal_stop_ = true;
+	  // Stops the prompt playing now, its buffers are dropped.
+	  if (current_fragment_) {
+		current_fragment_->cancel();
+	  }
+	  queue_cond_.SignalAll();
+	}
     pthread_join(thread_, nullptr);
+	googleapis::MutexLock lock(&mutex_);
     running_ = false;
+	for (FragmentInfo* fragment_info : scheduled_fragments_) {
+	  delete fragment_info;
+	}
+	scheduled_fragments_.clear();
+	fragment_playback_ = false;
+	idle_cond_.SignalAll();
   }
 }
 
@@ -45,91 +64,267 @@ void* SoundQueue::threadProc(void *ctx) {
 }
 
 void SoundQueue::run() {
-  FragmentInfo* next_fragment = nullptr;
-  fragment_playback_ = false;
-  while (!signal_stop_) {
-	bool got_new_fragment = false;
+  FragmentInfo* last_fragment = nullptr;
+  while (true) {
+	FragmentInfo* next_fragment;
 	{
 	  googleapis::MutexLock lock(&mutex_);
-	  if (scheduled_fragments_.size() > 0) {
-		delete next_fragment;
-		next_fragment = *scheduled_fragments_.begin();
+	  while (!signal_stop_ && scheduled_fragments_.empty() &&
+			 !(replay_ && last_fragment)) {
+		fragment_playback_ = false;
+		idle_cond_.SignalAll();
+		queue_cond_.Wait(&mutex_);
+	  }
+	  if (signal_stop_) {
+		break;
+	  }
+	  if (!scheduled_fragments_.empty()) {
+		next_fragment = scheduled_fragments_.front();
 		scheduled_fragments_.pop_front();
-		got_new_fragment = true;
+	  } else {
+		next_fragment = last_fragment;
 	  }
+	  fragment_playback_ = true;
+	  preempted_ = false;
+	  current_fragment_ = next_fragment;
 	}
-	if (!got_new_fragment) {
-      usleep(100000);
+	if (next_fragment != last_fragment) {
+	  delete last_fragment;
+	  last_fragment = next_fragment;
 	}
-    if (!next_fragment) {
-      fragment_playback_ = false;
-      continue;
-    }
-    while (replay_ || next_fragment->repeatLeft()) {
-      fragment_playback_ = true;
-      int16_t old_music_volume = music_audio_channel_->getVolume();
-      int16_t old_effects_volume = effect_audio_channel_->getVolume();
-      music_audio_channel_->setVolume(0.3f);
-      effect_audio_channel_->setVolume(0.7f);
-      next_fragment->playFragment(effect_audio_channel_);
-      effect_audio_channel_->setVolume(old_effects_volume);
-      music_audio_channel_->setVolume(old_music_volume);
-      usleep(next_fragment->delay());
-      if (!auto_replay_) {
-        replay_ = false;
-      }
-    }
-    if (fragment_playback_) {
+	playFragment(next_fragment);
+	{
+	  googleapis::MutexLock lock(&mutex_);
 	  fragment_playback_ = false;
-      sleep(1);  // pause after each message
+	  if (scheduled_fragments_.empty()) {
+		idle_cond_.SignalAll();
+	  }
+	}
+	waitFor(next_fragment->gap());  // pause after each message
+	googleapis::MutexLock lock(&mutex_);
+	current_fragment_ = nullptr;
+  }
+  delete last_fragment;
+}
+
+void SoundQueue::playFragment(FragmentInfo* fragment_info) {
+  if (!fragment_info->loaded()) {
+	PromptCache::FragmentPtr fragment = fragment_info->fetch(prompt_cache_);
+	googleapis::MutexLock lock(&mutex_);
+	if (!fragment_info->setFragment(fragment)) {
+	  return;
+	}
+  }
+  while (true) {
+	{
+	  googleapis::MutexLock lock(&mutex_);
+	  if (signal_stop_ || preempted_ ||
+		  !(replay_ || fragment_info->repeatLeft())) {
+		break;
+	  }
+	  // Under the lock, a preemption either sees the rearmed fragment or
+	  // is seen by the check above.
+	  fragment_info->rearm();
+	}
+	if (!fragment_info->played()) {
+	  // Everything queued in the channel and ALSA plays before the prompt.
+	  uint64_t latency_us = timeGetTimeUs() - fragment_info->scheduleTime() +
+			  (uint64_t)effect_audio_channel_->getOutputDelay() * 1000000 / 44100;
+	  schedule_latency_.add(latency_us);
+	  LOG(INFO) << "Prompt " << fragment_info->path() << " audible "
+			  << latency_us / 1000 << "ms after scheduling";
+	}
+    int16_t old_music_volume = music_audio_channel_->getVolume();
+    int16_t old_effects_volume = effect_audio_channel_->getVolume();
+    music_audio_channel_->setVolume(0.3f);
+    effect_audio_channel_->setVolume(0.7f);
+    fragment_info->playFragment(effect_audio_channel_);
+    effect_audio_channel_->setVolume(old_effects_volume);
+    music_audio_channel_->setVolume(old_music_volume);
+    waitFor(fragment_info->delay() / 1000);
+    if (!auto_replay_) {
+      replay_ = false;
     }
   }
-  delete next_fragment;
 }
 
-void SoundQueue::FragmentInfo::playFragment(AudioChannel* channel) {
-  if (!fragment_) {
-	fragment_ = SoundFragment::fromVorbisFile(fragment_path_.c_str());
+// Sleeps unless the queue is stopped or preempted in the meantime.
+void SoundQueue::waitFor(uint32_t time_ms) {
+  if (!time_ms) {
+	return;
+  }
+  uint64_t deadline_us = timeGetTimeUs() + (uint64_t)time_ms * 1000;
+  googleapis::MutexLock lock(&mutex_);
+  while (!signal_stop_ && !preempted_) {
+	uint64_t now_us = timeGetTimeUs();
+	if (now_us >= deadline_us) {
+	  break;
+	}
+	queue_cond_.WaitWithTimeout(&mutex_, (deadline_us - now_us + 999) / 1000);
+  }
+}
+
+SoundQueue::FragmentInfo::FragmentInfo(const char* path,
+		uint32_t repeat,
+		uint32_t delay,
+		uint32_t gap_ms,
+		EPriority priority)
+    : fragment_path_(path),
+	  silence_ms_(0),
+	  repeat_num_(repeat),
+	  repeat_delay_(delay),
+	  gap_ms_(gap_ms),
+	  priority_(priority),
+	  schedule_time_us_(timeGetTimeUs()),
+	  played_(false) {
+}
+
+void SoundQueue::FragmentInfo::setSequence(
+		const std::vector<std::string>& parts,
+		uint32_t silence_ms) {
+  parts_ = parts;
+  silence_ms_ = silence_ms;
+}
+
+PromptCache::FragmentPtr SoundQueue::FragmentInfo::fetch(
+		PromptCache* prompt_cache) const {
+  if (!parts_.empty()) {
+	return prompt_cache->getSequence(parts_, silence_ms_);
   }
+  return prompt_cache->get(fragment_path_);
+}
+
+bool SoundQueue::FragmentInfo::setFragment(
+		const PromptCache::FragmentPtr& fragment) {
+  fragment_ = fragment;
   if (!fragment_) {
 	LOG(ERROR) << "Unable to load audio fragment " << fragment_path_;
 	repeat_num_ = 0;
-	return;
+	return false;
   }
+  return true;
+}
+
+void SoundQueue::FragmentInfo::cancel() {
+  if (fragment_) {
+	fragment_->cancelPlayback();
+  }
+}
+
+void SoundQueue::FragmentInfo::rearm() {
+  fragment_->resetCancel();
+}
+
+void SoundQueue::FragmentInfo::playFragment(AudioChannel* channel) {
   fragment_->playFragment(channel);
+  played_ = true;
   if (repeat_num_)
 	repeat_num_--;
 }
 
-SoundQueue::FragmentInfo::~FragmentInfo() {
-	delete fragment_;
+void SoundQueue::replay() {
+  googleapis::MutexLock lock(&mutex_);
+  replay_ = true;
+  queue_cond_.Signal();
 }
 
 void SoundQueue::waitQueueEmpty() {
   autoReplay(false);
-  while (true) {
-	{
-      googleapis::MutexLock lock(&mutex_);
-      if (scheduled_fragments_.size() == 0 && !fragment_playback_) {
-        return;
-      }
+  googleapis::MutexLock lock(&mutex_);
+  while (running_ && (scheduled_fragments_.size() > 0 || fragment_playback_)) {
+	idle_cond_.Wait(&mutex_);
+  }
+}
+
+// Drops the newest of the lowest priority pending prompts if it is less
+// important than the one to be scheduled.
+bool SoundQueue::makeRoom(EPriority priority) {
+  auto victim = scheduled_fragments_.end();
+  for (auto it = scheduled_fragments_.begin();
+	   it != scheduled_fragments_.end(); ++it) {
+	if (victim == scheduled_fragments_.end() ||
+		(*it)->priority() <= (*victim)->priority()) {
+	  victim = it;
 	}
-    usleep(250000);
   }
+  if (victim == scheduled_fragments_.end() ||
+	  (*victim)->priority() >= priority) {
+	return false;
+  }
+  LOG(WARNING) << "Sound queue is full, dropping " << (*victim)->path();
+  delete *victim;
+  scheduled_fragments_.erase(victim);
+  return true;
 }
 
 void SoundQueue::scheduleFragment(const char* path,
 		uint32_t repeat,
-		uint32_t delay) {
-  googleapis::MutexLock lock(&mutex_);
+		uint32_t delay,
+		int32_t gap_ms,
+		EPriority priority) {
   if (!path) {
 	LOG(ERROR) << "Trying to schedule a null pointer fragment";
+	return;
+  }
+  schedule(new FragmentInfo(path, repeat, delay,
+		  gap_ms < 0 ? FLAGS_prompt_gap_ms : gap_ms, priority));
+}
+
+void SoundQueue::scheduleSequence(const std::vector<std::string>& paths,
+		uint32_t silence_ms,
+		EPriority priority) {
+  if (paths.empty()) {
+	LOG(ERROR) << "Trying to schedule an empty sequence";
+	return;
   }
-  if (scheduled_fragments_.size() < MAX_QUEUED_MESSAGES) {
-	scheduled_fragments_.push_back(new FragmentInfo(path, repeat, delay));
-  } else {
+  FragmentInfo* fragment_info = new FragmentInfo(
+		  PromptCache::sequenceKey(paths, silence_ms).c_str(), 1, 0,
+		  FLAGS_prompt_gap_ms, priority);
+  fragment_info->setSequence(paths, silence_ms);
+  schedule(fragment_info);
+}
+
+// Takes ownership of fragment_info.
+void SoundQueue::schedule(FragmentInfo* fragment_info) {
+  const EPriority priority = fragment_info->priority();
+  googleapis::MutexLock lock(&mutex_);
+  for (auto it = scheduled_fragments_.begin();
+	   it != scheduled_fragments_.end(); ++it) {
+	if ((*it)->path() == fragment_info->path()) {
+	  if ((*it)->priority() >= priority) {
+		LOG(INFO) << "Prompt " << fragment_info->path()
+				<< " is already pending.";
+		delete fragment_info;
+		return;
+	  }
+	  // Reschedule it with the higher priority.
+	  delete *it;
+	  scheduled_fragments_.erase(it);
+	  break;
+	}
+  }
+  if (scheduled_fragments_.size() >= MAX_QUEUED_MESSAGES &&
+	  !makeRoom(priority)) {
 	LOG(ERROR) << "Sound queue is full.";
+	delete fragment_info;
+	return;
+  }
+  auto pos = scheduled_fragments_.begin();
+  while (pos != scheduled_fragments_.end() && (*pos)->priority() >= priority) {
+	++pos;
+  }
+  scheduled_fragments_.insert(pos, fragment_info);
+  if (current_fragment_ && !preempted_ &&
+	  current_fragment_->priority() < priority) {
+	LOG(INFO) << "Prompt " << fragment_info->path() << " preempts "
+			<< current_fragment_->path();
+	preempted_ = true;
+	current_fragment_->cancel();
+	// The auto replay belonged to the preempted prompt.
+	replay_ = false;
+	auto_replay_ = false;
   }
+  queue_cond_.Signal();
 }
 
 } /* namespace dbus */
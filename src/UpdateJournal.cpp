@@ -0,0 +1,228 @@
+/*
+ * UpdateJournal.cpp
+ *
+ *  Created on: Jul 2, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "UpdateJournal.h"
+
+#include "BlockCodec.h"
+#include "FlashWriter.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace iqurius {
+
+static constexpr size_t g_HeaderSize = 4 + JOURNAL_DIGEST_SIZE;
+static constexpr size_t g_RecordSize = 4 + 8 + JOURNAL_DIGEST_SIZE + 4;
+static constexpr uint32_t g_CommitRecord = 0xffffffff;
+
+static void putUint32(uint32_t value, uint8_t* buffer) {
+	for (int idx = 0; idx < 4; ++idx) {
+		buffer[idx] = (value >> (idx * 8)) & 0xff;
+	}
+}
+
+static void putUint64(uint64_t value, uint8_t* buffer) {
+	for (int idx = 0; idx < 8; ++idx) {
+		buffer[idx] = (value >> (idx * 8)) & 0xff;
+	}
+}
+
+static uint32_t getUint32(const uint8_t* buffer) {
+	uint32_t value = 0;
+	for (int idx = 3; idx >= 0; --idx) {
+		value = (value << 8) | buffer[idx];
+	}
+	return value;
+}
+
+static uint64_t getUint64(const uint8_t* buffer) {
+	uint64_t value = 0;
+	for (int idx = 7; idx >= 0; --idx) {
+		value = (value << 8) | buffer[idx];
+	}
+	return value;
+}
+
+static bool writeAll(int fd, const uint8_t* buffer, size_t len) {
+	while (len > 0) {
+		ssize_t rc = ::write(fd, buffer, len);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			return false;
+		}
+		buffer += rc;
+		len -= rc;
+	}
+	return true;
+}
+
+static std::string directoryOf(const std::string& path) {
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos) {
+		return ".";
+	}
+	return slash ? path.substr(0, slash) : "/";
+}
+
+UpdateJournal::UpdateJournal(const std::string& path)
+	: path_(path),
+	  fd_(-1),
+	  committed_(false) {
+}
+
+UpdateJournal::~UpdateJournal() {
+	if (fd_ >= 0) {
+		::close(fd_);
+	}
+}
+
+bool UpdateJournal::open(const uint8_t* manifest_digest) {
+	uint8_t header[g_HeaderSize];
+
+	if (fd_ >= 0) {
+		::close(fd_);
+	}
+	progress_.clear();
+	committed_ = false;
+	fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd_ < 0) {
+		LOG(ERROR) << "Can not open " << path_ << " errno=" << errno;
+		return false;
+	}
+	if (load(manifest_digest)) {
+		LOG(INFO) << "Resuming the update, " << progress_.size()
+				<< " files in progress"
+				<< (committed_ ? ", all files complete" : "");
+		return true;
+	}
+	// Nothing to resume, start over.
+	progress_.clear();
+	committed_ = false;
+	putUint32(UPDATE_JOURNAL_MAGIC_NUMBER, header);
+	memcpy(header + 4, manifest_digest, JOURNAL_DIGEST_SIZE);
+	if (0 != ftruncate(fd_, 0) ||
+			0 != lseek(fd_, 0, SEEK_SET) ||
+			!writeAll(fd_, header, sizeof(header)) ||
+			0 != fdatasync(fd_)) {
+		LOG(ERROR) << "Can not write " << path_ << " errno=" << errno;
+		return false;
+	}
+	return FlashWriter::syncDirectory(directoryOf(path_));
+}
+
+// Reads the records up to the first torn one and drops the rest, so new
+// records follow the last good one.
+bool UpdateJournal::load(const uint8_t* manifest_digest) {
+	uint8_t header[g_HeaderSize];
+	uint8_t record[g_RecordSize];
+	off_t good = g_HeaderSize;
+
+	if (pread(fd_, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+			getUint32(header) != UPDATE_JOURNAL_MAGIC_NUMBER ||
+			0 != memcmp(header + 4, manifest_digest, JOURNAL_DIGEST_SIZE)) {
+		return false;
+	}
+	while (pread(fd_, record, sizeof(record), good) ==
+			(ssize_t)sizeof(record)) {
+		if (blockChecksum(record, g_RecordSize - 4) !=
+				getUint32(record + g_RecordSize - 4)) {
+			LOG(WARNING) << "Torn record in " << path_;
+			break;
+		}
+		uint32_t file = getUint32(record);
+		if (file == g_CommitRecord) {
+			committed_ = true;
+		} else {
+			Progress& progress = progress_[file];
+			progress.length_ = getUint64(record + 4);
+			memcpy(progress.digest_, record + 12, JOURNAL_DIGEST_SIZE);
+		}
+		good += g_RecordSize;
+	}
+	if (0 != ftruncate(fd_, good) || lseek(fd_, good, SEEK_SET) != good) {
+		LOG(ERROR) << "Can not trim " << path_ << " errno=" << errno;
+		return false;
+	}
+	return true;
+}
+
+bool UpdateJournal::progress(uint32_t file,
+		uint64_t* length,
+		uint8_t* digest) const {
+	auto it = progress_.find(file);
+
+	if (it == progress_.end()) {
+		return false;
+	}
+	*length = it->second.length_;
+	memcpy(digest, it->second.digest_, JOURNAL_DIGEST_SIZE);
+	return true;
+}
+
+bool UpdateJournal::append(uint32_t file,
+		uint64_t length,
+		const uint8_t* digest) {
+	uint8_t record[g_RecordSize];
+
+	if (fd_ < 0) {
+		return false;
+	}
+	putUint32(file, record);
+	putUint64(length, record + 4);
+	memcpy(record + 12, digest, JOURNAL_DIGEST_SIZE);
+	putUint32(blockChecksum(record, g_RecordSize - 4),
+			record + g_RecordSize - 4);
+	if (!writeAll(fd_, record, sizeof(record)) || 0 != fdatasync(fd_)) {
+		LOG(ERROR) << "Can not write " << path_ << " errno=" << errno;
+		return false;
+	}
+	return true;
+}
+
+bool UpdateJournal::record(uint32_t file,
+		uint64_t length,
+		const uint8_t* digest) {
+	Progress& progress = progress_[file];
+
+	progress.length_ = length;
+	memcpy(progress.digest_, digest, JOURNAL_DIGEST_SIZE);
+	return append(file, length, digest);
+}
+
+bool UpdateJournal::commit() {
+	uint8_t digest[JOURNAL_DIGEST_SIZE];
+
+	memset(digest, 0, sizeof(digest));
+	if (!append(g_CommitRecord, 0, digest)) {
+		return false;
+	}
+	committed_ = true;
+	return true;
+}
+
+void UpdateJournal::remove() {
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+	progress_.clear();
+	committed_ = false;
+	if (0 == unlink(path_.c_str())) {
+		FlashWriter::syncDirectory(directoryOf(path_));
+	}
+}
+
+} /* namespace iqurius */
@@ -23,6 +23,7 @@
 #include "DictionaryHelper.h"
 #include "FirmwareUpdater.h"
 #include "ObjectPath.h"
+#include "PromptCache.h"
 #include "SbcDecodeThread.h"
 #include "SbcMediaEndpoint.h"
 #include "SoundFragment.h"
@@ -43,6 +44,8 @@
 DEFINE_bool(autoconnect, true, "Connect to known devices automatically.");
 DEFINE_string(command_file, "/dev/ttyAMA0",
 		"File or FIFO where to read commands and write status to.");
+DEFINE_int32(latency_dump_period_ms, 0, "How often the per stage audio "
+		"latency histograms are written to the log, 0 to disable.");
 
 static const char* A2DP_UUID = "0000110a-0000-1000-8000-00805f9b34fb";
 
@@ -142,7 +145,8 @@ public:
 		  update_checker_token_(0),
 		  shutdown_(false),
 		  mixer_(2),
-		  sound_queue_(mixer_.getAudioChannel(1), mixer_.getAudioChannel(0)),
+		  sound_queue_(mixer_.getAudioChannel(1), mixer_.getAudioChannel(0),
+				  &prompt_cache_),
 		  command_parser_(FLAGS_command_file),
 		  phone_connected_(false) {
 	}
@@ -259,7 +263,8 @@ public:
 				adapter_->setDiscoverable(true);
 				//adapter_->setDiscoverableTimeout(3*60); // 3 minutes;
 				sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-						iqurius::SoundManager::SOUND_READY_TO_PAIR));
+						iqurius::SoundManager::SOUND_READY_TO_PAIR),
+						iqurius::SoundQueue::PRIORITY_LOW);
 			}
 			if (!adapter_->getPairable()) {
 				LOG(INFO) << "Set pairable.";
@@ -299,7 +304,7 @@ public:
 		if (sbc_media_endpoint_ &&
 			sbc_media_endpoint_->isTransportConfigValid() &&
 			(!playback_thread_ ||
-			 !playback_thread_->ok() ||
+			 !(playback_thread_->ok() || playback_thread_->isStarting()) ||
 			 playback_thread_->codecId() != dbus::PlaybackThread::E_SBC)) {
 			stopPlayback();
 			playback_thread_ = new dbus::SbcDecodeThread(&conn_,
@@ -307,7 +312,7 @@ public:
 					mixer_.getAudioChannel(0),
 					sbc_media_endpoint_->getSamplingRate());
 			playback_thread_->start();
-			LOG(INFO) << "Started SBC playback thread.";
+			LOG(INFO) << "Starting SBC playback thread.";
 			return;
 		}
 	}
@@ -442,22 +447,25 @@ public:
 		if (updater_.CheckUpdateAvailable()) {
 			command_parser_.sendStatus("@&FWUP\n");
 			sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-					iqurius::SoundManager::SOUND_PLEASE_DONT_TURH_THE_POWER));
+					iqurius::SoundManager::SOUND_PLEASE_DONT_TURH_THE_POWER),
+					iqurius::SoundQueue::PRIORITY_HIGH);
 			sound_queue_.waitQueueEmpty();
 			sound_queue_.autoReplay(true);
 			sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-					iqurius::SoundManager::SOUND_PREPARING_THE_UPDATE), 1, 1500000);
+					iqurius::SoundManager::SOUND_PREPARING_THE_UPDATE), 1, 1500000, -1,
+					iqurius::SoundQueue::PRIORITY_HIGH);
 			if (updater_.UpdateValid()) {
 				sound_queue_.waitQueueEmpty();
 				sound_queue_.autoReplay(true);
 				sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-						iqurius::SoundManager::SOUND_UPDATING));
+						iqurius::SoundManager::SOUND_UPDATING),
+						iqurius::SoundQueue::PRIORITY_HIGH);
 				if (updater_.Update()) {
-					updater_.SyncDisc();
 					shutdown_ = true;
 					sound_queue_.autoReplay(false);
 					sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-							iqurius::SoundManager::SOUND_UPDATE_COMPLETED));
+							iqurius::SoundManager::SOUND_UPDATE_COMPLETED),
+							iqurius::SoundQueue::PRIORITY_HIGH);
 					sound_queue_.waitQueueEmpty();
 				} else {
 					command_parser_.sendStatus("@&PING\n");
@@ -537,6 +545,15 @@ public:
 		command_parser_.sendStatus("@&PING\n");
 	}
 
+	void dumpLatency() {
+		mixer_.getAudioChannel(0)->getLatencyTrace()->dump("Playback");
+		mixer_.getAudioChannel(1)->getLatencyTrace()->dump("Prompts");
+		if (sound_queue_.getScheduleLatency().count()) {
+			LOG(INFO) << "Prompts latency schedule to audible: "
+					<< sound_queue_.getScheduleLatency().toString();
+		}
+	}
+
 	void tryReconnect() {
 		MyAudioSource* connected_source = sourceConnected();
 		if (NULL == connected_source && !audio_sources_.empty()) {
@@ -555,10 +572,13 @@ public:
 	void checkForUpdates() {
 		if (updater_.CheckUpdateAvailable()) {
 			LOG(INFO) << "Found firmware update";
-			sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-					iqurius::SoundManager::SOUND_UPDATE_IS_AVAILABLE));
-			sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-					iqurius::SoundManager::SOUND_ENTER_CODE_522));
+			sound_queue_.scheduleSequence({
+					sound_manager_.getSoundPath(
+						iqurius::SoundManager::SOUND_UPDATE_IS_AVAILABLE),
+					sound_manager_.getSoundPath(
+						iqurius::SoundManager::SOUND_ENTER_CODE_522) },
+					UPDATE_PROMPT_PAUSE_MS,
+					iqurius::SoundQueue::PRIORITY_LOW);
 		}
 	}
 
@@ -607,7 +627,8 @@ public:
 		dbus::ObjectPath adapter_path;
 		if (!getAdapterPath("", &adapter_path)) {
 			sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-					iqurius::SoundManager::SOUND_UNABLE_TO_CONNECT_TO_BLUETOOTH_ADAPTER));
+					iqurius::SoundManager::SOUND_UNABLE_TO_CONNECT_TO_BLUETOOTH_ADAPTER),
+					iqurius::SoundQueue::PRIORITY_HIGH);
 			return;
 		}
 		adapter_ = new dbus::BluezAdapter(&conn_, adapter_path);
@@ -641,7 +662,8 @@ public:
 			conn_.removeObject(adapter_);
 			adapter_ = NULL;
 			sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-					iqurius::SoundManager::SOUND_UNABLE_TO_CONNECT_TO_BLUETOOTH_ADAPTER));
+					iqurius::SoundManager::SOUND_UNABLE_TO_CONNECT_TO_BLUETOOTH_ADAPTER),
+					iqurius::SoundQueue::PRIORITY_HIGH);
 			return;
 		}
 
@@ -665,8 +687,14 @@ public:
 	void mainLoop() {
 		uint32_t ping_proc_token;
 		uint32_t discoverable_proc_token;
+		uint32_t latency_dump_token = 0;
 
 		mixer_.start();
+		prompt_cache_.setBundle(sound_manager_.getBundle());
+		for (const auto& element : sound_manager_.getSoundEncodings()) {
+			prompt_cache_.setEncoding(element.first, element.second);
+		}
+		prompt_cache_.startPreload(sound_manager_.getSoundPaths());
 		sound_queue_.start();
 		command_parser_.setCommandCllaback(
 				googleapis::NewPermanentCallback(this,
@@ -683,6 +711,13 @@ public:
 		iqurius::PostTimerCallback(1000, googleapis::NewPermanentCallback(this,
 							&Application::updateScreenData));
 
+		if (FLAGS_latency_dump_period_ms > 0) {
+			latency_dump_token = iqurius::PostTimerCallback(
+					FLAGS_latency_dump_period_ms,
+				googleapis::NewPermanentCallback(this,
+					&Application::dumpLatency));
+		}
+
 		connectToBluetoothAdapter();
 
 		discoverable_proc_token = iqurius::PostTimerCallback(
@@ -704,12 +739,16 @@ public:
 		}
 
 		sound_queue_.scheduleFragment(sound_manager_.getSoundPath(
-				iqurius::SoundManager::SOUND_RESTARTING));
+				iqurius::SoundManager::SOUND_RESTARTING),
+				iqurius::SoundQueue::PRIORITY_HIGH);
 
 		removeReconnect();
 		removeUpdateChecker();
 		iqurius::RemoveTimerCallback(ping_proc_token);
 		iqurius::RemoveTimerCallback(discoverable_proc_token);
+		if (latency_dump_token) {
+			iqurius::RemoveTimerCallback(latency_dump_token);
+		}
 
 		sound_queue_.waitQueueEmpty();
 		mixer_.getAudioChannel(1)->waitForIdle();
@@ -721,9 +760,9 @@ public:
 		if (rc) {
 		    LOG(ERROR) << "halt returned " << rc;
 		}
+		updater_.SyncDisc();
 		uint32_t timer = timeGetTime();
 		while (elapsedTime(timer) < SHUTDOWN_TIMEOUT) {
-			updater_.SyncDisc();
 			iqurius::ProcessDelayedCalls();
 			conn_.process(100); // 100ms timeout
 		}
@@ -748,6 +787,7 @@ public:
 		}
 		iqurius::DeletePendingCalls();
 		sound_queue_.stop();
+		prompt_cache_.stopPreload();
 		mixer_.stop();
 	}
 private:
@@ -761,6 +801,7 @@ private:
 	static const uint32_t UPDATE_CHECK_TIMEOUT = 60000;
 	static const uint32_t SHUTDOWN_TIMEOUT = 5000;
 	static const uint32_t PLAYBACK_CHECK_TIME = 5000;
+	static const uint32_t UPDATE_PROMPT_PAUSE_MS = 300;
 
 	dbus::Connection conn_;
 	dbus::BluezAdapter* adapter_;
@@ -773,8 +814,9 @@ private:
 	bool shutdown_;
 	iqurius::FirmwareUpdater updater_;
 	iqurius::AudioMixer mixer_;
-	iqurius::SoundQueue sound_queue_;
 	iqurius::SoundManager sound_manager_;
+	iqurius::PromptCache prompt_cache_;
+	iqurius::SoundQueue sound_queue_;
 	std::list<MyAudioSource*> audio_sources_;
 	CommandParser command_parser_;
 	bool phone_connected_;
@@ -0,0 +1,195 @@
+/*
+ * mkprompts.cpp
+ *
+ *  Created on: Jun 6, 2015
+ *      Author: Venelin Efremov
+ *
+ * Copyright (C) Venelin Efremov 2015
+ * All rights reserved.
+ */
+
+#include "MixKernels.h"
+#include "PcmConvert.h"
+#include "PromptBundle.h"
+#include "time_util.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string>
+#include <vector>
+
+DEFINE_string(input_dir, ".", "Directory with the Ogg prompts.");
+DEFINE_string(output_path, "prompts.bin", "Output filename.");
+DEFINE_int32(sample_rate, 44100, "Sample rate of the bundled prompts, "
+		"lower rates are stored as mono.");
+DEFINE_bool(benchmark, false, "Instead of writing a bundle, log the memory "
+		"and the mixing CPU cost of each prompt in every in-memory format.");
+DEFINE_int32(benchmark_runs, 20, "Times each prompt is mixed when "
+		"benchmarking.");
+
+using gflags::ParseCommandLineFlags;
+using gflags::SetUsageMessage;
+using google::InitGoogleLogging;
+using iqurius::PromptBundleWriter;
+using iqurius::SampleEncoding;
+using iqurius::decodeVorbisFile;
+using iqurius::normalizePcm;
+using std::string;
+
+static bool addPrompt(const string& path, PromptBundleWriter* writer) {
+  std::vector<int16_t> pcm;
+  uint8_t channels;
+  uint32_t sample_rate;
+
+  if (FLAGS_sample_rate < 8000 || FLAGS_sample_rate > 44100) {
+	LOG(ERROR) << "Unsupported sample rate " << FLAGS_sample_rate;
+	return false;
+  }
+  if (!decodeVorbisFile(path.c_str(), &pcm, &channels, &sample_rate) ||
+	  !normalizePcm(&pcm, &channels, &sample_rate, FLAGS_sample_rate,
+			  FLAGS_sample_rate != 44100)) {
+	return false;
+  }
+  size_t name_pos = path.find_last_of('/');
+  string name = name_pos == string::npos ? path : path.substr(name_pos + 1);
+  LOG(INFO) << "Adding " << path << " as " << name << ", " << pcm.size() * 2
+		  << " bytes";
+  return writer->addPrompt(name.c_str(),
+		  reinterpret_cast<const uint8_t*>(pcm.data()), pcm.size() * 2,
+		  channels, sample_rate);
+}
+
+// Output rate and block size of the mixer.
+static constexpr uint32_t MIX_SAMPLE_RATE = 44100;
+static constexpr size_t MIX_BLOCK_FRAMES = 882;
+
+struct BenchmarkFormat {
+	const char* name;
+	uint32_t sample_rate;
+	SampleEncoding encoding;
+};
+
+static const BenchmarkFormat g_BenchmarkFormats[] = {
+	{ "pcm/44100", 44100, iqurius::ENCODING_PCM_S16 },
+	{ "pcm/22050", 22050, iqurius::ENCODING_PCM_S16 },
+	{ "pcm/16000", 16000, iqurius::ENCODING_PCM_S16 },
+	{ "adpcm/44100", 44100, iqurius::ENCODING_IMA_ADPCM },
+	{ "adpcm/22050", 22050, iqurius::ENCODING_IMA_ADPCM },
+	{ "adpcm/16000", 16000, iqurius::ENCODING_IMA_ADPCM },
+};
+
+// Mixes the samples the way AudioMixer::mixChannel does, one mixer block
+// at a time. The output is discarded.
+static void mixPrompt(const int16_t* samples,
+		size_t num_frames,
+		uint8_t channels,
+		uint32_t sample_rate,
+		int32_t* accumulator,
+		uint32_t* phase,
+		int16_t* prev_sample,
+		int16_t* next_sample) {
+  const uint32_t step = ((uint64_t)sample_rate << 16) / MIX_SAMPLE_RATE;
+  size_t pos = 0;
+
+  while (pos < num_frames) {
+	size_t frames = MIX_BLOCK_FRAMES;
+	if (sample_rate != MIX_SAMPLE_RATE) {
+	  pos += iqurius::mixUpsampledSamples(accumulator, samples + pos,
+			  num_frames - pos, &frames, step, phase, prev_sample,
+			  next_sample, 0x100);
+	  continue;
+	}
+	if (frames > num_frames - pos) {
+	  frames = num_frames - pos;
+	}
+	if (channels == 1) {
+	  iqurius::mixMonoSamples(accumulator, samples + pos, frames, 0x100);
+	} else {
+	  iqurius::mixSamples(accumulator, samples + pos * 2, frames * 2, 0x100);
+	}
+	pos += frames;
+  }
+}
+
+static bool benchmarkPrompt(const string& path) {
+  std::vector<int16_t> pcm;
+  uint8_t channels;
+  uint32_t sample_rate;
+  std::vector<int32_t> accumulator(MIX_BLOCK_FRAMES * 2);
+
+  if (!decodeVorbisFile(path.c_str(), &pcm, &channels, &sample_rate)) {
+	return false;
+  }
+  for (const BenchmarkFormat& format : g_BenchmarkFormats) {
+	std::vector<int16_t> samples(pcm);
+	uint8_t format_channels = channels;
+	uint32_t format_rate = sample_rate;
+	const bool adpcm = format.encoding == iqurius::ENCODING_IMA_ADPCM;
+	if (!normalizePcm(&samples, &format_channels, &format_rate,
+			format.sample_rate,
+			adpcm || format.sample_rate != MIX_SAMPLE_RATE)) {
+	  return false;
+	}
+	std::vector<uint8_t> blocks;
+	size_t bytes = samples.size() * 2;
+	if (adpcm) {
+	  iqurius::imaAdpcmEncode(samples.data(), samples.size(), &blocks);
+	  bytes = blocks.size();
+	}
+	const size_t num_frames = samples.size() / format_channels;
+	int16_t decoded[iqurius::IMA_ADPCM_BLOCK_SAMPLES];
+	uint64_t start_us = timeGetTimeUs();
+	for (int32_t run = 0; run < FLAGS_benchmark_runs; ++run) {
+	  uint32_t phase = 0x10000;
+	  int16_t prev_sample = 0;
+	  int16_t next_sample = 0;
+	  if (!adpcm) {
+		mixPrompt(samples.data(), num_frames, format_channels, format_rate,
+				accumulator.data(), &phase, &prev_sample, &next_sample);
+		continue;
+	  }
+	  for (size_t offset = 0; offset < blocks.size();
+		   offset += iqurius::IMA_ADPCM_BLOCK_BYTES) {
+		size_t decoded_len = iqurius::imaAdpcmDecodeBlock(
+				blocks.data() + offset, decoded);
+		mixPrompt(decoded, decoded_len, 1, format_rate,
+				accumulator.data(), &phase, &prev_sample, &next_sample);
+	  }
+	}
+	uint64_t elapsed_us = timeGetTimeUs() - start_us;
+	double audio_sec = (double)num_frames / format_rate * FLAGS_benchmark_runs;
+	LOG(INFO) << path << " " << format.name << ": " << bytes / 1024
+			<< "KB, " << (audio_sec > 0 ? elapsed_us / audio_sec : 0)
+			<< "us CPU per second of audio";
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+	SetUsageMessage("Decode Ogg voice prompts into a PCM bundle.\n"
+			"Usage: mkprompts [--input_dir=DIR] [--output_path=FILE] "
+			"[--benchmark] prompt.ogg...");
+	ParseCommandLineFlags(&argc, &argv, true);
+	InitGoogleLogging(argv[0]);
+	PromptBundleWriter writer;
+	for (int idx = 1; idx < argc; ++idx) {
+		string path(argv[idx]);
+		if (path[0] != '/') {
+			path = FLAGS_input_dir + "/" + path;
+		}
+		if (FLAGS_benchmark) {
+			if (!benchmarkPrompt(path)) {
+				return 1;
+			}
+		} else if (!addPrompt(path, &writer)) {
+			return 1;
+		}
+	}
+	if (FLAGS_benchmark) {
+		return 0;
+	}
+	if (!writer.writeBundle(FLAGS_output_path.c_str())) {
+		return 1;
+	}
+	return 0;
+}
@@ -8,7 +8,9 @@
  * All rights reserved.
  */
 
+#include "BlockCodec.h"
 #include "FirmwareContainer.h"
+#include "time_util.h"
 
 #include <dirent.h>
 #include <gflags/gflags.h>
@@ -16,13 +18,44 @@
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 DEFINE_string(update_version, "", "Version string for this update package.");
 DEFINE_string(output_path, "iqjs.fwu", "Output filename.");
+DEFINE_int32(threads, 0, "Number of compression threads, 0 uses one per CPU.");
+DEFINE_int32(container_version, 1,
+		"Container format to write. Version 2 adds a block index and per "
+		"block checksums but needs a device that already reads it.");
+DEFINE_bool(verify, false, "Read the container back and verify every file.");
+DEFINE_string(delta_base, "",
+		"Directory holding the currently installed files, laid out like the "
+		"flash partition. Blocks that match them are not shipped. Needs "
+		"--container_version=2.");
+DEFINE_bool(delta_xor, true,
+		"Ship changed blocks of a delta update as the compressed XOR with "
+		"the installed block when that is smaller.");
+DEFINE_string(codec_policy, "lzo",
+		"How the codec of each block is picked: lzo, lz4 or zstd for one "
+		"codec, ratio for the smallest result, decode for the codec that "
+		"decodes fastest on the device, store to compress nothing. "
+		"Blocks that do not shrink are always stored. Anything but lzo "
+		"needs --container_version=2.");
+DEFINE_string(bench, "",
+		"Compress this file, e.g. a SYSTEM image, with every codec built in "
+		"and report the ratio and the compression and decompression "
+		"speeds instead of writing a container. Run it on the device for "
+		"device decoding speeds.");
+DEFINE_int32(bench_rounds, 3,
+		"Times every block is decoded in --bench, the fastest one counts.");
 
 using gflags::ParseCommandLineFlags;
 using gflags::SetUsageMessage;
 using google::InitGoogleLogging;
+using iqurius::BlockCodec;
+using iqurius::CodecPolicy;
+using iqurius::FirmwareContainerReader;
 using iqurius::FirmwareContainerWriter;
 using std::string;
 
@@ -47,6 +80,107 @@ void addFolder(const string& path,
       writer->addFile(src_path.c_str(), dest_path.c_str(), false);
   }
 }
+// Decoding is timed block by block right after the block is compressed,
+// so images larger than the memory of the device can be measured.
+static bool runBench(const string& path) {
+	static const BlockCodec codecs[] = {
+		iqurius::CODEC_STORED, iqurius::CODEC_LZO1X,
+		iqurius::CODEC_LZ4, iqurius::CODEC_ZSTD,
+	};
+	static const size_t block_size = 1024 * 1024;
+	struct Result {
+		uint64_t stored_;
+		uint64_t compress_us_;
+		uint64_t decompress_us_;
+	} results[iqurius::CODEC_COUNT];
+	uint8_t* input = new uint8_t[block_size];
+	uint8_t* output = new uint8_t[iqurius::compressedBound(block_size)];
+	uint8_t* decoded = new uint8_t[block_size];
+	uint8_t* work_memory = new uint8_t[iqurius::compressWorkMemory()];
+	uint64_t total = 0;
+	size_t len;
+	bool result = false;
+	FILE* file = fopen(path.c_str(), "rb");
+
+	memset(results, 0, sizeof(results));
+	if (NULL == file) {
+		LOG(ERROR) << "Can not open " << path;
+		goto exit;
+	}
+	while ((len = fread(input, 1, block_size, file)) > 0) {
+		total += len;
+		for (BlockCodec codec : codecs) {
+			Result& r = results[codec];
+			size_t output_len = iqurius::compressedBound(block_size);
+			uint64_t start_time;
+			uint64_t best_us;
+
+			if (!iqurius::codecAvailable(codec)) {
+				continue;
+			}
+			start_time = timeGetTimeUs();
+			if (codec == iqurius::CODEC_STORED) {
+				memcpy(output, input, len);
+				output_len = len;
+			} else if (!iqurius::compressBlock(codec, input, len,
+					output, &output_len, work_memory)) {
+				goto exit;
+			}
+			r.compress_us_ += timeGetTimeUs() - start_time;
+			r.stored_ += output_len;
+			best_us = 0;
+			for (int round = 0; round == 0 || round < FLAGS_bench_rounds;
+					++round) {
+				uint64_t elapsed_us;
+				start_time = timeGetTimeUs();
+				if (!iqurius::decompressBlock(codec, output, output_len,
+						decoded, len)) {
+					goto exit;
+				}
+				elapsed_us = timeGetTimeUs() - start_time;
+				if (round == 0 || elapsed_us < best_us) {
+					best_us = elapsed_us;
+				}
+			}
+			r.decompress_us_ += best_us;
+			if (0 != memcmp(input, decoded, len)) {
+				LOG(ERROR) << iqurius::codecName(codec) << " does not round trip";
+				goto exit;
+			}
+		}
+	}
+	printf("%-8s %10s %7s %12s %12s\n", "codec", "bytes", "ratio",
+			"comp MB/s", "decomp MB/s");
+	for (BlockCodec codec : codecs) {
+		const Result& r = results[codec];
+		if (!iqurius::codecAvailable(codec)) {
+			continue;
+		}
+		printf("%-8s %10llu %6.1f%% %12.1f %12.1f\n",
+				iqurius::codecName(codec),
+				(unsigned long long)r.stored_,
+				total ? 100.0 * r.stored_ / total : 0.0,
+				r.compress_us_ ? (double)total / r.compress_us_ : 0.0,
+				r.decompress_us_ ? (double)total / r.decompress_us_ : 0.0);
+	}
+	result = true;
+exit:
+	if (file) fclose(file);
+	delete [] work_memory;
+	delete [] decoded;
+	delete [] output;
+	delete [] input;
+	return result;
+}
+
+static size_t threadCount() {
+	if (FLAGS_threads > 0) {
+		return FLAGS_threads;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
 int main(int argc, char *argv[]) {
 	SetUsageMessage("Create a firmware update container file");
 	ParseCommandLineFlags(&argc, &argv, true);
@@ -55,11 +189,38 @@ int main(int argc, char *argv[]) {
 		LOG(ERROR) << "Error initializing the LZO library";
 		return 1;
 	}
+	if (!FLAGS_bench.empty()) {
+		return runBench(FLAGS_bench) ? 0 : 1;
+	}
+	CodecPolicy policy;
+	if (!iqurius::parseCodecPolicy(FLAGS_codec_policy.c_str(), &policy)) {
+		return 1;
+	}
 	FirmwareContainerWriter writer(FLAGS_update_version.c_str());
+	writer.setThreads(threadCount());
+	writer.setFormatVersion(FLAGS_container_version);
+	writer.setCodecPolicy(policy);
+	if (!FLAGS_delta_base.empty()) {
+		writer.setDeltaBase(FLAGS_delta_base.c_str(), FLAGS_delta_xor);
+	}
 	writer.addFile("target/KERNEL", "kernel.img", false);
 	writer.addFile("target/SYSTEM", "SYSTEM", false);
 	addFolder("3rdparty/bootloader", "", &writer);
 	addFolder("3rdparty/bootloader/overlays", "overlays/", &writer);
-	writer.writeContainer(FLAGS_output_path.c_str());
+	if (!writer.writeContainer(FLAGS_output_path.c_str())) {
+		LOG(ERROR) << "Failed to write " << FLAGS_output_path;
+		return 1;
+	}
+	if (FLAGS_verify) {
+		FirmwareContainerReader reader(FLAGS_output_path.c_str());
+		reader.setThreads(threadCount());
+		if (!reader.loadManifest() ||
+				!reader.verifyFiles(FLAGS_delta_base.c_str(),
+						FLAGS_delta_base.c_str())) {
+			LOG(ERROR) << "Verification of " << FLAGS_output_path << " failed";
+			return 1;
+		}
+		LOG(INFO) << FLAGS_output_path << " verified";
+	}
 	return 0;
 }
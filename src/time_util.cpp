@@ -26,3 +26,10 @@ uint32_t timeGetTime() {
 uint32_t elapsedTime(uint32_t time) {
 	return timeGetTime() - time;
 }
+
+uint64_t timeGetTimeUs() {
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}